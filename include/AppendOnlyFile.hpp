@@ -0,0 +1,42 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// The append-only file: an RDB image of the keyspace as of the moment the file was
+// created, followed by every write command run since, in RESP form.
+//
+// Threads running write commands only append them to an in-memory buffer. One writer
+// thread moves whatever has accumulated to the file with a single write, and under
+// appendfsync always a single fdatasync, so concurrent clients share each sync (group
+// commit). Connections then wait for their own commands to be durable before their
+// replies are flushed, while the store locks are already released.
+class AppendOnlyFile {
+public:
+    enum class FsyncPolicy { Always, EverySec, No };
+    using Run = std::function<void(const std::string& name, const std::vector<std::string>& args)>;
+
+    static bool parsePolicy(const std::string& text, FsyncPolicy& out);
+
+    // Loads path into the keyspace: the RDB preamble, then each command through run. A
+    // command or MULTI/EXEC block cut short by a crash is dropped and the file truncated
+    // before it. Returns false if the file is corrupt.
+    static bool load(const std::string& path, const Run& run);
+
+    // Starts appending to path, first writing the current keyspace as the preamble if the
+    // file does not exist yet, and starts the writer thread.
+    static bool open(const std::string& path, FsyncPolicy policy);
+    static bool enabled();
+
+    // Appends commands, each name first, as one contiguous run. Callers hold the stores they
+    // wrote to, so commands are logged in the order they were applied. No-op while the AOF
+    // is off.
+    static void append(const std::vector<std::vector<std::string>>& commands);
+    // Under appendfsync always, blocks until everything the calling thread appended is on
+    // disk; otherwise returns at once.
+    static void waitUntilDurable();
+
+private:
+    static void writerLoop();
+};
@@ -0,0 +1,61 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Output side of every client connection. Any thread may queue replies or messages for a
+// client, but only the connection's own thread writes them to its socket, with
+// non-blocking sends, so no thread ever waits on another client's socket.
+//
+// Queued output is bounded per client class, as with Redis' client-output-buffer-limit:
+// a client whose queue passes the hard limit, or stays above the soft limit for
+// soft_seconds, is disconnected.
+class ClientOutput {
+public:
+    using Buffer = std::shared_ptr<const std::string>;
+    // Unique per connection for the life of the process, unlike descriptors, which the
+    // kernel reuses. Zero means not registered.
+    using ClientId = uint64_t;
+
+    enum class ClientClass { Normal, PubSub, Replica };
+    static constexpr size_t CLIENT_CLASS_COUNT = 3;
+
+    // A zero limit disables that check.
+    struct Limit {
+        size_t hard = 0;
+        size_t soft = 0;
+        int64_t soft_seconds = 0;
+    };
+
+    static void setLimit(ClientClass cls, Limit limit);
+    // Parses "<class> <hard> <soft> <soft-seconds>" as in redis.conf; sizes accept kb/mb/gb.
+    static bool parseLimit(const std::string& spec);
+    static void setClass(int fd, ClientClass cls);
+
+    static size_t connectedClients();
+    static uint64_t disconnections(ClientClass cls);
+
+    // Called by the connection thread, which becomes the only writer of the socket.
+    static void registerClient(int fd);
+    static void unregisterClient(int fd);
+    static ClientId clientId(int fd);
+    // Readable whenever another thread has queued output for the client.
+    static int wakeFd(int fd);
+
+    // Output for a descriptor that is not registered (such as the link to our master)
+    // is written synchronously instead.
+    static void send(int fd, std::string_view data);
+    static void send(int fd, Buffer data);
+    // Queues the same buffer for every client in ids that is still registered.
+    static void broadcast(const std::vector<ClientId>& ids, const Buffer& data);
+    // Runs fn and returns what the calling thread sent to fd meanwhile, instead of queueing
+    // it. Collections nest.
+    static std::string collect(int fd, const std::function<void()>& fn);
+
+    // Writes as much queued output as the socket accepts. Returns false if the connection failed.
+    static bool flush(int fd);
+    static bool hasPending(int fd);
+};
@@ -0,0 +1,27 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "GeoEncoding.hpp"
+
+// Candidate positions in structure-of-arrays form, in degrees.
+struct GeoPoints {
+    std::vector<double> latitude;
+    std::vector<double> longitude;
+};
+
+double geo_distance(double lat1, double lon1, double lat2, double lon2);
+
+void decode_to_points(const std::vector<uint64_t>& geo_codes, GeoPoints& out);
+
+// Appends the index and distance of every point within radius_m of the center. Points outside
+// the circle's bounding box are dropped before any trigonometry; the rest go through a SIMD
+// haversine kernel chosen at runtime (AVX-512, AVX2 or scalar).
+void filter_by_radius(double center_lat, double center_lon, double radius_m, const GeoPoints& points,
+                      std::vector<uint32_t>& indices, std::vector<double>& distances);
+
+// Same as filter_by_radius for an axis-aligned box of width_m x height_m centred on the point.
+void filter_by_box(double center_lat, double center_lon, double width_m, double height_m, const GeoPoints& points,
+                   std::vector<uint32_t>& indices, std::vector<double>& distances);
+
+// Lower bound on the distance from the point to anything inside the cell.
+double min_distance_to_cell(double latitude, double longitude, const GeoCell& cell);
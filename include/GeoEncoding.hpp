@@ -1,5 +1,7 @@
 #pragma once
 #include <cstdint>
+#include <cstddef>
+#include <vector>
 
 constexpr double MIN_LATITUDE = -85.05112878;
 constexpr double MAX_LATITUDE = 85.05112878;
@@ -9,10 +11,37 @@ constexpr double MAX_LONGITUDE = 180.0;
 constexpr double LATITUDE_RANGE = MAX_LATITUDE - MIN_LATITUDE;
 constexpr double LONGITUDE_RANGE = MAX_LONGITUDE - MIN_LONGITUDE;
 
+constexpr double EARTH_RADIUS_IN_METERS = 6372797.560856;
+constexpr int GEO_STEP_MAX = 26;
+constexpr double GEO_SCALE = static_cast<double>(1 << GEO_STEP_MAX);
+
 struct Coordinates {
     double latitude;
     double longitude;
 };
 
+// Half-open range [min, max) of 52-bit scores belonging to one geohash cell.
+struct GeoScoreRange {
+    uint64_t min;
+    uint64_t max;
+};
+
+struct GeoCell {
+    GeoScoreRange range;
+    double min_latitude;
+    double max_latitude;
+    double min_longitude;
+    double max_longitude;
+};
+
 uint64_t encode(double latitude, double longitude);
 Coordinates decode(uint64_t geo_code);
+
+// Array forms of encode/decode. They use BMI2 PDEP/PEXT when the CPU has fast support for
+// them and the portable bit ladders otherwise.
+void encode_batch(const double* latitudes, const double* longitudes, size_t n, uint64_t* out);
+void decode_batch(const uint64_t* geo_codes, size_t n, double* latitudes, double* longitudes);
+
+// The cell containing the point plus its 8 neighbours (without duplicates), at the finest
+// precision whose cells still cover a box of the given half-extents around the point.
+std::vector<GeoCell> covering_cells(double latitude, double longitude, double half_height_m, double half_width_m);
@@ -8,6 +8,7 @@ public:
     explicit GeoHandler(SortedSetHandler* ssHandler);
 
     bool isGeoCommand(const std::string& cmd);
+    bool isWriteCommand(const std::string& cmd);
     void handleCommand(const std::string& cmd, const std::vector<std::string>& args);
 
 private:
@@ -17,5 +18,6 @@ private:
     void handleGeoPos(const std::vector<std::string>& args);
     void handleGeoDis(const std::vector<std::string>& args);
     void handleGeoSearch(const std::vector<std::string>& args);
-    double haversine(double lat1, double lon1, double lat2, double lon2);
+    void handleGeoSearchStore(const std::vector<std::string>& args);
+    void runGeoSearch(const std::string& cmd, const std::vector<std::string>& args, bool store);
 };
@@ -7,10 +7,12 @@
 #include "ReplicationManager.hpp"
 #include "Rdb.hpp"
 #include "Parser.hpp"
-#include "RdbReader.hpp"
 #include "PubSubHandler.hpp"
 #include "SortedSetHandler.hpp"
 #include "GeoHandler.hpp"
+#include "StoreLock.hpp"
+#include "ScriptingHandler.hpp"
+#include "Propagation.hpp"
 
 class Handler {
     int client_fd;
@@ -19,24 +21,42 @@ class Handler {
     std::string rdb_dir;
     std::string rdb_filename;
 
-    RdbReader rdbReader;
     KvStoreHandler kvHandler;
     ListStoreHandler listHandler;
     StreamStoreHandler streamHandler;
     PubSubHandler pubSubHandler;
     SortedSetHandler sortedSetHandler;
     GeoHandler geoHandler;
+    ScriptingHandler scriptingHandler;
     ReplicationManager* replManager = nullptr;
 
     std::vector<std::pair<std::string, std::vector<std::string>>> queued_commands;
+    // Keys under WATCH with the version each had when it was watched.
+    std::vector<std::pair<std::string, uint64_t>> watched_keys;
+    // While a transaction or script runs, what its writes propagate is collected here and
+    // logged as one MULTI/EXEC when the outermost one ends.
+    int propagation_depth = 0;
+    std::vector<Propagation::Command> batched_propagation;
 
 public:
     Handler(int client_fd, bool replica, ReplicationManager* rm = nullptr, const std::string& dir = "./", const std::string& filename = "dump.rdb");
+    ~Handler();
 
     void handleMessage(const std::string& message);
     void handleTypeCommand(const std::vector<std::string>& args);
     void executeCommand(const std::string& name, const std::vector<std::string>& args);
     void executeQueuedCommand(const std::string& cmd, const std::vector<std::string>& args);
-    void propagateIfWrite(const std::string& name, const std::vector<std::string>& args);
+    void runCommand(const std::string& name, const std::vector<std::string>& args);
+    bool isWriteCommand(const std::string& name);
+    void propagate(std::vector<Propagation::Command> commands);
+    void beginPropagationBatch();
+    void endPropagationBatch();
     void sendResponse(const std::string& response);
+    void unwatchAll();
+    bool watchedKeysChanged() const;
+    void execTransaction();
+    void runScriptCommand(const std::string& name, const std::vector<std::string>& args);
+    void addStoresFor(const std::string& name, std::vector<std::mutex*>& stores);
+    bool runFromScript(const std::string& name, const std::vector<std::string>& args, bool& wrote);
+    static std::vector<std::mutex*> allStores();
 };
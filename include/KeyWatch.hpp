@@ -0,0 +1,18 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+// Modification versions for WATCHed keys. Only keys with at least one watcher are tracked,
+// and touch() returns after a single atomic load while nothing is watched, so writes to
+// unwatched keys stay cheap.
+//
+// Write handlers call touch() while still holding their store lock, so a watcher can never
+// observe a new value without also observing the new version.
+class KeyWatch {
+public:
+    // Starts watching key and returns its current version.
+    static uint64_t watch(const std::string& key);
+    static void unwatch(const std::string& key);
+    static uint64_t version(const std::string& key);
+    static void touch(const std::string& key);
+};
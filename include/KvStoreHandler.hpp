@@ -6,26 +6,39 @@
 #include <mutex>
 #include <chrono>
 
-class RdbReader;
+class RdbWriter;
 
 struct ValueWithExpiry {
     std::string value;
     std::optional<std::chrono::steady_clock::time_point> expiry;
 };
 
+struct RestoredString {
+    std::string key;
+    std::string value;
+    std::optional<int64_t> expire_ms;
+};
+
 class KvStoreHandler {
 public:
-    explicit KvStoreHandler(int client_fd, RdbReader* rdbReader);
+    explicit KvStoreHandler(int client_fd);
 
     bool isKvCommand(const std::string& cmd);
     bool isWriteCommand(const std::string& cmd);
     void handleCommand(const std::string& cmd, const std::vector<std::string>& args);
     bool hasKey(const std::string& key);
     std::string typeName() const { return "string"; }
+    static std::mutex& storeMutex() { return store_mutex; }
+    // Writes every key to out; the caller holds store_mutex.
+    static void saveTo(RdbWriter& out);
+    // Inserts keys read from a dump under one lock; expire_ms is unix time. Keys that have
+    // already expired are dropped. Returns how many were inserted.
+    static size_t restore(std::vector<RestoredString>& batch);
+    // Sizes the table for a dump's key count before loading it.
+    static void reserve(size_t keys);
 
 private:
     int client_fd;
-    RdbReader* rdbReader;
 
     void handleSet(const std::vector<std::string>& args);
     void handleGet(const std::vector<std::string>& args);
@@ -5,6 +5,8 @@
 #include <mutex>
 #include <condition_variable>
 
+class RdbWriter;
+
 class ListStoreHandler {
 public:
     explicit ListStoreHandler(int client_fd);
@@ -14,6 +16,11 @@ public:
     void handleCommand(const std::string& cmd, const std::vector<std::string>& args);
     bool hasKey(const std::string& key);
     std::string typeName() const { return "list"; }
+    static std::mutex& storeMutex() { return store_mutex; }
+    // Writes every key to out; the caller holds store_mutex.
+    static void saveTo(RdbWriter& out);
+    // Inserts lists read from a dump under one lock. Returns how many were inserted.
+    static size_t restore(std::vector<std::pair<std::string, std::vector<std::string>>>& batch);
 
 private:
     int client_fd;
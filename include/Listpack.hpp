@@ -0,0 +1,48 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Builds a listpack, the compact encoding Redis uses inside RDB files for small
+// collections and for stream nodes. Each element is written with the smallest encoding
+// that fits and followed by its back-length, so the result can be walked both ways.
+class ListpackWriter {
+public:
+    void appendInteger(int64_t value);
+    void appendString(std::string_view value);
+
+    size_t size() const { return count; }
+    // Returns the finished listpack, header and terminator included.
+    std::string finish();
+
+private:
+    std::string elements;
+    size_t count = 0;
+
+    void appendBacklen(size_t length);
+};
+
+// Walks a listpack front to back, as written by ListpackWriter or by Redis. Throws
+// std::runtime_error on malformed input.
+class ListpackReader {
+public:
+    // Integers are returned as numbers; strings as views into the listpack.
+    struct Element {
+        bool is_integer = false;
+        int64_t integer = 0;
+        std::string_view string;
+
+        std::string text() const;
+    };
+
+    explicit ListpackReader(std::string_view listpack);
+
+    // Returns false at the terminator.
+    bool next(Element& out);
+    // Reads the next element, which must exist and be an integer.
+    int64_t nextInteger();
+
+private:
+    std::string_view data;
+    size_t pos = 6;
+};
@@ -0,0 +1,14 @@
+#pragma once
+#include <cstddef>
+#include <string_view>
+
+// LZF, the compression RDB files use for long strings. The format is liblzf's: literal
+// runs of up to 32 bytes and back references of 3 to 264 bytes within the last 8KB.
+
+// Compresses in into out, which holds capacity bytes. Returns the compressed size, or 0
+// if the result would not fit.
+size_t lzfCompress(std::string_view in, char* out, size_t capacity);
+
+// Decompresses in into out, which must hold exactly out_len bytes. Returns false if the
+// input is corrupt or does not expand to out_len bytes.
+bool lzfDecompress(std::string_view in, char* out, size_t out_len);
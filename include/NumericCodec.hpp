@@ -0,0 +1,14 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <optional>
+
+namespace Numeric {
+    // Shortest representation that parses back to exactly the same double.
+    std::string formatDouble(double value);
+    void appendDouble(std::string& out, double value);
+    void appendBulkDouble(std::string& out, double value);
+
+    // Locale-independent; accepts an optional leading '+' and inf/-inf, rejects nan and trailing junk.
+    std::optional<double> parseDouble(std::string_view text);
+}
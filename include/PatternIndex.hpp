@@ -0,0 +1,61 @@
+#pragma once
+#include <bitset>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Redis-style glob pattern (*, ?, [abc], [^a-z], \x) compiled once into per-character tokens.
+class GlobMatcher {
+public:
+    explicit GlobMatcher(std::string_view pattern);
+
+    // The literal characters the pattern starts with; the matcher only checks what follows.
+    const std::string& literalPrefix() const { return prefix; }
+    // Matches text that is already known to start with literalPrefix().
+    bool matchesAfterPrefix(std::string_view text) const;
+
+private:
+    struct Token {
+        enum Kind { Char, Any, Star, Class } kind = Char;
+        char ch = 0;
+        std::bitset<256> set;
+    };
+
+    std::string prefix;
+    std::vector<Token> tokens;
+};
+
+// Pattern subscriptions indexed by their literal prefix in a trie. A channel only runs the
+// matchers of patterns whose prefix lies on its path through the trie, so the cost of a
+// publish depends on the channel length and the candidate patterns, not on the total number
+// of patterns.
+class PatternIndex {
+public:
+    // Subscribers are connection ids (ClientOutput::ClientId).
+    using Subscribers = std::unordered_set<uint64_t>;
+
+    // Both return whether the subscription set changed.
+    bool add(const std::string& pattern, uint64_t client);
+    bool remove(const std::string& pattern, uint64_t client);
+
+    void match(std::string_view channel, const std::function<void(const std::string& pattern, const Subscribers& subscribers)>& visit) const;
+
+private:
+    struct Entry {
+        GlobMatcher matcher;
+        Subscribers subscribers;
+    };
+
+    struct Node {
+        std::map<char, std::unique_ptr<Node>> children;
+        std::unordered_map<std::string, Entry> patterns;
+    };
+
+    Node root;
+};
@@ -0,0 +1,24 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// The commands a write is logged to the AOF and sent to replicas as. By default that is the
+// command as the client sent it. A command whose effect depends on when it runs (a generated
+// stream ID, a relative expiry, an idle-time check) rewrites it into commands that repeat
+// exactly what it did, so a replay builds the same data.
+class Propagation {
+public:
+    // Name first, then the arguments.
+    using Command = std::vector<std::string>;
+
+    // Called by Handler around each write command, on the thread running it.
+    static void begin(const std::string& name, const std::vector<std::string>& args);
+    static std::vector<Command> end();
+
+    // Both are no-ops when no write is being recorded, as during AOF replay. index counts
+    // the arguments after the command name.
+    static void rewriteArgument(size_t index, std::string value);
+    // An empty list propagates nothing.
+    static void replace(std::vector<Command> commands);
+};
@@ -1,14 +1,18 @@
 #pragma once
+#include <array>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 #include <string>
 #include <mutex>
 #include <sys/socket.h>
+#include "ClientOutput.hpp"
+#include "PatternIndex.hpp"
 
 class PubSubHandler {
 public:
     explicit PubSubHandler(int client_fd);
+    ~PubSubHandler();
 
     bool isPubSubCommand(const std::string& cmd);
     void handleCommand(const std::string& cmd, const std::vector<std::string>& args);
@@ -16,15 +20,40 @@ public:
 
 private:
     int client_fd;
+    // Subscriptions are keyed by connection id, so a publish racing with a disconnect never
+    // reaches the next connection to get the same descriptor.
+    ClientOutput::ClientId client_id;
     bool subscribed_mode = false;
+    // Channel and pattern subscriptions, kept here so sharded commands need not take store_mutex.
+    size_t regular_count = 0;
+    // Only this connection's thread touches its shard channels.
+    std::unordered_set<std::string> shard_channels;
 
-    void handleSubscribe(const std::vector<std::string>& args);
+    void handleSubscribe(const std::vector<std::string>& args, bool pattern);
     void handlePing();
-    void handleUnsubscribe(const std::vector<std::string>& args);
+    void handleUnsubscribe(const std::vector<std::string>& args, bool pattern);
     void handlePublish(const std::vector<std::string>& args);
+    void handleShardSubscribe(const std::vector<std::string>& args);
+    void handleShardUnsubscribe(const std::vector<std::string>& args);
+    void handleShardPublish(const std::vector<std::string>& args);
     void sendResponse(const std::string& response);
+    // Caller holds store_mutex.
+    size_t subscriptionCount() const;
+    void updateMode();
 
-    static std::unordered_map<int, std::unordered_set<std::string>> client_channels;
+    static std::unordered_map<ClientOutput::ClientId, std::unordered_set<std::string>> client_channels;
+    static std::unordered_map<ClientOutput::ClientId, std::unordered_set<std::string>> client_patterns;
     static std::mutex store_mutex;
-    static std::unordered_map<std::string, std::unordered_set<int>> channel_subscribers;
+    static std::unordered_map<std::string, std::unordered_set<ClientOutput::ClientId>> channel_subscribers;
+    static PatternIndex pattern_index;
+
+    // Sharded channels are partitioned by hash; each shard has its own lock and subscriber
+    // table, so SPUBLISH to unrelated channels does not contend.
+    static constexpr size_t SHARD_COUNT = 64;
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, std::unordered_set<ClientOutput::ClientId>> subscribers;
+    };
+    static std::array<Shard, SHARD_COUNT> shards;
+    static Shard& shardFor(const std::string& channel);
 };
\ No newline at end of file
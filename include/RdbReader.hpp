@@ -1,37 +1,41 @@
 #pragma once
 #include <string>
-#include <vector>
-#include <unordered_map>
+#include <string_view>
+#include <atomic>
 #include <cstdint>
-#include <optional>
+#include <vector>
 
-struct RdbEntry {
-    std::string value;
-    std::optional<int64_t> expiry;
-};
+struct RdbCursor;
+struct RdbEntryRef;
+class RdbLoadQueue;
 
+// Loads a dump into the shared keyspace. Called once at startup, before clients connect;
+// keys outside db 0, keys that have already expired, and sets and hashes, which this server
+// has no type for, are skipped.
+//
+// The file is mapped read-only and parsed in place: raw strings are copied only once, out
+// of the mapping into the store, and LZF-compressed strings are expanded straight into
+// their final buffer. The calling thread only scans for entry
+// boundaries and hands batches of entries to worker threads, which decode them and insert
+// each batch under a single store lock.
 class RdbReader {
 public:
-    explicit RdbReader(const std::string &filepath);
+    // workers == 0 uses one worker per hardware thread.
+    explicit RdbReader(const std::string &filepath, size_t workers = 0);
     bool load();
-    std::vector<std::string> getKeys(int db = 0) const;
-    std::optional<std::string> getValue(int db, const std::string &key) const;
-    const std::unordered_map<int, std::unordered_map<std::string, RdbEntry>>& getAllEntries() const;
+    size_t keysLoaded() const { return keys_loaded_; }
+    size_t keysSkipped() const { return keys_skipped_; }
+    // Where the dump ended, checksum included, or 0 if it did not load completely. Any
+    // bytes after that are not part of the dump, as with the AOF's commands.
+    size_t endOffset() const { return end_offset_; }
 
 private:
     std::string filepath_;
-    std::unordered_map<int, std::unordered_map<std::string, RdbEntry>> db_data_;
-    std::optional<int64_t> pending_expiry_;
+    size_t workers_;
+    std::atomic<size_t> keys_loaded_{0};
+    size_t keys_skipped_ = 0;
+    size_t end_offset_ = 0;
 
-    bool parseFile(std::ifstream &in);
-    std::string readN(std::ifstream &in, size_t n);
-    bool tryReadByte(std::ifstream &in, uint8_t &out);
-    uint8_t readByte(std::ifstream &in);
-    void skipBytes(std::ifstream &in, size_t n);
-    uint32_t readUInt32LE(std::ifstream &in);
-    uint64_t readUInt64LE(std::ifstream &in);
-    uint32_t readUInt32BE(std::ifstream &in);
-    uint64_t readUInt64BE(std::ifstream &in);
-    uint64_t readLength(std::ifstream &in, bool &isEncoded, int &encType);
-    std::string readString(std::ifstream &in);
+    bool scan(RdbCursor &in, RdbLoadQueue &queue);
+    void decode(std::vector<RdbEntryRef> &batch);
 };
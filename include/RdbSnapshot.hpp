@@ -0,0 +1,28 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+// SAVE and BGSAVE. Both write the whole keyspace to a temporary file and rename it over
+// the dump, so a crash mid-save never leaves a truncated dump behind.
+//
+// BGSAVE forks while holding every store lock, so the child sees a consistent copy-on-write
+// view of the keyspace as of the fork and the parent resumes serving clients at once.
+class RdbSnapshot {
+public:
+    enum class Result { Ok, Failed, AlreadyRunning };
+
+    static Result save(const std::string& path);
+    static Result saveInBackground(const std::string& path);
+
+    static bool inProgress();
+    // Unix time in seconds of the last successful save.
+    static int64_t lastSaveTime();
+    static bool lastBackgroundSaveOk();
+
+    // Writes the whole keyspace to fd as an RDB image; the caller holds every store lock.
+    static bool writeTo(int fd);
+
+private:
+    // Runs with the stores locked, or in the forked child.
+    static bool writeFile(const std::string& path);
+};
@@ -0,0 +1,48 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Writes an RDB file (version 11) to a file descriptor through a buffer, keeping the
+// CRC-64 that ends the file up to date as it goes. Store handlers serialize their own
+// values with the primitives below.
+class RdbWriter {
+public:
+    enum Type : uint8_t {
+        TYPE_STRING = 0,
+        TYPE_LIST = 1,
+        TYPE_ZSET_2 = 5,
+        TYPE_STREAM_LISTPACKS_3 = 21,
+    };
+
+    explicit RdbWriter(int fd) : fd(fd) {}
+
+    // Magic, auxiliary fields and the database selector.
+    void writeHeader();
+    // EOF marker and checksum; returns false if any write failed.
+    bool finish();
+
+    // Starts a key: optional absolute expiry in unix milliseconds, then type and name.
+    void writeKey(Type type, std::string_view key, int64_t expire_ms = -1);
+
+    void writeLength(uint64_t length);
+    // Strings that are canonical 32-bit integers are stored in integer form, and strings
+    // longer than COMPRESS_MIN_LENGTH bytes are LZF-compressed when that saves space.
+    void writeString(std::string_view value);
+    void writeBinaryDouble(double value);
+    void writeMillis(int64_t ms);
+    void writeRaw(std::string_view bytes);
+
+private:
+    static constexpr size_t BUFFER_SIZE = 64 * 1024;
+    static constexpr size_t COMPRESS_MIN_LENGTH = 20;
+
+    int fd;
+    std::string buffer;
+    std::string compress_buffer;
+    uint64_t crc = 0;
+    bool failed = false;
+
+    void writeByte(uint8_t byte);
+    void flush();
+};
@@ -3,13 +3,15 @@
 #include <string>
 #include <mutex>
 #include <sys/socket.h>
+#include "ClientOutput.hpp"
 
 class ReplicationManager {
-    std::vector<int> replica_fds; 
+    std::vector<ClientOutput::ClientId> replica_ids;
     std::mutex mtx;
 
 public:
     void addReplica(int fd);
     void removeReplica(int fd);
-    void propagateCommand(const std::vector<std::string>& cmdParts);
+    // Sends the commands to every replica as one buffer.
+    void propagateCommands(const std::vector<std::vector<std::string>>& commands);
 };
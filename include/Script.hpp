@@ -0,0 +1,86 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Compile or runtime error of a script. The message is a complete error reply without the
+// leading '-', e.g. "ERR user_script:3: attempt to compare nil with number".
+class ScriptError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+struct ScriptTable;
+
+// A value of the scripting language, which has the Lua types scripts need.
+struct ScriptValue {
+    enum class Type { Nil, Boolean, Number, String, Table, Function };
+    using Function = std::function<ScriptValue(std::vector<ScriptValue>& args)>;
+
+    Type type = Type::Nil;
+    bool boolean = false;
+    double number = 0;
+    std::string string;
+    std::shared_ptr<ScriptTable> table;
+    std::shared_ptr<const Function> function;
+
+    static ScriptValue fromBool(bool value);
+    static ScriptValue fromNumber(double value);
+    static ScriptValue fromString(std::string value);
+    static ScriptValue fromTable(std::shared_ptr<ScriptTable> value);
+    static ScriptValue fromFunction(Function value);
+
+    // Numbers print as Lua prints them, "%.14g".
+    static std::string formatNumber(double value);
+
+    bool truthy() const { return type != Type::Nil && !(type == Type::Boolean && !boolean); }
+    const char* typeName() const;
+};
+
+// Keys 1..n live in the array part; other keys are strings or numbers.
+struct ScriptTable {
+    std::vector<ScriptValue> array;
+    std::unordered_map<std::string, ScriptValue> fields;
+    std::map<double, ScriptValue> numbers;
+    // Library tables are shared between scripts and cannot be modified by them.
+    bool readonly = false;
+
+    ScriptValue get(const ScriptValue& key) const;
+    void set(const ScriptValue& key, ScriptValue value);
+};
+
+// A script compiled once into a tree whose local variables are resolved to frame slots and
+// whose globals are resolved by index, so a cached script runs without re-parsing.
+//
+// The language is the subset of Lua that scripts against the keyspace use: locals, tables,
+// arithmetic and comparisons, string concatenation, if/while/repeat, numeric for, generic
+// for over ipairs()/pairs(), and calls of built-in functions. Scripts cannot define
+// functions, and functions return a single value.
+class Script {
+public:
+    // Throws ScriptError on syntax errors.
+    explicit Script(const std::string& source);
+    ~Script();
+
+    // Runs the script with the standard library plus globals, which the script may read but
+    // not assign. Throws ScriptError on runtime errors, or once the run exceeds budget_ms while
+    // has_written is still false: a script that has written runs to completion, so its
+    // effects are never left half-applied.
+    ScriptValue run(const std::unordered_map<std::string, ScriptValue>& globals, int64_t budget_ms, const bool& has_written) const;
+
+    struct Expr;
+    struct Stmt;
+    using Block = std::vector<std::unique_ptr<Stmt>>;
+
+private:
+    friend class ScriptRunner;
+
+    Block body;
+    std::vector<std::string> global_names;
+    size_t slot_count = 0;
+};
@@ -0,0 +1,47 @@
+#pragma once
+#include "Script.hpp"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// EVAL, EVALSHA and SCRIPT. Scripts are compiled once and cached under the SHA-1 of their
+// source. The caller runs EVAL and EVALSHA holding the locks of every store, so a script
+// executes atomically against the keyspace. A run is aborted once it runs longer than the
+// time limit unless it has already written, in which case it is left to finish.
+class ScriptingHandler {
+public:
+    // Runs a command for redis.call(); returns false for commands scripts may not call, and
+    // sets wrote when the command is a write.
+    using Dispatch = std::function<bool(const std::string& name, const std::vector<std::string>& args, bool& wrote)>;
+
+    ScriptingHandler(int client_fd, Dispatch dispatch);
+
+    bool isScriptCommand(const std::string& cmd);
+    void handleCommand(const std::string& cmd, const std::vector<std::string>& args);
+
+    static void setTimeLimit(int64_t ms) { time_limit_ms = ms; }
+
+private:
+    int client_fd;
+    Dispatch dispatch;
+    // The "redis" library table, bound to this connection.
+    ScriptValue redis_lib;
+    // Set once the running script has called a write command.
+    bool script_wrote = false;
+
+    void handleEval(const std::vector<std::string>& args, bool by_sha);
+    void handleScript(const std::vector<std::string>& args);
+    void runScript(const Script& script, const std::vector<std::string>& args, size_t numkeys);
+    ScriptValue call(std::vector<ScriptValue>& args, bool raise_errors);
+
+    void sendResponse(std::string_view response);
+
+    static std::unordered_map<std::string, std::shared_ptr<const Script>> script_cache;
+    static std::mutex cache_mutex;
+    static std::atomic<int64_t> time_limit_ms;
+};
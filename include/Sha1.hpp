@@ -0,0 +1,6 @@
+#pragma once
+#include <string>
+#include <string_view>
+
+// Lowercase hex SHA-1 digest, as used to name cached scripts.
+std::string sha1Hex(std::string_view data);
@@ -6,6 +6,8 @@
 #include <mutex>
 #include<optional>
 
+class RdbWriter;
+
 struct ZSet {
     std::map<std::pair<double, std::string>, std::string> ordered;   
     std::unordered_map<std::string, double> lookup;                 
@@ -16,21 +18,43 @@ public:
     explicit SortedSetHandler(int client_fd);
 
     bool isSortedSetCommand(const std::string& cmd);
+    bool isWriteCommand(const std::string& cmd);
     void handleCommand(const std::string& cmd, const std::vector<std::string>& args);
+    static std::mutex& storeMutex() { return store_mutex; }
+    // Writes every key to out; the caller holds store_mutex.
+    static void saveTo(RdbWriter& out);
+    // Inserts sets read from a dump under one lock. Returns how many were inserted.
+    static size_t restore(std::vector<std::pair<std::string, std::vector<std::pair<std::string, double>>>>& batch);
     void handleZAdd(const std::vector<std::string>& args);
     void handleZRank(const std::vector<std::string>& args);
     void handleZRange(const std::vector<std::string>& args);
     void handleZCard(const std::vector<std::string>& args);
     void handleZScore(const std::vector<std::string>& args);
     void handleZRem(const std::vector<std::string>& args);
+    void handleZUnionStore(const std::vector<std::string>& args);
+    void handleZInterStore(const std::vector<std::string>& args);
+    void handleZDiffStore(const std::vector<std::string>& args);
     void sendResponse(const std::string& response);
+    // Adds or updates members and returns how many were new.
+    size_t addMembers(const std::string& key, const std::vector<std::pair<std::string, double>>& members);
     std::optional<double> getScore(const std::string& key, const std::string& member);
     std::vector<std::pair<std::string, double>> getAllWithScores(const std::string& key);
+    // Members whose score falls in any of the half-open [min, max) ranges.
+    std::vector<std::pair<std::string, double>> getInScoreRanges(const std::string& key, const std::vector<std::pair<double, double>>& ranges);
+    // Variants for callers already holding storeMutex(), so that several lookups see one
+    // version of the set.
+    std::optional<double> getScoreLocked(const std::string& key, const std::string& member);
+    void appendInScoreRangeLocked(const std::string& key, double min, double max, std::vector<std::pair<std::string, double>>& out);
+    // Replaces the set at key with the given members; an empty list deletes the key.
+    void replaceMembers(const std::string& key, std::vector<std::pair<std::string, double>> members);
 
 private:
     int client_fd;
 
-    std::unordered_map<std::string, ZSet> sorted_sets;
-    std::mutex store_mutex;
+    enum class SetOperation { Union, Inter, Diff };
+    void handleSetOperation(SetOperation op, const std::string& cmd, const std::vector<std::string>& args);
+
+    static std::unordered_map<std::string, ZSet> sorted_sets;
+    static std::mutex store_mutex;
 
 };
@@ -0,0 +1,33 @@
+#pragma once
+#include <mutex>
+#include <vector>
+
+// Scoped lock on a store mutex. While EXEC holds a store for its whole batch, locking that
+// store again from the same thread is a no-op, so queued commands run under the batch's
+// locks instead of re-acquiring their own.
+class StoreLock {
+public:
+    explicit StoreLock(std::mutex& mutex);
+    ~StoreLock();
+
+    // A lock adopted from the batch stays held until the batch is released.
+    void unlock() {
+        if (lock.owns_lock() && !adopted) lock.unlock();
+    }
+    // Only a command that took the lock itself may wait on it; inside EXEC a blocking
+    // command answers as if its timeout had already expired.
+    bool canBlock() const { return lock.owns_lock(); }
+    std::unique_lock<std::mutex>& unique() { return lock; }
+
+    // Locks each mutex once, always in the same (address) order so that concurrent
+    // batches cannot deadlock. Batches do not nest. A blocking batch is for a single
+    // command that has to keep its store locked after it returns: its StoreLock adopts the
+    // batch's lock and may wait on it as usual.
+    static void acquireBatch(std::vector<std::mutex*> mutexes, bool blocking = false);
+    static void releaseBatch();
+    static bool holdsBatch();
+
+private:
+    std::unique_lock<std::mutex> lock;
+    bool adopted = false;
+};
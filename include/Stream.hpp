@@ -0,0 +1,134 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+struct StreamId {
+    uint64_t ms = 0;
+    uint64_t seq = 0;
+
+    auto operator<=>(const StreamId&) const = default;
+
+    static constexpr StreamId min() { return {0, 0}; }
+    static constexpr StreamId max() { return {UINT64_MAX, UINT64_MAX}; }
+
+    std::string toString() const;
+    // Smallest ID greater than this one; max() has no successor and returns itself.
+    StreamId next() const;
+    // Largest ID smaller than this one; min() has no predecessor and returns itself.
+    StreamId prev() const;
+
+    // Parses "ms-seq", or "ms" alone with the given sequence number.
+    static std::optional<StreamId> parse(std::string_view text, uint64_t missingSeq);
+};
+
+// Decoded view of one entry. The views point into the stream's storage and are only valid
+// for the duration of the visit callback.
+struct StreamEntry {
+    StreamId id;
+    std::vector<std::pair<std::string_view, std::string_view>> fields;
+};
+
+struct PendingEntry {
+    std::string consumer;
+    int64_t delivery_time = 0;
+    uint64_t delivery_count = 0;
+};
+
+struct Consumer {
+    int64_t seen_time = 0;
+    std::set<StreamId> pending;
+};
+
+// The pending entries list is indexed by ID in `pel` and by owner in each consumer's
+// `pending` set; both indexes are only changed through the methods below.
+struct ConsumerGroup {
+    StreamId last_delivered;
+    std::map<StreamId, PendingEntry> pel;
+    std::map<std::string, Consumer> consumers;
+
+    Consumer& consumer(const std::string& name, int64_t now);
+    // Makes `name` the owner of id, creating the PEL entry if needed.
+    PendingEntry& assign(StreamId id, const std::string& name, int64_t now);
+    bool ack(StreamId id);
+    // Removes the consumer and its pending entries, returning how many it had.
+    size_t removeConsumer(const std::string& name);
+};
+
+// Entries are kept in macro-nodes of consecutive IDs, indexed by their first ID in an
+// ordered map, so appends and seeks are logarithmic in the number of nodes and never
+// touch the ID text.
+//
+// Inside a node entries are packed into one byte buffer, similar to a Redis listpack:
+// IDs are stored as varint deltas from the node's first ID, entries whose field names
+// match the node's master field list store only a flag instead of the names, and
+// canonical integer values are stored as zigzag varint deltas from the previous integer
+// value of the same field. Deleted entries are only flagged; a node is freed once all of
+// its entries are deleted.
+class Stream {
+public:
+    static constexpr size_t NODE_MAX_ENTRIES = 100;
+    static constexpr size_t NODE_MAX_BYTES = 4096;
+
+    bool empty() const { return length == 0; }
+    size_t size() const { return length; }
+    StreamId lastId() const { return last_id; }
+    // Every entry ever appended, including those since deleted or trimmed.
+    uint64_t entriesAdded() const { return entries_added; }
+    // Largest ID removed by a delete or trim, or 0-0 if none was.
+    StreamId maxDeletedId() const { return max_deleted_id; }
+
+    // Raises lastId() past entries that were appended and since deleted; the caller
+    // guarantees id >= lastId().
+    void setLastId(StreamId id) { last_id = id; }
+    // Restore the counters above when loading a stream whose deleted entries are gone.
+    void setEntriesAdded(uint64_t n) { entries_added = n; }
+    void setMaxDeletedId(StreamId id) { max_deleted_id = id; }
+    // The caller guarantees id > lastId().
+    void append(StreamId id, std::vector<std::pair<std::string, std::string>> fields);
+
+    // Visits entries with start <= id <= end in ascending order until visit returns false.
+    void range(StreamId start, StreamId end, const std::function<bool(const StreamEntry&)>& visit) const;
+    // Same as range() but in descending order, starting from end.
+    void revrange(StreamId start, StreamId end, const std::function<bool(const StreamEntry&)>& visit) const;
+    bool contains(StreamId id) const;
+
+    // Marks the entry deleted; lastId() is unaffected. Returns false if there was no such entry.
+    bool remove(StreamId id);
+    // Both trims remove entries from the head and return how many went. An approximate trim
+    // only drops whole nodes and may leave a few extra entries; limit (0 for none) caps how
+    // many entries it removes.
+    size_t trimMaxLen(size_t maxlen, bool approx, size_t limit);
+    size_t trimMinId(StreamId minid, bool approx, size_t limit);
+
+    std::map<std::string, ConsumerGroup>& groups() { return consumer_groups; }
+
+private:
+    struct Node {
+        std::vector<std::string> master_fields;
+        std::string data;
+        // count includes deleted entries and bounds the node's size; live does not.
+        size_t count = 0;
+        size_t live = 0;
+        StreamId last;
+        // Last integer value seen per master field, used to delta-encode the next append.
+        std::vector<int64_t> last_ints;
+    };
+
+    static void appendEntry(Node& node, StreamId master, StreamId id, const std::vector<std::pair<std::string, std::string>>& fields);
+    void markDeleted(std::map<StreamId, Node>::iterator it, size_t offset);
+    size_t trimHead(const std::function<bool(StreamId, size_t)>& shouldRemove, bool approx, size_t limit);
+
+    std::map<StreamId, Node> nodes;
+    size_t length = 0;
+    StreamId last_id;
+    uint64_t entries_added = 0;
+    StreamId max_deleted_id;
+    std::map<std::string, ConsumerGroup> consumer_groups;
+};
@@ -2,8 +2,12 @@
 #include <unordered_map>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <mutex>
 #include <condition_variable>
+#include "Stream.hpp"
+
+class RdbWriter;
 
 class StreamStoreHandler {
 public:
@@ -14,19 +18,37 @@ public:
     void handleCommand(const std::string& cmd, const std::vector<std::string>& args);
     bool hasKey(const std::string& key);
     std::string typeName() const { return "stream"; }
+    static std::mutex& storeMutex() { return store_mutex; }
+    // Writes every key to out; the caller holds store_mutex.
+    static void saveTo(RdbWriter& out);
+    // Appends the live entries of one stream node in the RDB listpack layout.
+    static void loadNode(Stream& stream, StreamId master, std::string_view listpack);
+    // Inserts streams read from a dump under one lock. Returns how many were inserted.
+    static size_t restore(std::vector<std::pair<std::string, Stream>>& batch);
 
 private:
     int client_fd;
 
     void handleXadd(const std::vector<std::string>& args);
-    void handleXrange(const std::vector<std::string>& args);
+    void handleXrange(const std::vector<std::string>& args, bool reverse);
+    void handleXlen(const std::vector<std::string>& args);
     void handleXread(const std::vector<std::string>& args);
+    void handleXtrim(const std::vector<std::string>& args);
+    void handleXdel(const std::vector<std::string>& args);
+    void handleXgroup(const std::vector<std::string>& args);
+    void handleXreadgroup(const std::vector<std::string>& args);
+    void handleXack(const std::vector<std::string>& args);
+    void handleXpending(const std::vector<std::string>& args);
+    void handleXclaim(const std::vector<std::string>& args);
+    void handleXautoclaim(const std::vector<std::string>& args);
+
+    // Caller holds store_mutex.
+    static ConsumerGroup* findGroup(const std::string& key, const std::string& group);
 
-    void sendResponse(const std::string& response);
+    void sendResponse(std::string_view response);
     int64_t getCurrentTimeMs();
 
-    using StreamEntry = std::pair<std::string, std::unordered_map<std::string, std::string>>;
-    static std::unordered_map<std::string, std::vector<StreamEntry>> stream_store;
+    static std::unordered_map<std::string, Stream> stream_store;
     static std::mutex store_mutex;
     static std::unordered_map<std::string, std::condition_variable> stream_cvs;
 
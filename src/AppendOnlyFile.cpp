@@ -0,0 +1,258 @@
+#include "AppendOnlyFile.hpp"
+#include "Handler.hpp"
+#include "RdbReader.hpp"
+#include "RdbSnapshot.hpp"
+#include "StoreLock.hpp"
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+
+using Clock = std::chrono::steady_clock;
+
+static std::mutex aof_mutex;
+static std::condition_variable writer_cv;
+static std::condition_variable durable_cv;
+// Appended but not yet handed to the writer.
+static std::string pending;
+// Byte counts since startup: everything appended, and the prefix of it that is durable.
+static uint64_t appended_bytes = 0;
+static uint64_t durable_bytes = 0;
+static int aof_fd = -1;
+static AppendOnlyFile::FsyncPolicy fsync_policy = AppendOnlyFile::FsyncPolicy::EverySec;
+static std::atomic<bool> aof_enabled{false};
+static thread_local uint64_t last_appended = 0;
+
+bool AppendOnlyFile::parsePolicy(const std::string& text, FsyncPolicy& out) {
+    if (text == "always") out = FsyncPolicy::Always;
+    else if (text == "everysec") out = FsyncPolicy::EverySec;
+    else if (text == "no") out = FsyncPolicy::No;
+    else return false;
+    return true;
+}
+
+bool AppendOnlyFile::enabled() {
+    return aof_enabled.load();
+}
+
+void AppendOnlyFile::append(const std::vector<std::vector<std::string>>& commands) {
+    if (!aof_enabled.load(std::memory_order_relaxed)) return;
+
+    std::string resp;
+    for (const auto& command : commands) {
+        resp += "*" + std::to_string(command.size()) + "\r\n";
+        for (const auto& part : command) {
+            resp += "$" + std::to_string(part.size()) + "\r\n";
+            resp += part;
+            resp += "\r\n";
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(aof_mutex);
+    bool was_empty = pending.empty();
+    pending += resp;
+    appended_bytes += resp.size();
+    last_appended = appended_bytes;
+    if (was_empty) writer_cv.notify_one();
+}
+
+void AppendOnlyFile::waitUntilDurable() {
+    if (fsync_policy != FsyncPolicy::Always || last_appended == 0) return;
+    std::unique_lock<std::mutex> lock(aof_mutex);
+    durable_cv.wait(lock, [] { return durable_bytes >= last_appended; });
+}
+
+void AppendOnlyFile::writerLoop() {
+    std::string out;
+    bool unsynced = false;
+    Clock::time_point last_sync = Clock::now();
+
+    while (true) {
+        uint64_t upto;
+        {
+            std::unique_lock<std::mutex> lock(aof_mutex);
+            auto ready = [&] { return !pending.empty() || !out.empty(); };
+            // Under everysec, wake up for the next second's fsync even without new writes.
+            if (unsynced && fsync_policy == FsyncPolicy::EverySec) writer_cv.wait_until(lock, last_sync + std::chrono::seconds(1), ready);
+            else writer_cv.wait(lock, ready);
+            if (out.empty()) out.swap(pending);
+            else out += pending;
+            pending.clear();
+            upto = appended_bytes;
+        }
+
+        size_t written = 0;
+        while (written < out.size()) {
+            ssize_t n = ::write(aof_fd, out.data() + written, out.size() - written);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            written += static_cast<size_t>(n);
+        }
+        out.erase(0, written);
+        if (written > 0) unsynced = true;
+        if (!out.empty()) {
+            std::cerr << "AOF: write failed: " << strerror(errno) << "\n";
+            // Acknowledged writes must be durable, so there is no way to go on.
+            if (fsync_policy == FsyncPolicy::Always) _exit(1);
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            continue;
+        }
+
+        Clock::time_point now = Clock::now();
+        bool sync = fsync_policy == FsyncPolicy::Always || (fsync_policy == FsyncPolicy::EverySec && now - last_sync >= std::chrono::seconds(1));
+        if (unsynced && sync) {
+            if (fdatasync(aof_fd) != 0) {
+                std::cerr << "AOF: fdatasync failed: " << strerror(errno) << "\n";
+                if (fsync_policy == FsyncPolicy::Always) _exit(1);
+            }
+            unsynced = false;
+            last_sync = now;
+        }
+
+        std::lock_guard<std::mutex> lock(aof_mutex);
+        durable_bytes = upto;
+        durable_cv.notify_all();
+    }
+}
+
+bool AppendOnlyFile::open(const std::string& path, FsyncPolicy policy) {
+    struct stat st{};
+    if (stat(path.c_str(), &st) != 0 || st.st_size == 0) {
+        // A new file starts from the current keyspace, so nothing loaded from the dump is lost.
+        std::string temp = path + ".tmp-" + std::to_string(getpid());
+        int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        StoreLock::acquireBatch(Handler::allStores());
+        bool ok = RdbSnapshot::writeTo(fd) && fsync(fd) == 0;
+        StoreLock::releaseBatch();
+        ok = close(fd) == 0 && ok;
+        if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+            unlink(temp.c_str());
+            return false;
+        }
+    }
+
+    aof_fd = ::open(path.c_str(), O_WRONLY | O_APPEND);
+    if (aof_fd < 0) return false;
+    fsync_policy = policy;
+    aof_enabled = true;
+    std::thread(writerLoop).detach();
+    return true;
+}
+
+enum class ParseResult { Complete, Incomplete, Corrupt };
+
+// Parses one RESP array of bulk strings starting at pos, advancing pos past it.
+static ParseResult parseCommand(std::string_view data, size_t& pos, std::vector<std::string>& parts) {
+    auto readNumber = [&](char prefix, int64_t& value) {
+        if (pos >= data.size()) return ParseResult::Incomplete;
+        if (data[pos] != prefix) return ParseResult::Corrupt;
+        size_t eol = data.find("\r\n", pos);
+        if (eol == std::string_view::npos) return ParseResult::Incomplete;
+        auto res = std::from_chars(data.data() + pos + 1, data.data() + eol, value);
+        if (res.ec != std::errc{} || res.ptr != data.data() + eol || value < 0) return ParseResult::Corrupt;
+        pos = eol + 2;
+        return ParseResult::Complete;
+    };
+
+    parts.clear();
+    int64_t count = 0;
+    ParseResult result = readNumber('*', count);
+    if (result != ParseResult::Complete) return result;
+    if (count == 0) return ParseResult::Corrupt;
+    for (int64_t i = 0; i < count; ++i) {
+        int64_t len = 0;
+        result = readNumber('$', len);
+        if (result != ParseResult::Complete) return result;
+        if (data.size() - pos < static_cast<size_t>(len) + 2) return ParseResult::Incomplete;
+        if (data.compare(pos + len, 2, "\r\n") != 0) return ParseResult::Corrupt;
+        parts.emplace_back(data.substr(pos, len));
+        pos += len + 2;
+    }
+    return ParseResult::Complete;
+}
+
+bool AppendOnlyFile::load(const std::string& path, const Run& run) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open()) return true;
+    char magic[5] = {};
+    in.read(magic, sizeof(magic));
+
+    size_t offset = 0;
+    if (in.gcount() == 5 && std::memcmp(magic, "REDIS", 5) == 0) {
+        RdbReader preamble(path);
+        preamble.load();
+        offset = preamble.endOffset();
+        if (offset == 0) {
+            std::cerr << "AOF: the RDB preamble of " << path << " is corrupt\n";
+            return false;
+        }
+        std::cout << "Loaded " << preamble.keysLoaded() << " keys from the AOF preamble\n";
+    }
+
+    in.clear();
+    in.seekg(static_cast<std::streamoff>(offset));
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    // Replayed as one batch holding every store, so blocking commands never wait. The
+    // commands of a MULTI/EXEC block are only run once its EXEC has been read.
+    size_t pos = 0, replayed = 0;
+    std::vector<std::string> parts;
+    std::vector<std::pair<std::string, std::vector<std::string>>> queued;
+    std::optional<size_t> multi_start;
+    ParseResult result = ParseResult::Complete;
+    StoreLock::acquireBatch(Handler::allStores());
+    while (pos < data.size()) {
+        size_t start = pos;
+        result = parseCommand(data, pos, parts);
+        if (result != ParseResult::Complete) {
+            pos = start;
+            break;
+        }
+        std::string name = parts.front();
+        for (char& c : name) c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+        parts.erase(parts.begin());
+        if (name == "MULTI" && !multi_start) {
+            multi_start = start;
+        } else if (name == "EXEC" && multi_start) {
+            for (const auto& [queued_name, queued_args] : queued) run(queued_name, queued_args);
+            replayed += queued.size();
+            queued.clear();
+            multi_start.reset();
+        } else if (multi_start) {
+            queued.emplace_back(std::move(name), std::move(parts));
+            parts = {};
+        } else {
+            run(name, parts);
+            replayed++;
+        }
+    }
+    StoreLock::releaseBatch();
+
+    if (result == ParseResult::Corrupt) {
+        std::cerr << "AOF: bad command at offset " << offset + pos << " of " << path << "\n";
+        return false;
+    }
+    if (multi_start) {
+        std::cerr << "AOF: dropping a transaction without EXEC at the end of " << path << "\n";
+        if (truncate(path.c_str(), static_cast<off_t>(offset + *multi_start)) != 0) return false;
+    } else if (result == ParseResult::Incomplete) {
+        std::cerr << "AOF: dropping a truncated command at the end of " << path << "\n";
+        if (truncate(path.c_str(), static_cast<off_t>(offset + pos)) != 0) return false;
+    }
+    std::cout << "Replayed " << replayed << " commands from the AOF\n";
+    return true;
+}
@@ -0,0 +1,325 @@
+#include "ClientOutput.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <sstream>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+struct ClientQueue {
+    std::mutex mutex;
+    // Elements are only popped by the owner thread, and deque keeps references stable on
+    // push_back, so the owner can write the front buffers without holding the mutex.
+    std::deque<ClientOutput::Buffer> queue;
+    size_t front_offset = 0;
+    // Bytes still to be written, and since when they have been above the soft limit.
+    size_t pending_bytes = 0;
+    int64_t soft_since_ms = 0;
+    // Set under mutex once the client is over its limits or unregistered; from then on fd
+    // may already belong to another connection, so nothing touches it.
+    bool closing = false;
+    int fd = -1;
+    int event_fd = -1;
+    ClientOutput::ClientId id = 0;
+    std::thread::id owner;
+    std::atomic<ClientOutput::ClientClass> cls{ClientOutput::ClientClass::Normal};
+
+    // Other threads may still hold the queue after it is unregistered, so the eventfd lives
+    // as long as the queue and its number cannot be reused under them.
+    ~ClientQueue() {
+        if (event_fd >= 0) close(event_fd);
+    }
+};
+
+static std::shared_mutex registry_mutex;
+static std::unordered_map<int, std::shared_ptr<ClientQueue>> clients;
+static std::unordered_map<ClientOutput::ClientId, std::shared_ptr<ClientQueue>> clients_by_id;
+static ClientOutput::ClientId next_client_id = 1;
+
+// Buffers handed to one sendmsg call.
+static constexpr size_t MAX_IOV = 64;
+
+// Defaults match Redis: normal clients are unbounded, pub/sub 32mb/8mb/60s, replicas 256mb/64mb/60s.
+static std::array<ClientOutput::Limit, ClientOutput::CLIENT_CLASS_COUNT> limits = {{
+    {0, 0, 0},
+    {32u << 20, 8u << 20, 60},
+    {256u << 20, 64u << 20, 60},
+}};
+static std::mutex limits_mutex;
+static std::array<std::atomic<uint64_t>, ClientOutput::CLIENT_CLASS_COUNT> disconnected{};
+
+static int64_t nowMs() {
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// Caller holds client.mutex. Returns true if the client went over its limits; the socket is
+// then shut down, which ends the connection thread's loop, and further output is dropped.
+// The queue itself is released by the owner, which may be writing from it right now.
+static bool overLimit(ClientQueue& client) {
+    if (client.closing) return true;
+    ClientOutput::Limit limit;
+    size_t index = static_cast<size_t>(client.cls.load());
+    {
+        std::lock_guard<std::mutex> lock(limits_mutex);
+        limit = limits[index];
+    }
+
+    bool over = limit.hard != 0 && client.pending_bytes > limit.hard;
+    if (limit.soft != 0 && client.pending_bytes > limit.soft) {
+        int64_t now = nowMs();
+        if (client.soft_since_ms == 0) client.soft_since_ms = now;
+        else if (now - client.soft_since_ms >= limit.soft_seconds * 1000) over = true;
+    } else {
+        client.soft_since_ms = 0;
+    }
+    if (!over) return false;
+
+    client.closing = true;
+    disconnected[index]++;
+    shutdown(client.fd, SHUT_RDWR);
+    return true;
+}
+
+static std::shared_ptr<ClientQueue> lookup(int fd) {
+    std::shared_lock<std::shared_mutex> lock(registry_mutex);
+    auto it = clients.find(fd);
+    return it == clients.end() ? nullptr : it->second;
+}
+
+static void enqueue(ClientQueue& client, ClientOutput::Buffer data) {
+    bool was_empty;
+    {
+        std::lock_guard<std::mutex> lock(client.mutex);
+        if (client.closing) return;
+        was_empty = client.queue.empty();
+        client.pending_bytes += data->size();
+        client.queue.push_back(std::move(data));
+        if (overLimit(client)) return;
+    }
+    // The owner flushes after every command it runs; other threads have to wake it, but only
+    // once per burst since a non-empty queue already has a wakeup pending.
+    if (was_empty && std::this_thread::get_id() != client.owner) {
+        uint64_t one = 1;
+        ssize_t ignored = write(client.event_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+void ClientOutput::registerClient(int fd) {
+    auto client = std::make_shared<ClientQueue>();
+    client->fd = fd;
+    client->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    client->owner = std::this_thread::get_id();
+    std::unique_lock<std::shared_mutex> lock(registry_mutex);
+    client->id = next_client_id++;
+    clients_by_id[client->id] = client;
+    clients[fd] = std::move(client);
+}
+
+void ClientOutput::unregisterClient(int fd) {
+    std::shared_ptr<ClientQueue> client;
+    {
+        std::unique_lock<std::shared_mutex> lock(registry_mutex);
+        auto it = clients.find(fd);
+        if (it == clients.end()) return;
+        client = std::move(it->second);
+        clients.erase(it);
+        clients_by_id.erase(client->id);
+    }
+    // The caller closes the socket next, so threads still holding the queue must stop
+    // using its descriptors first.
+    std::lock_guard<std::mutex> lock(client->mutex);
+    client->closing = true;
+    client->queue.clear();
+    client->pending_bytes = 0;
+}
+
+ClientOutput::ClientId ClientOutput::clientId(int fd) {
+    auto client = lookup(fd);
+    return client ? client->id : 0;
+}
+
+int ClientOutput::wakeFd(int fd) {
+    auto client = lookup(fd);
+    return client ? client->event_fd : -1;
+}
+
+static thread_local int batch_fd = -1;
+static thread_local std::string batch;
+
+std::string ClientOutput::collect(int fd, const std::function<void()>& fn) {
+    int outer_fd = std::exchange(batch_fd, fd);
+    std::string outer = std::exchange(batch, std::string());
+    auto restore = [&]() {
+        batch_fd = outer_fd;
+        return std::exchange(batch, std::move(outer));
+    };
+    try {
+        fn();
+    } catch (...) {
+        restore();
+        throw;
+    }
+    return restore();
+}
+
+void ClientOutput::send(int fd, std::string_view data) {
+    if (fd == batch_fd) {
+        batch.append(data);
+        return;
+    }
+    auto client = lookup(fd);
+    if (client) {
+        enqueue(*client, std::make_shared<const std::string>(data));
+        return;
+    }
+    size_t total = 0;
+    while (total < data.size()) {
+        ssize_t sent = ::send(fd, data.data() + total, data.size() - total, MSG_NOSIGNAL);
+        if (sent <= 0) break;
+        total += static_cast<size_t>(sent);
+    }
+}
+
+void ClientOutput::send(int fd, Buffer data) {
+    if (fd == batch_fd) {
+        batch.append(*data);
+        return;
+    }
+    auto client = lookup(fd);
+    if (client) enqueue(*client, std::move(data));
+    else send(fd, std::string_view(*data));
+}
+
+void ClientOutput::broadcast(const std::vector<ClientId>& ids, const Buffer& data) {
+    std::vector<std::shared_ptr<ClientQueue>> targets;
+    targets.reserve(ids.size());
+    {
+        std::shared_lock<std::shared_mutex> lock(registry_mutex);
+        for (ClientId id : ids) {
+            auto it = clients_by_id.find(id);
+            if (it != clients_by_id.end()) targets.push_back(it->second);
+        }
+    }
+    for (auto& client : targets) enqueue(*client, data);
+}
+
+bool ClientOutput::flush(int fd) {
+    auto client = lookup(fd);
+    if (!client) return true;
+
+    iovec iov[MAX_IOV];
+    while (true) {
+        size_t count = 0, offered = 0;
+        {
+            std::lock_guard<std::mutex> lock(client->mutex);
+            if (client->closing) {
+                client->queue.clear();
+                return false;
+            }
+            for (auto it = client->queue.begin(); it != client->queue.end() && count < MAX_IOV; ++it, ++count) {
+                size_t skip = count == 0 ? client->front_offset : 0;
+                iov[count].iov_base = const_cast<char*>((*it)->data() + skip);
+                iov[count].iov_len = (*it)->size() - skip;
+                offered += iov[count].iov_len;
+            }
+        }
+        if (count == 0) return true;
+
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t sent = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        std::lock_guard<std::mutex> lock(client->mutex);
+        if (client->closing) return false;
+        client->pending_bytes -= static_cast<size_t>(sent);
+        size_t left = static_cast<size_t>(sent);
+        while (left > 0) {
+            size_t remaining = client->queue.front()->size() - client->front_offset;
+            if (left < remaining) {
+                client->front_offset += left;
+                break;
+            }
+            left -= remaining;
+            client->queue.pop_front();
+            client->front_offset = 0;
+        }
+        // A short write means the socket buffer is full; the caller polls for POLLOUT.
+        if (static_cast<size_t>(sent) < offered) return !overLimit(*client);
+    }
+}
+
+bool ClientOutput::hasPending(int fd) {
+    auto client = lookup(fd);
+    if (!client) return false;
+    std::lock_guard<std::mutex> lock(client->mutex);
+    return !client->queue.empty();
+}
+
+void ClientOutput::setLimit(ClientClass cls, Limit limit) {
+    std::lock_guard<std::mutex> lock(limits_mutex);
+    limits[static_cast<size_t>(cls)] = limit;
+}
+
+static bool parseSize(const std::string& text, size_t& out) {
+    size_t digits = 0;
+    while (digits < text.size() && isdigit(static_cast<unsigned char>(text[digits]))) digits++;
+    if (digits == 0) return false;
+    std::string unit = text.substr(digits);
+    std::transform(unit.begin(), unit.end(), unit.begin(), ::tolower);
+    size_t scale = unit.empty() || unit == "b" ? 1 : unit == "kb" ? 1024 : unit == "mb" ? 1024 * 1024 : unit == "gb" ? 1024 * 1024 * 1024 : 0;
+    if (scale == 0) return false;
+    out = std::stoull(text.substr(0, digits)) * scale;
+    return true;
+}
+
+bool ClientOutput::parseLimit(const std::string& spec) {
+    std::istringstream in(spec);
+    std::string name, hard, soft;
+    int64_t seconds = -1;
+    if (!(in >> name >> hard >> soft >> seconds) || seconds < 0) return false;
+
+    ClientClass cls;
+    if (name == "normal") cls = ClientClass::Normal;
+    else if (name == "pubsub") cls = ClientClass::PubSub;
+    else if (name == "replica" || name == "slave") cls = ClientClass::Replica;
+    else return false;
+
+    Limit limit;
+    if (!parseSize(hard, limit.hard) || !parseSize(soft, limit.soft)) return false;
+    limit.soft_seconds = seconds;
+    setLimit(cls, limit);
+    return true;
+}
+
+void ClientOutput::setClass(int fd, ClientClass cls) {
+    auto client = lookup(fd);
+    if (client) client->cls = cls;
+}
+
+size_t ClientOutput::connectedClients() {
+    std::shared_lock<std::shared_mutex> lock(registry_mutex);
+    return clients.size();
+}
+
+uint64_t ClientOutput::disconnections(ClientClass cls) {
+    return disconnected[static_cast<size_t>(cls)];
+}
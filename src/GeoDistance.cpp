@@ -0,0 +1,220 @@
+#include "GeoDistance.hpp"
+#include "GeoEncoding.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// The vector helpers below are always inlined into target-specific kernels, so the
+// by-value vector ABI that -Wpsabi warns about never applies.
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+constexpr double DEG_TO_RAD = M_PI / 180.0;
+
+// Every argument the kernel feeds to sin/cos lies in [-pi/2, pi/2], where these Taylor
+// polynomials are accurate to well below a double ulp, so no range reduction is needed.
+// Coefficients are (-1)^k / (2k+1)! and (-1)^k / (2k)!, highest order first.
+constexpr double SIN_COEFFS[] = {
+    1.0 / 51090942171709440000.0, -1.0 / 121645100408832000.0, 1.0 / 355687428096000.0,
+    -1.0 / 1307674368000.0, 1.0 / 6227020800.0, -1.0 / 39916800.0, 1.0 / 362880.0,
+    -1.0 / 5040.0, 1.0 / 120.0, -1.0 / 6.0,
+};
+constexpr double COS_COEFFS[] = {
+    -1.0 / 1124000727777607680000.0, 1.0 / 2432902008176640000.0, -1.0 / 6402373705728000.0,
+    1.0 / 20922789888000.0, -1.0 / 87178291200.0, 1.0 / 479001600.0, -1.0 / 3628800.0,
+    1.0 / 40320.0, -1.0 / 720.0, 1.0 / 24.0, -1.0 / 2.0,
+};
+
+template <typename V, size_t N>
+__attribute__((always_inline)) inline V horner(const V& x2, const double (&coeffs)[N]) {
+    V p = x2 * coeffs[0] + coeffs[1];
+    for (size_t i = 2; i < N; ++i) p = p * x2 + coeffs[i];
+    return p;
+}
+
+template <typename V>
+__attribute__((always_inline)) inline V sin_poly(const V& x) {
+    V x2 = x * x;
+    return x + x * x2 * horner(x2, SIN_COEFFS);
+}
+
+template <typename V>
+__attribute__((always_inline)) inline V cos_poly(const V& x) {
+    V x2 = x * x;
+    return 1.0 + x2 * horner(x2, COS_COEFFS);
+}
+
+// Haversine term a = sin^2(dlat/2) + cos(lat1) cos(lat2) sin^2(dlon/2); distance is 2R asin(sqrt(a)).
+template <typename V>
+__attribute__((always_inline)) inline V haversine_term(const V& lat, const V& lon, double center_lat_rad, double center_lon_rad, double cos_center_lat) {
+    V lat_rad = lat * DEG_TO_RAD;
+    V half_dlat = (lat_rad - center_lat_rad) * 0.5;
+    V dlon = lon * DEG_TO_RAD - center_lon_rad;
+    dlon = dlon > M_PI ? dlon - 2 * M_PI : dlon;
+    dlon = dlon < -M_PI ? dlon + 2 * M_PI : dlon;
+    V half_dlon = dlon * 0.5;
+
+    V s_lat = sin_poly(half_dlat);
+    V s_lon = sin_poly(half_dlon);
+    return s_lat * s_lat + cos_center_lat * cos_poly(lat_rad) * s_lon * s_lon;
+}
+
+template <typename V>
+__attribute__((always_inline)) inline void haversine_terms(const double* lat, const double* lon, size_t n, double center_lat,
+                                                           double center_lon, double* out) {
+    constexpr size_t width = sizeof(V) / sizeof(double);
+    double clat = center_lat * DEG_TO_RAD;
+    double clon = center_lon * DEG_TO_RAD;
+    double cos_clat = cos(clat);
+
+    size_t i = 0;
+    for (; i + width <= n; i += width) {
+        V la, lo;
+        memcpy(&la, lat + i, sizeof(V));
+        memcpy(&lo, lon + i, sizeof(V));
+        V a = haversine_term(la, lo, clat, clon, cos_clat);
+        memcpy(out + i, &a, sizeof(V));
+    }
+    for (; i < n; ++i) out[i] = haversine_term(lat[i], lon[i], clat, clon, cos_clat);
+}
+
+using TermsFn = void (*)(const double*, const double*, size_t, double, double, double*);
+
+static void terms_scalar(const double* lat, const double* lon, size_t n, double clat, double clon, double* out) {
+    haversine_terms<double>(lat, lon, n, clat, clon, out);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+typedef double v4d __attribute__((vector_size(32)));
+typedef double v8d __attribute__((vector_size(64)));
+
+__attribute__((target("avx2,fma")))
+static void terms_avx2(const double* lat, const double* lon, size_t n, double clat, double clon, double* out) {
+    haversine_terms<v4d>(lat, lon, n, clat, clon, out);
+}
+
+__attribute__((target("avx512f")))
+static void terms_avx512(const double* lat, const double* lon, size_t n, double clat, double clon, double* out) {
+    haversine_terms<v8d>(lat, lon, n, clat, clon, out);
+}
+#endif
+
+static TermsFn select_terms() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return terms_avx512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return terms_avx2;
+#endif
+    return terms_scalar;
+}
+
+static const TermsFn haversine_terms_impl = select_terms();
+
+static double term_to_distance(double a) {
+    return 2.0 * EARTH_RADIUS_IN_METERS * asin(sqrt(std::min(1.0, a)));
+}
+
+double geo_distance(double lat1, double lon1, double lat2, double lon2) {
+    return term_to_distance(haversine_term(lat2, lon2, lat1 * DEG_TO_RAD, lon1 * DEG_TO_RAD, cos(lat1 * DEG_TO_RAD)));
+}
+
+void decode_to_points(const std::vector<uint64_t>& geo_codes, GeoPoints& out) {
+    out.latitude.resize(geo_codes.size());
+    out.longitude.resize(geo_codes.size());
+    decode_batch(geo_codes.data(), geo_codes.size(), out.latitude.data(), out.longitude.data());
+}
+
+// Keeps the points inside the lat/lon bounding box of the given half-extents, padded slightly
+// so rounding never rejects a point on the boundary.
+static void box_candidates(double center_lat, double center_lon, double half_height_m, double half_width_m,
+                           const GeoPoints& points, std::vector<uint32_t>& boxed, GeoPoints& candidates) {
+    double lat_delta = half_height_m / EARTH_RADIUS_IN_METERS / DEG_TO_RAD;
+    double min_cos = 1.0;
+    for (double lat : {center_lat - lat_delta, center_lat, center_lat + lat_delta}) {
+        min_cos = std::min(min_cos, cos(std::clamp(lat, -90.0, 90.0) * DEG_TO_RAD));
+    }
+    double lon_delta = min_cos > 0 ? half_width_m / EARTH_RADIUS_IN_METERS / DEG_TO_RAD / min_cos : LONGITUDE_RANGE;
+    lat_delta = lat_delta * (1 + 1e-9) + 1e-9;
+    lon_delta = lon_delta * (1 + 1e-9) + 1e-9;
+
+    size_t n = points.latitude.size();
+    boxed.reserve(n);
+    candidates.latitude.reserve(n);
+    candidates.longitude.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        double lat = points.latitude[i];
+        double lon = points.longitude[i];
+        double dlon = std::fabs(lon - center_lon);
+        if (dlon > 180.0) dlon = 360.0 - dlon;
+        if (std::fabs(lat - center_lat) <= lat_delta && dlon <= lon_delta) {
+            boxed.push_back(static_cast<uint32_t>(i));
+            candidates.latitude.push_back(lat);
+            candidates.longitude.push_back(lon);
+        }
+    }
+}
+
+void filter_by_radius(double center_lat, double center_lon, double radius_m, const GeoPoints& points,
+                      std::vector<uint32_t>& indices, std::vector<double>& distances) {
+    std::vector<uint32_t> boxed;
+    GeoPoints candidates;
+    box_candidates(center_lat, center_lon, radius_m, radius_m, points, boxed, candidates);
+
+    std::vector<double> terms(boxed.size());
+    haversine_terms_impl(candidates.latitude.data(), candidates.longitude.data(), boxed.size(), center_lat, center_lon, terms.data());
+
+    // Compare haversine terms first so asin/sqrt only run for likely matches.
+    double half_angle = std::min(radius_m / (2.0 * EARTH_RADIUS_IN_METERS), M_PI / 2);
+    double max_term = sin(half_angle) * sin(half_angle) * (1 + 1e-9) + 1e-15;
+    for (size_t k = 0; k < boxed.size(); ++k) {
+        if (terms[k] > max_term) continue;
+        double distance = term_to_distance(terms[k]);
+        if (distance <= radius_m) {
+            indices.push_back(boxed[k]);
+            distances.push_back(distance);
+        }
+    }
+}
+
+void filter_by_box(double center_lat, double center_lon, double width_m, double height_m, const GeoPoints& points,
+                   std::vector<uint32_t>& indices, std::vector<double>& distances) {
+    std::vector<uint32_t> boxed;
+    GeoPoints candidates;
+    box_candidates(center_lat, center_lon, height_m / 2, width_m / 2, points, boxed, candidates);
+
+    std::vector<double> terms(boxed.size());
+    haversine_terms_impl(candidates.latitude.data(), candidates.longitude.data(), boxed.size(), center_lat, center_lon, terms.data());
+
+    // Same rule as Redis: the latitude offset and the longitude offset measured along the
+    // point's own parallel must each fit within half the box.
+    for (size_t k = 0; k < boxed.size(); ++k) {
+        double lat = candidates.latitude[k];
+        double lat_distance = EARTH_RADIUS_IN_METERS * std::fabs(lat - center_lat) * DEG_TO_RAD;
+        if (lat_distance > height_m / 2) continue;
+        double lon_distance = geo_distance(lat, center_lon, lat, candidates.longitude[k]);
+        if (lon_distance > width_m / 2) continue;
+        indices.push_back(boxed[k]);
+        distances.push_back(term_to_distance(terms[k]));
+    }
+}
+
+double min_distance_to_cell(double latitude, double longitude, const GeoCell& cell) {
+    double dlat = 0;
+    if (latitude < cell.min_latitude) dlat = cell.min_latitude - latitude;
+    else if (latitude > cell.max_latitude) dlat = latitude - cell.max_latitude;
+
+    auto wrapped = [](double d) {
+        d = std::fabs(d);
+        return d > 180.0 ? 360.0 - d : d;
+    };
+    double dlon = 0;
+    if (longitude < cell.min_longitude || longitude > cell.max_longitude) {
+        dlon = std::min(wrapped(longitude - cell.min_longitude), wrapped(longitude - cell.max_longitude));
+    }
+
+    // Each haversine term is bounded from below separately; cos(lat) over the cell is
+    // smallest at one of its edges.
+    double min_cos = std::min(cos(cell.min_latitude * DEG_TO_RAD), cos(cell.max_latitude * DEG_TO_RAD));
+    double s_lat = sin(dlat * DEG_TO_RAD / 2);
+    double s_lon = sin(dlon * DEG_TO_RAD / 2);
+    return term_to_distance(s_lat * s_lat + cos(latitude * DEG_TO_RAD) * min_cos * s_lon * s_lon);
+}
@@ -1,5 +1,12 @@
 #include "GeoEncoding.hpp"
 #include <cmath>
+#include <algorithm>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+static constexpr uint64_t EVEN_BITS = 0x5555555555555555ULL;
+static constexpr uint64_t ODD_BITS = 0xAAAAAAAAAAAAAAAAULL;
 
 static uint64_t spread_int32_to_int64(uint32_t v) {
     uint64_t result = v;
@@ -7,7 +14,7 @@ static uint64_t spread_int32_to_int64(uint32_t v) {
     result = (result | (result << 8))  & 0x00FF00FF00FF00FFULL;
     result = (result | (result << 4))  & 0x0F0F0F0F0F0F0F0FULL;
     result = (result | (result << 2))  & 0x3333333333333333ULL;
-    result = (result | (result << 1))  & 0x5555555555555555ULL;
+    result = (result | (result << 1))  & EVEN_BITS;
     return result;
 }
 
@@ -15,21 +22,8 @@ static uint64_t interleave(uint32_t x, uint32_t y) {
     return spread_int32_to_int64(x) | (spread_int32_to_int64(y) << 1);
 }
 
-uint64_t encode(double latitude, double longitude) {
-    constexpr double LAT_RANGE = MAX_LATITUDE - MIN_LATITUDE;
-    constexpr double LON_RANGE = MAX_LONGITUDE - MIN_LONGITUDE;
-
-    double norm_lat = pow(2, 26) * (latitude - MIN_LATITUDE) / LAT_RANGE;
-    double norm_lon = pow(2, 26) * (longitude - MIN_LONGITUDE) / LON_RANGE;
-
-    uint32_t lat_int = static_cast<uint32_t>(norm_lat);
-    uint32_t lon_int = static_cast<uint32_t>(norm_lon);
-
-    return interleave(lat_int, lon_int);
-}
-
-uint32_t compact_int64_to_int32(uint64_t v) {
-    v = v & 0x5555555555555555ULL;
+static uint32_t compact_int64_to_int32(uint64_t v) {
+    v = v & EVEN_BITS;
     v = (v | (v >> 1)) & 0x3333333333333333ULL;
     v = (v | (v >> 2)) & 0x0F0F0F0F0F0F0F0FULL;
     v = (v | (v >> 4)) & 0x00FF00FF00FF00FFULL;
@@ -38,11 +32,19 @@ uint32_t compact_int64_to_int32(uint64_t v) {
     return static_cast<uint32_t>(v);
 }
 
-Coordinates convert_grid_numbers_to_coordinates(uint32_t grid_latitude_number, uint32_t grid_longitude_number) {
-    double grid_latitude_min = MIN_LATITUDE + LATITUDE_RANGE * (grid_latitude_number / pow(2, 26));
-    double grid_latitude_max = MIN_LATITUDE + LATITUDE_RANGE * ((grid_latitude_number + 1) / pow(2, 26));
-    double grid_longitude_min = MIN_LONGITUDE + LONGITUDE_RANGE * (grid_longitude_number / pow(2, 26));
-    double grid_longitude_max = MIN_LONGITUDE + LONGITUDE_RANGE * ((grid_longitude_number + 1) / pow(2, 26));
+static uint32_t latitude_grid_number(double latitude) {
+    return static_cast<uint32_t>(GEO_SCALE * (latitude - MIN_LATITUDE) / LATITUDE_RANGE);
+}
+
+static uint32_t longitude_grid_number(double longitude) {
+    return static_cast<uint32_t>(GEO_SCALE * (longitude - MIN_LONGITUDE) / LONGITUDE_RANGE);
+}
+
+static Coordinates convert_grid_numbers_to_coordinates(uint32_t grid_latitude_number, uint32_t grid_longitude_number) {
+    double grid_latitude_min = MIN_LATITUDE + LATITUDE_RANGE * (grid_latitude_number / GEO_SCALE);
+    double grid_latitude_max = MIN_LATITUDE + LATITUDE_RANGE * ((grid_latitude_number + 1) / GEO_SCALE);
+    double grid_longitude_min = MIN_LONGITUDE + LONGITUDE_RANGE * (grid_longitude_number / GEO_SCALE);
+    double grid_longitude_max = MIN_LONGITUDE + LONGITUDE_RANGE * ((grid_longitude_number + 1) / GEO_SCALE);
     
     Coordinates result;
     result.latitude = (grid_latitude_min + grid_latitude_max) / 2;
@@ -51,12 +53,136 @@ Coordinates convert_grid_numbers_to_coordinates(uint32_t grid_latitude_number, u
     return result;
 }
 
+static void encode_batch_portable(const double* latitudes, const double* longitudes, size_t n, uint64_t* out) {
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = interleave(latitude_grid_number(latitudes[i]), longitude_grid_number(longitudes[i]));
+    }
+}
+
+static void decode_batch_portable(const uint64_t* geo_codes, size_t n, double* latitudes, double* longitudes) {
+    for (size_t i = 0; i < n; ++i) {
+        Coordinates c = convert_grid_numbers_to_coordinates(compact_int64_to_int32(geo_codes[i]),
+                                                            compact_int64_to_int32(geo_codes[i] >> 1));
+        latitudes[i] = c.latitude;
+        longitudes[i] = c.longitude;
+    }
+}
+
+#if defined(__x86_64__)
+// PDEP scatters the grid numbers straight onto the even (latitude) and odd (longitude)
+// bits, and PEXT gathers them back, replacing the shift-and-mask ladders.
+__attribute__((target("bmi2")))
+static void encode_batch_bmi2(const double* latitudes, const double* longitudes, size_t n, uint64_t* out) {
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = _pdep_u64(latitude_grid_number(latitudes[i]), EVEN_BITS) |
+                 _pdep_u64(longitude_grid_number(longitudes[i]), ODD_BITS);
+    }
+}
+
+__attribute__((target("bmi2")))
+static void decode_batch_bmi2(const uint64_t* geo_codes, size_t n, double* latitudes, double* longitudes) {
+    for (size_t i = 0; i < n; ++i) {
+        Coordinates c = convert_grid_numbers_to_coordinates(static_cast<uint32_t>(_pext_u64(geo_codes[i], EVEN_BITS)),
+                                                            static_cast<uint32_t>(_pext_u64(geo_codes[i], ODD_BITS)));
+        latitudes[i] = c.latitude;
+        longitudes[i] = c.longitude;
+    }
+}
+#endif
+
+using EncodeBatchFn = void (*)(const double*, const double*, size_t, uint64_t*);
+using DecodeBatchFn = void (*)(const uint64_t*, size_t, double*, double*);
+
+static bool has_fast_bmi2() {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    // PDEP/PEXT are microcoded and slower than the portable path on AMD before Zen 3,
+    // which reports BMI2 but not VAES; use that as the cut-off.
+    if (!__builtin_cpu_supports("bmi2")) return false;
+    return !__builtin_cpu_is("amd") || __builtin_cpu_supports("vaes");
+#else
+    return false;
+#endif
+}
+
+static const bool use_bmi2 = has_fast_bmi2();
+
+void encode_batch(const double* latitudes, const double* longitudes, size_t n, uint64_t* out) {
+#if defined(__x86_64__)
+    if (use_bmi2) return encode_batch_bmi2(latitudes, longitudes, n, out);
+#endif
+    encode_batch_portable(latitudes, longitudes, n, out);
+}
+
+void decode_batch(const uint64_t* geo_codes, size_t n, double* latitudes, double* longitudes) {
+#if defined(__x86_64__)
+    if (use_bmi2) return decode_batch_bmi2(geo_codes, n, latitudes, longitudes);
+#endif
+    decode_batch_portable(geo_codes, n, latitudes, longitudes);
+}
+
+uint64_t encode(double latitude, double longitude) {
+    uint64_t geo_code;
+    encode_batch(&latitude, &longitude, 1, &geo_code);
+    return geo_code;
+}
+
 Coordinates decode(uint64_t geo_code) {
-    uint64_t y = geo_code >> 1;
-    uint64_t x = geo_code;
-    
-    uint32_t grid_latitude_number = compact_int64_to_int32(x);
-    uint32_t grid_longitude_number = compact_int64_to_int32(y);
-    
-    return convert_grid_numbers_to_coordinates(grid_latitude_number, grid_longitude_number);
+    Coordinates result;
+    decode_batch(&geo_code, 1, &result.latitude, &result.longitude);
+    return result;
 }
+
+static uint32_t grid_number(double value, double min, double range) {
+    double norm = GEO_SCALE * (value - min) / range;
+    return static_cast<uint32_t>(std::clamp(norm, 0.0, GEO_SCALE - 1));
+}
+
+static double meters_to_degrees(double meters) {
+    return meters / EARTH_RADIUS_IN_METERS * 180.0 / M_PI;
+}
+
+std::vector<GeoCell> covering_cells(double latitude, double longitude, double half_height_m, double half_width_m) {
+    double lat_delta = meters_to_degrees(half_height_m);
+
+    // Longitude degrees shrink towards the poles, so size the box by its widest latitude.
+    double min_cos = 1.0;
+    for (double lat : {latitude - lat_delta, latitude, latitude + lat_delta}) {
+        min_cos = std::min(min_cos, cos(std::clamp(lat, -90.0, 90.0) * M_PI / 180.0));
+    }
+    double lon_delta = min_cos > 0 ? meters_to_degrees(half_width_m) / min_cos : LONGITUDE_RANGE;
+
+    // Every neighbour is a whole cell wide, so the 3x3 block covers the box as soon as
+    // a single cell is at least as large as the box half-extent in both directions.
+    int step = GEO_STEP_MAX;
+    while (step > 1 && (LATITUDE_RANGE / (1 << step) < lat_delta || LONGITUDE_RANGE / (1 << step) < lon_delta)) {
+        step--;
+    }
+
+    int shift = GEO_STEP_MAX - step;
+    int64_t cells = int64_t{1} << step;
+    int64_t lat_cell = grid_number(latitude, MIN_LATITUDE, LATITUDE_RANGE) >> shift;
+    int64_t lon_cell = grid_number(longitude, MIN_LONGITUDE, LONGITUDE_RANGE) >> shift;
+
+    double cell_height = LATITUDE_RANGE / cells;
+    double cell_width = LONGITUDE_RANGE / cells;
+
+    std::vector<GeoCell> result;
+    result.reserve(9);
+    for (int64_t dlat = -1; dlat <= 1; ++dlat) {
+        int64_t row = lat_cell + dlat;
+        if (row < 0 || row >= cells) continue;
+        for (int64_t dlon = -1; dlon <= 1; ++dlon) {
+            int64_t col = (lon_cell + dlon + cells) % cells;
+            uint64_t hash = interleave(static_cast<uint32_t>(row), static_cast<uint32_t>(col));
+            GeoScoreRange range{hash << (2 * shift), (hash + 1) << (2 * shift)};
+            bool seen = std::any_of(result.begin(), result.end(), [&](const GeoCell& c) { return c.range.min == range.min; });
+            if (seen) continue;
+
+            result.push_back({range,
+                              MIN_LATITUDE + row * cell_height, MIN_LATITUDE + (row + 1) * cell_height,
+                              MIN_LONGITUDE + col * cell_width, MIN_LONGITUDE + (col + 1) * cell_width});
+        }
+    }
+    return result;
+}
\ No newline at end of file
@@ -1,15 +1,24 @@
 #include "GeoHandler.hpp"
 #include "GeoEncoding.hpp"
+#include "GeoDistance.hpp"
+#include "NumericCodec.hpp"
+#include "StoreLock.hpp"
 #include <sstream>
 #include <iostream>
-#include <iomanip>
 #include <cmath>
+#include <algorithm>
+#include <charconv>
+#include <optional>
 
 GeoHandler::GeoHandler(SortedSetHandler* ssHandler)
     : sortedSetHandler(ssHandler) {}
 
 bool GeoHandler::isGeoCommand(const std::string& cmd) {
-    return cmd == "GEOADD" || cmd == "GEOPOS" || cmd == "GEODIST" || cmd == "GEOSEARCH";
+    return cmd == "GEOADD" || cmd == "GEOPOS" || cmd == "GEODIST" || cmd == "GEOSEARCH" || cmd == "GEOSEARCHSTORE";
+}
+
+bool GeoHandler::isWriteCommand(const std::string& cmd) {
+    return cmd == "GEOADD" || cmd == "GEOSEARCHSTORE";
 }
 
 void GeoHandler::handleCommand(const std::string& cmd, const std::vector<std::string>& args) {
@@ -17,36 +26,58 @@ void GeoHandler::handleCommand(const std::string& cmd, const std::vector<std::st
     else if (cmd == "GEOPOS") handleGeoPos(args);
     else if (cmd == "GEODIST") handleGeoDis(args);
     else if (cmd == "GEOSEARCH") handleGeoSearch(args);
+    else if (cmd == "GEOSEARCHSTORE") handleGeoSearchStore(args);
     else sortedSetHandler->sendResponse("-ERR Unsupported geo command\r\n");
 }
 
 void GeoHandler::handleGeoAdd(const std::vector<std::string>& args) {
-    if (args.size() < 4) {
+    if (args.size() < 4 || (args.size() - 1) % 3 != 0) {
         sortedSetHandler->sendResponse("-ERR GEOADD requires key, longitude, latitude and member\r\n");
         return;
     }
 
     const std::string& key = args[0];
-    double longitude = std::stod(args[1]);
-    double latitude = std::stod(args[2]);
-    const std::string& member = args[3];
-
-    bool invalidLongitude = longitude < -180.0 || longitude > 180.0;
-    bool invalidLatitude  = latitude  < -85.05112878 || latitude  > 85.05112878;
-
-    if (invalidLongitude || invalidLatitude) {
-        std::ostringstream err;
-        err << "-ERR invalid ";
-        if (invalidLongitude) err << "longitude";
-        if (invalidLongitude && invalidLatitude) err << ",";
-        if (invalidLatitude) err << "latitude";
-        err << " value\r\n";
-        sortedSetHandler->sendResponse(err.str());
-        return;
+    size_t n = (args.size() - 1) / 3;
+    std::vector<double> longitudes(n), latitudes(n);
+
+    for (size_t i = 0; i < n; ++i) {
+        auto lonOpt = Numeric::parseDouble(args[1 + 3 * i]);
+        auto latOpt = Numeric::parseDouble(args[2 + 3 * i]);
+        if (!lonOpt || !latOpt) {
+            sortedSetHandler->sendResponse("-ERR value is not a valid float\r\n");
+            return;
+        }
+        double longitude = *lonOpt;
+        double latitude = *latOpt;
+
+        bool invalidLongitude = longitude < MIN_LONGITUDE || longitude > MAX_LONGITUDE;
+        bool invalidLatitude  = latitude  < MIN_LATITUDE || latitude  > MAX_LATITUDE;
+
+        if (invalidLongitude || invalidLatitude) {
+            std::ostringstream err;
+            err << "-ERR invalid ";
+            if (invalidLongitude) err << "longitude";
+            if (invalidLongitude && invalidLatitude) err << ",";
+            if (invalidLatitude) err << "latitude";
+            err << " value\r\n";
+            sortedSetHandler->sendResponse(err.str());
+            return;
+        }
+        longitudes[i] = longitude;
+        latitudes[i] = latitude;
+    }
+
+    std::vector<uint64_t> scores(n);
+    encode_batch(latitudes.data(), longitudes.data(), n, scores.data());
+
+    std::vector<std::pair<std::string, double>> members;
+    members.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        members.emplace_back(args[3 + 3 * i], static_cast<double>(scores[i]));
     }
 
-    uint64_t score = encode(latitude, longitude);
-    sortedSetHandler->handleZAdd({key, std::to_string(static_cast<double>(score)), member});
+    size_t added = sortedSetHandler->addMembers(key, members);
+    sortedSetHandler->sendResponse(":" + std::to_string(added) + "\r\n");
 }
 
 void GeoHandler::handleGeoPos(const std::vector<std::string>& args) {
@@ -58,32 +89,24 @@ void GeoHandler::handleGeoPos(const std::vector<std::string>& args) {
     const std::string& key = args[0];
     std::vector<std::string> members(args.begin() + 1, args.end());
 
-    std::ostringstream resp;
-    resp << "*" << members.size() << "\r\n";
+    std::string resp = "*" + std::to_string(members.size()) + "\r\n";
 
     for (const auto& member : members) {
         auto scoreOpt = sortedSetHandler->getScore(key, member); 
         if (!scoreOpt.has_value()) {
-            resp << "*-1\r\n";  
+            resp += "*-1\r\n";  
             continue;
         }
 
         uint64_t score = static_cast<uint64_t>(scoreOpt.value());
         Coordinates coords = decode(score);
 
-        std::ostringstream lonSs, latSs;
-        lonSs << std::setprecision(17) << coords.longitude;
-        latSs << std::setprecision(17) << coords.latitude;
-
-        std::string lonStr = lonSs.str();
-        std::string latStr = latSs.str();
-
-        resp << "*2\r\n";
-        resp << "$" << lonStr.size() << "\r\n" << lonStr << "\r\n";
-        resp << "$" << latStr.size() << "\r\n" << latStr << "\r\n";
+        resp += "*2\r\n";
+        Numeric::appendBulkDouble(resp, coords.longitude);
+        Numeric::appendBulkDouble(resp, coords.latitude);
     }
 
-    sortedSetHandler->sendResponse(resp.str());
+    sortedSetHandler->sendResponse(resp);
 }
 
 void GeoHandler::handleGeoDis(const std::vector<std::string>& args) {
@@ -110,87 +133,256 @@ void GeoHandler::handleGeoDis(const std::vector<std::string>& args) {
     Coordinates coords1 = decode(score1);
     Coordinates coords2 = decode(score2);
 
-    double distance = haversine(coords1.latitude, coords1.longitude, coords2.latitude, coords2.longitude);
+    double distance = geo_distance(coords1.latitude, coords1.longitude, coords2.latitude, coords2.longitude);
 
-    std::ostringstream distSs;
-    distSs << std::setprecision(17) << distance;
-    std::string distStr = distSs.str();
-
-    std::ostringstream resp;
-    resp << "$" << distStr.size() << "\r\n" << distStr << "\r\n";
-    sortedSetHandler->sendResponse(resp.str());
+    std::string resp;
+    Numeric::appendBulkDouble(resp, distance);
+    sortedSetHandler->sendResponse(resp);
 }
 
-double GeoHandler::haversine(double lat1, double lon1, double lat2, double lon2) {
-    const double R = 6372797.560856; 
-    double dLat = (lat2 - lat1) * M_PI / 180.0;
-    double dLon = (lon2 - lon1) * M_PI / 180.0;
+static std::optional<double> unitToMeters(std::string unit) {
+    std::transform(unit.begin(), unit.end(), unit.begin(), ::tolower);
+    if (unit == "m") return 1.0;
+    if (unit == "km") return 1000.0;
+    if (unit == "mi") return 1609.344;
+    if (unit == "ft") return 0.3048;
+    return std::nullopt;
+}
 
-    lat1 = lat1 * M_PI / 180.0;
-    lat2 = lat2 * M_PI / 180.0;
+struct GeoMatch {
+    std::string member;
+    double score;
+    double distance;
+};
 
-    double a = sin(dLat/2) * sin(dLat/2) + sin(dLon/2) * sin(dLon/2) * cos(lat1) * cos(lat2);
-    double c = 2 * atan2(sqrt(a), sqrt(1-a));
+void GeoHandler::handleGeoSearch(const std::vector<std::string>& args) {
+    runGeoSearch("GEOSEARCH", args, false);
+}
 
-    return R * c;
-}   
+void GeoHandler::handleGeoSearchStore(const std::vector<std::string>& args) {
+    runGeoSearch("GEOSEARCHSTORE", args, true);
+}
 
-void GeoHandler::handleGeoSearch(const std::vector<std::string>& args){
-    if (args.size() < 7) {
-        sortedSetHandler->sendResponse("-ERR GEOSEARCH requires key FROMLONLAT <lon> <lat> BYRADIUS <radius> <unit>\r\n");
+void GeoHandler::runGeoSearch(const std::string& cmd, const std::vector<std::string>& args, bool store) {
+    size_t first = store ? 2 : 1;
+    if (args.size() < first) {
+        sortedSetHandler->sendResponse("-ERR " + cmd + " requires a key\r\n");
         return;
     }
+    const std::string& key = args[first - 1];
+
+    enum class Sort { None, Asc, Desc };
+    int fromCount = 0, byCount = 0;
+    std::optional<std::string> fromMember;
+    double centerLon = 0, centerLat = 0;
+    bool byBox = false;
+    double radius = 0, width = 0, height = 0, unitFactor = 1.0;
+    Sort sort = Sort::None;
+    size_t count = 0;
+    bool any = false, withDist = false, withCoord = false, withHash = false, storeDist = false;
+
+    for (size_t i = first; i < args.size(); ++i) {
+        std::string opt = args[i];
+        std::transform(opt.begin(), opt.end(), opt.begin(), ::toupper);
+        size_t left = args.size() - i - 1;
+
+        if (opt == "FROMMEMBER" && left >= 1) {
+            fromMember = args[++i];
+            fromCount++;
+        } else if (opt == "FROMLONLAT" && left >= 2) {
+            auto lon = Numeric::parseDouble(args[i + 1]);
+            auto lat = Numeric::parseDouble(args[i + 2]);
+            if (!lon || !lat) {
+                sortedSetHandler->sendResponse("-ERR value is not a valid float\r\n");
+                return;
+            }
+            if (*lon < MIN_LONGITUDE || *lon > MAX_LONGITUDE || *lat < MIN_LATITUDE || *lat > MAX_LATITUDE) {
+                sortedSetHandler->sendResponse("-ERR invalid longitude,latitude pair " + args[i + 1] + "," + args[i + 2] + "\r\n");
+                return;
+            }
+            centerLon = *lon;
+            centerLat = *lat;
+            fromCount++;
+            i += 2;
+        } else if ((opt == "BYRADIUS" && left >= 2) || (opt == "BYBOX" && left >= 3)) {
+            byBox = opt == "BYBOX";
+            size_t sizes = byBox ? 2 : 1;
+            std::vector<double> extents;
+            for (size_t k = 1; k <= sizes; ++k) {
+                auto v = Numeric::parseDouble(args[i + k]);
+                if (!v || *v < 0) {
+                    sortedSetHandler->sendResponse(byBox ? "-ERR need numeric width and height\r\n" : "-ERR need numeric radius\r\n");
+                    return;
+                }
+                extents.push_back(*v);
+            }
+            auto factor = unitToMeters(args[i + sizes + 1]);
+            if (!factor) {
+                sortedSetHandler->sendResponse("-ERR unsupported unit provided. please use M, KM, FT, MI\r\n");
+                return;
+            }
+            unitFactor = *factor;
+            if (byBox) {
+                width = extents[0] * unitFactor;
+                height = extents[1] * unitFactor;
+            } else {
+                radius = extents[0] * unitFactor;
+            }
+            byCount++;
+            i += sizes + 1;
+        } else if (opt == "ASC") {
+            sort = Sort::Asc;
+        } else if (opt == "DESC") {
+            sort = Sort::Desc;
+        } else if (opt == "COUNT" && left >= 1) {
+            const std::string& text = args[++i];
+            long long n = 0;
+            auto res = std::from_chars(text.data(), text.data() + text.size(), n);
+            if (res.ec != std::errc{} || res.ptr != text.data() + text.size()) {
+                sortedSetHandler->sendResponse("-ERR value is not an integer or out of range\r\n");
+                return;
+            }
+            if (n <= 0) {
+                sortedSetHandler->sendResponse("-ERR COUNT must be > 0\r\n");
+                return;
+            }
+            count = static_cast<size_t>(n);
+            if (i + 1 < args.size()) {
+                std::string next = args[i + 1];
+                std::transform(next.begin(), next.end(), next.begin(), ::toupper);
+                if (next == "ANY") {
+                    any = true;
+                    i++;
+                }
+            }
+        } else if (!store && opt == "WITHDIST") {
+            withDist = true;
+        } else if (!store && opt == "WITHCOORD") {
+            withCoord = true;
+        } else if (!store && opt == "WITHHASH") {
+            withHash = true;
+        } else if (store && opt == "STOREDIST") {
+            storeDist = true;
+        } else {
+            sortedSetHandler->sendResponse("-ERR syntax error\r\n");
+            return;
+        }
+    }
 
-    const std::string& key = args[0];
-
-    if (args[1] != "FROMLONLAT") {
-        sortedSetHandler->sendResponse("-ERR Only FROMLONLAT mode supported\r\n");
+    if (fromCount != 1) {
+        sortedSetHandler->sendResponse("-ERR exactly one of FROMMEMBER or FROMLONLAT can be specified for " + cmd + "\r\n");
         return;
     }
-
-    double centerLon = std::stod(args[2]);
-    double centerLat = std::stod(args[3]);
-
-    if (args[4] != "BYRADIUS") {
-        sortedSetHandler->sendResponse("-ERR Only BYRADIUS search supported\r\n");
+    if (byCount != 1) {
+        sortedSetHandler->sendResponse("-ERR exactly one of BYRADIUS and BYBOX can be specified for " + cmd + "\r\n");
         return;
     }
 
-    double radius = std::stod(args[5]);
-    std::string unit = args[6];
-
-    if (unit == "m") {
-        // already meters
-    } else if (unit == "km") {
-        radius *= 1000.0;
-    } else if (unit == "mi") {
-        radius *= 1609.344;
-    } else if (unit == "ft") {
-        radius *= 0.3048;
-    } else {
-        sortedSetHandler->sendResponse("-ERR Unsupported unit\r\n");
-        return;
+    // The centre and every cell are read from one version of the set, so a concurrent GEOADD
+    // cannot move a member between cells mid-scan.
+    StoreLock lock(SortedSetHandler::storeMutex());
+    if (fromMember) {
+        auto score = sortedSetHandler->getScoreLocked(key, *fromMember);
+        if (!score) {
+            sortedSetHandler->sendResponse("-ERR could not decode requested zset member\r\n");
+            return;
+        }
+        Coordinates coords = decode(static_cast<uint64_t>(*score));
+        centerLat = coords.latitude;
+        centerLon = coords.longitude;
     }
 
-    auto membersWithScores = sortedSetHandler->getAllWithScores(key);
+    // A plain COUNT returns the nearest matches, as in Redis.
+    bool bounded = count > 0 && !any;
+    if (bounded && sort == Sort::None) sort = Sort::Asc;
+
+    // Cells are visited nearest-first so a full COUNT heap can stop as soon as its farthest
+    // match is closer than anything a remaining cell could hold.
+    auto cells = covering_cells(centerLat, centerLon, byBox ? height / 2 : radius, byBox ? width / 2 : radius);
+    std::vector<std::pair<double, size_t>> visitOrder;
+    for (size_t c = 0; c < cells.size(); ++c) {
+        visitOrder.emplace_back(min_distance_to_cell(centerLat, centerLon, cells[c]), c);
+    }
+    std::sort(visitOrder.begin(), visitOrder.end());
+
+    // Heap of the best `count` matches; its front is the one to evict next.
+    auto evictFirst = [sort](const GeoMatch& a, const GeoMatch& b) {
+        return sort == Sort::Desc ? a.distance > b.distance : a.distance < b.distance;
+    };
+
+    std::vector<GeoMatch> matches;
+    std::vector<std::pair<std::string, double>> candidates;
+    bool done = false;
+    for (const auto& [lowerBound, c] : visitOrder) {
+        if (done) break;
+        if (bounded && sort == Sort::Asc && matches.size() == count && matches.front().distance <= lowerBound) break;
+
+        candidates.clear();
+        sortedSetHandler->appendInScoreRangeLocked(key, static_cast<double>(cells[c].range.min), static_cast<double>(cells[c].range.max), candidates);
+        if (candidates.empty()) continue;
+
+        std::vector<uint64_t> geoCodes;
+        geoCodes.reserve(candidates.size());
+        for (const auto& [member, score] : candidates) geoCodes.push_back(static_cast<uint64_t>(score));
+        GeoPoints points;
+        decode_to_points(geoCodes, points);
+
+        std::vector<uint32_t> hits;
+        std::vector<double> distances;
+        if (byBox) filter_by_box(centerLat, centerLon, width, height, points, hits, distances);
+        else filter_by_radius(centerLat, centerLon, radius, points, hits, distances);
+
+        for (size_t k = 0; k < hits.size(); ++k) {
+            GeoMatch match{std::move(candidates[hits[k]].first), candidates[hits[k]].second, distances[k]};
+            if (!bounded) {
+                matches.push_back(std::move(match));
+                if (any && matches.size() == count) {
+                    done = true;
+                    break;
+                }
+            } else if (matches.size() < count) {
+                matches.push_back(std::move(match));
+                std::push_heap(matches.begin(), matches.end(), evictFirst);
+            } else if (evictFirst(match, matches.front())) {
+                std::pop_heap(matches.begin(), matches.end(), evictFirst);
+                matches.back() = std::move(match);
+                std::push_heap(matches.begin(), matches.end(), evictFirst);
+            }
+        }
+    }
 
-    std::vector<std::string> results;
+    lock.unlock();
 
-    for (const auto& [member, score] : membersWithScores) {
-        uint64_t scoreVal = static_cast<uint64_t>(score);
-        Coordinates coords = decode(scoreVal);
-        double distance = haversine(centerLat, centerLon, coords.latitude, coords.longitude);
+    if (sort == Sort::Asc) {
+        std::stable_sort(matches.begin(), matches.end(), [](const GeoMatch& a, const GeoMatch& b) { return a.distance < b.distance; });
+    } else if (sort == Sort::Desc) {
+        std::stable_sort(matches.begin(), matches.end(), [](const GeoMatch& a, const GeoMatch& b) { return a.distance > b.distance; });
+    }
 
-        if (distance <= radius) {
-            results.push_back(member);
-        }
+    if (store) {
+        std::vector<std::pair<std::string, double>> members;
+        members.reserve(matches.size());
+        for (auto& m : matches) members.emplace_back(std::move(m.member), storeDist ? m.distance / unitFactor : m.score);
+        size_t stored = members.size();
+        sortedSetHandler->replaceMembers(args[0], std::move(members));
+        sortedSetHandler->sendResponse(":" + std::to_string(stored) + "\r\n");
+        return;
     }
 
-    std::ostringstream resp;
-    resp << "*" << results.size() << "\r\n";
-    for (const auto& m : results) {
-        resp << "$" << m.size() << "\r\n" << m << "\r\n";
+    size_t fields = 1 + withDist + withHash + withCoord;
+    std::string resp = "*" + std::to_string(matches.size()) + "\r\n";
+    for (const auto& m : matches) {
+        if (fields > 1) resp += "*" + std::to_string(fields) + "\r\n";
+        resp += "$" + std::to_string(m.member.size()) + "\r\n" + m.member + "\r\n";
+        if (withDist) Numeric::appendBulkDouble(resp, m.distance / unitFactor);
+        if (withHash) resp += ":" + std::to_string(static_cast<uint64_t>(m.score)) + "\r\n";
+        if (withCoord) {
+            Coordinates coords = decode(static_cast<uint64_t>(m.score));
+            resp += "*2\r\n";
+            Numeric::appendBulkDouble(resp, coords.longitude);
+            Numeric::appendBulkDouble(resp, coords.latitude);
+        }
     }
 
-    sortedSetHandler->sendResponse(resp.str());
-}
\ No newline at end of file
+    sortedSetHandler->sendResponse(resp);
+}
@@ -1,21 +1,99 @@
 #include "Handler.hpp"
+#include "AppendOnlyFile.hpp"
+#include "ClientOutput.hpp"
+#include "KeyWatch.hpp"
+#include "Propagation.hpp"
+#include "RdbSnapshot.hpp"
+#include <algorithm>
+#include <iterator>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <utility>
 #include <sstream>
 #include <iostream>
 
 Handler::Handler(int client_fd, bool replica, ReplicationManager* rm, const std::string& dir, const std::string& filename)
     : client_fd(client_fd), isReplica(replica),
-      rdbReader((dir.empty() ? filename : (dir + "/" + filename))),   
-      kvHandler(client_fd, &rdbReader),
+      rdb_dir(dir), rdb_filename(filename),
+      kvHandler(client_fd),
       listHandler(client_fd),
-      streamHandler(client_fd), replManager(rm), 
+      streamHandler(client_fd),
       pubSubHandler(client_fd),
       sortedSetHandler(client_fd),
-      geoHandler(&sortedSetHandler),    
-      rdb_dir(dir), rdb_filename(filename) {
-        rdbReader.load();
-      }
+      geoHandler(&sortedSetHandler),
+      scriptingHandler(client_fd,
+                       [this](const std::string& name, const std::vector<std::string>& args, bool& wrote) { return runFromScript(name, args, wrote); }),
+      replManager(rm) {}
+
+Handler::~Handler() {
+    unwatchAll();
+}
+
+void Handler::unwatchAll() {
+    for (const auto& [key, version] : watched_keys) KeyWatch::unwatch(key);
+    watched_keys.clear();
+}
+
+bool Handler::watchedKeysChanged() const {
+    for (const auto& [key, version] : watched_keys) {
+        if (KeyWatch::version(key) != version) return true;
+    }
+    return false;
+}
+
+std::vector<std::mutex*> Handler::allStores() {
+    return {&KvStoreHandler::storeMutex(), &ListStoreHandler::storeMutex(), &StreamStoreHandler::storeMutex(), &SortedSetHandler::storeMutex()};
+}
+
+void Handler::addStoresFor(const std::string& name, std::vector<std::mutex*>& stores) {
+    if (kvHandler.isKvCommand(name)) stores.push_back(&KvStoreHandler::storeMutex());
+    else if (listHandler.isListCommand(name)) stores.push_back(&ListStoreHandler::storeMutex());
+    else if (streamHandler.isStreamCommand(name)) stores.push_back(&StreamStoreHandler::storeMutex());
+    else if (sortedSetHandler.isSortedSetCommand(name) || geoHandler.isGeoCommand(name)) stores.push_back(&SortedSetHandler::storeMutex());
+    // A script may touch any store.
+    else if (scriptingHandler.isScriptCommand(name)) stores = allStores();
+}
+
+// Scripts may call data commands and publish, but not change the connection's state.
+bool Handler::runFromScript(const std::string& name, const std::vector<std::string>& args, bool& wrote) {
+    bool allowed = kvHandler.isKvCommand(name) || listHandler.isListCommand(name) || streamHandler.isStreamCommand(name) ||
+                   sortedSetHandler.isSortedSetCommand(name) || geoHandler.isGeoCommand(name) ||
+                   name == "PUBLISH" || name == "SPUBLISH";
+    if (!allowed) return false;
+    wrote = isWriteCommand(name);
+    runCommand(name, args);
+    return true;
+}
+
+// Runs the queued commands as one isolated batch: every store they touch is locked once up
+// front, in a fixed order, and all of their replies go out as a single write.
+void Handler::execTransaction() {
+    std::vector<std::mutex*> stores;
+    for (const auto& [qname, qargs] : queued_commands) addStoresFor(qname, stores);
+    StoreLock::acquireBatch(std::move(stores));
+    beginPropagationBatch();
+
+    std::string replies = ClientOutput::collect(client_fd, [&]() {
+        // An optimistic transaction aborts if any watched key changed since WATCH.
+        if (watchedKeysChanged()) {
+            sendResponse("*-1\r\n");
+            return;
+        }
+        sendResponse("*" + std::to_string(queued_commands.size()) + "\r\n");
+        for (auto& [qname, qargs] : queued_commands) {
+            try {
+                runCommand(qname, qargs);
+            } catch (const std::exception& e) {
+                sendResponse("-ERR " + std::string(e.what()) + "\r\n");
+            }
+        }
+    });
+
+    endPropagationBatch();
+    StoreLock::releaseBatch();
+    unwatchAll();
+    if (!replies.empty()) ClientOutput::send(client_fd, std::make_shared<const std::string>(std::move(replies)));
+}
 
 void Handler::handleMessage(const std::string& message) {
     Parser parser;
@@ -48,15 +126,7 @@ void Handler::handleMessage(const std::string& message) {
                 sendResponse("-ERR EXEC without MULTI\r\n");
             } else {
                 in_transaction = false;
-                if (queued_commands.empty()) {
-                    sendResponse("*0\r\n");
-                } else {
-                    sendResponse("*" + std::to_string(queued_commands.size()) + "\r\n");
-                    for (auto& [qname, qargs] : queued_commands) {
-                        executeCommand(qname, qargs);
-                        propagateIfWrite(qname, qargs);
-                    }
-                }
+                execTransaction();
                 queued_commands.clear();
             }
         } else if (name == "DISCARD") {
@@ -65,8 +135,33 @@ void Handler::handleMessage(const std::string& message) {
             } else {
                 in_transaction = false;
                 queued_commands.clear();
+                unwatchAll();
                 sendResponse("+OK\r\n");
             }
+        } else if (name == "WATCH") {
+            if (in_transaction) {
+                sendResponse("-ERR WATCH inside MULTI is not allowed\r\n");
+            } else if (cmd.args.empty()) {
+                sendResponse("-ERR wrong number of arguments for 'watch' command\r\n");
+            } else {
+                for (const auto& key : cmd.args) {
+                    bool already = std::any_of(watched_keys.begin(), watched_keys.end(),
+                                               [&](const auto& watched) { return watched.first == key; });
+                    if (!already) watched_keys.emplace_back(key, KeyWatch::watch(key));
+                }
+                sendResponse("+OK\r\n");
+            }
+        } else if (name == "UNWATCH") {
+            unwatchAll();
+            sendResponse("+OK\r\n");
+        } else if (name == "SAVE" || name == "BGSAVE") {
+            std::string path = rdb_dir.empty() ? rdb_filename : rdb_dir + "/" + rdb_filename;
+            auto result = name == "SAVE" ? RdbSnapshot::save(path) : RdbSnapshot::saveInBackground(path);
+            if (result == RdbSnapshot::Result::AlreadyRunning) sendResponse("-ERR Background save already in progress\r\n");
+            else if (result == RdbSnapshot::Result::Failed) sendResponse("-ERR Error saving the dump to " + path + "\r\n");
+            else sendResponse(name == "SAVE" ? "+OK\r\n" : "+Background saving started\r\n");
+        } else if (name == "LASTSAVE") {
+            sendResponse(":" + std::to_string(RdbSnapshot::lastSaveTime()) + "\r\n");
         } else if (name == "TYPE") {
             handleTypeCommand(cmd.args);
         } else if (name == "REPLCONF") {
@@ -78,8 +173,8 @@ void Handler::handleMessage(const std::string& message) {
                 sendResponse(response);
                 size_t rdb_len = Rdb::emptyRdbLen();
                 std::string header = "$" + std::to_string(rdb_len) + "\r\n";
-                send(client_fd, header.c_str(), header.size(), 0);
-                send(client_fd, Rdb::emptyRdbData(), rdb_len, 0);
+                ClientOutput::send(client_fd, header);
+                ClientOutput::send(client_fd, std::string_view(reinterpret_cast<const char*>(Rdb::emptyRdbData()), rdb_len));
                 if (replManager) replManager->addReplica(client_fd);
             } else {
                 sendResponse("-ERR invalid PSYNC args\r\n");
@@ -89,13 +184,13 @@ void Handler::handleMessage(const std::string& message) {
                    streamHandler.isStreamCommand(name) ||
                    pubSubHandler.isPubSubCommand(name) || 
                    sortedSetHandler.isSortedSetCommand(name) ||
-                   geoHandler.isGeoCommand(name)) {
+                   geoHandler.isGeoCommand(name) ||
+                   scriptingHandler.isScriptCommand(name)) {
             if (in_transaction) {
                 queued_commands.emplace_back(name, cmd.args);
                 sendResponse("+QUEUED\r\n");
             } else {
-                executeCommand(name, cmd.args);
-                propagateIfWrite(name, cmd.args);
+                runCommand(name, cmd.args);
             }
         } else if (name == "INFO" || name == "info") {
             if (cmd.args.size() == 1 && cmd.args[0] == "replication") {
@@ -110,6 +205,28 @@ void Handler::handleMessage(const std::string& message) {
                 }
                 std::string response = "$" + std::to_string(info.size()) + "\r\n" + info + "\r\n";
                 sendResponse(response);            
+            } else if (cmd.args.size() == 1 && cmd.args[0] == "persistence") {
+                std::string info;
+                info  = "rdb_bgsave_in_progress:" + std::string(RdbSnapshot::inProgress() ? "1" : "0") + "\r\n";
+                info += "rdb_last_save_time:" + std::to_string(RdbSnapshot::lastSaveTime()) + "\r\n";
+                info += "rdb_last_bgsave_status:" + std::string(RdbSnapshot::lastBackgroundSaveOk() ? "ok" : "err") + "\r\n";
+                info += "aof_enabled:" + std::string(AppendOnlyFile::enabled() ? "1" : "0");
+                sendResponse("$" + std::to_string(info.size()) + "\r\n" + info + "\r\n");
+            } else if (cmd.args.size() == 1 && (cmd.args[0] == "clients" || cmd.args[0] == "stats")) {
+                using ClientClass = ClientOutput::ClientClass;
+                std::string info;
+                if (cmd.args[0] == "clients") {
+                    info  = "connected_clients:" + std::to_string(ClientOutput::connectedClients());
+                } else {
+                    uint64_t normal = ClientOutput::disconnections(ClientClass::Normal);
+                    uint64_t pubsub = ClientOutput::disconnections(ClientClass::PubSub);
+                    uint64_t replica = ClientOutput::disconnections(ClientClass::Replica);
+                    info  = "client_output_buffer_limit_disconnections:" + std::to_string(normal + pubsub + replica) + "\r\n";
+                    info += "client_output_buffer_limit_disconnections_normal:" + std::to_string(normal) + "\r\n";
+                    info += "client_output_buffer_limit_disconnections_pubsub:" + std::to_string(pubsub) + "\r\n";
+                    info += "client_output_buffer_limit_disconnections_replica:" + std::to_string(replica);
+                }
+                sendResponse("$" + std::to_string(info.size()) + "\r\n" + info + "\r\n");
             }
         } else if (name == "CONFIG" && !cmd.args.empty() && cmd.args[0] == "GET") {
             if (cmd.args.size() < 2) {
@@ -144,19 +261,92 @@ void Handler::executeCommand(const std::string& name, const std::vector<std::str
     else if (pubSubHandler.isPubSubCommand(name)) pubSubHandler.handleCommand(name, args);
     else if (sortedSetHandler.isSortedSetCommand(name)) sortedSetHandler.handleCommand(name, args);
     else if (geoHandler.isGeoCommand(name)) geoHandler.handleCommand(name, args);
+    else if (scriptingHandler.isScriptCommand(name)) runScriptCommand(name, args);
+}
+
+// A script runs holding every store, and what it wrote is logged as one transaction before
+// they are released. Inside EXEC the transaction already holds them.
+void Handler::runScriptCommand(const std::string& name, const std::vector<std::string>& args) {
+    if (name == "SCRIPT") {
+        scriptingHandler.handleCommand(name, args);
+        return;
+    }
+
+    bool own_locks = !StoreLock::holdsBatch();
+    if (own_locks) StoreLock::acquireBatch(allStores());
+    beginPropagationBatch();
+    try {
+        scriptingHandler.handleCommand(name, args);
+    } catch (...) {
+        endPropagationBatch();
+        if (own_locks) StoreLock::releaseBatch();
+        throw;
+    }
+    endPropagationBatch();
+    if (own_locks) StoreLock::releaseBatch();
+}
+
+bool Handler::isWriteCommand(const std::string& name) {
+    return kvHandler.isWriteCommand(name) ||
+           listHandler.isWriteCommand(name) ||
+           streamHandler.isWriteCommand(name) ||
+           sortedSetHandler.isWriteCommand(name) ||
+           geoHandler.isWriteCommand(name);
+}
+
+// A write keeps its stores locked until it is logged, so the AOF and replicas get writes to
+// a store in the order they were applied. Inside EXEC or a script the batch already holds
+// them. Writes that failed changed nothing and are not logged.
+void Handler::runCommand(const std::string& name, const std::vector<std::string>& args) {
+    if (!isWriteCommand(name)) {
+        executeCommand(name, args);
+        return;
+    }
+
+    bool own_locks = !StoreLock::holdsBatch();
+    if (own_locks) {
+        std::vector<std::mutex*> stores;
+        addStoresFor(name, stores);
+        StoreLock::acquireBatch(std::move(stores), true);
+    }
+    Propagation::begin(name, args);
+    std::string reply;
+    try {
+        reply = ClientOutput::collect(client_fd, [&]() { executeCommand(name, args); });
+    } catch (...) {
+        Propagation::end();
+        if (own_locks) StoreLock::releaseBatch();
+        throw;
+    }
+    std::vector<Propagation::Command> commands = Propagation::end();
+    if (reply.empty() || reply[0] != '-') propagate(std::move(commands));
+    if (own_locks) StoreLock::releaseBatch();
+
+    if (!reply.empty()) ClientOutput::send(client_fd, std::make_shared<const std::string>(std::move(reply)));
 }
 
-void Handler::propagateIfWrite(const std::string& name, const std::vector<std::string>& args) {
-    if (!replManager) return;
+// Several commands go out wrapped in MULTI/EXEC, so a replay or replica applies all of them
+// or none.
+void Handler::propagate(std::vector<Propagation::Command> commands) {
+    if (propagation_depth > 0) {
+        std::move(commands.begin(), commands.end(), std::back_inserter(batched_propagation));
+        return;
+    }
+    if (commands.empty()) return;
+    if (commands.size() > 1) {
+        commands.insert(commands.begin(), Propagation::Command{"MULTI"});
+        commands.push_back(Propagation::Command{"EXEC"});
+    }
+    AppendOnlyFile::append(commands);
+    if (replManager) replManager->propagateCommands(commands);
+}
 
-    bool isWrite = (kvHandler.isWriteCommand(name) ||
-                    listHandler.isWriteCommand(name) ||
-                    streamHandler.isWriteCommand(name));
-    if (!isWrite) return;
+void Handler::beginPropagationBatch() {
+    propagation_depth++;
+}
 
-    std::vector<std::string> cmdParts = {name};
-    cmdParts.insert(cmdParts.end(), args.begin(), args.end());
-    replManager->propagateCommand(cmdParts);
+void Handler::endPropagationBatch() {
+    if (--propagation_depth == 0) propagate(std::exchange(batched_propagation, {}));
 }
 
 void Handler::handleTypeCommand(const std::vector<std::string>& args) {
@@ -185,12 +375,5 @@ void Handler::executeQueuedCommand(const std::string& cmd, const std::vector<std
 void Handler::sendResponse(const std::string& response) {
     if (isReplica) return;
 
-    size_t total = 0;
-    while (total < response.size()) {
-        ssize_t sent = send(client_fd, response.data() + total, response.size() - total, 0);
-        if (sent <= 0) {
-            break;
-        }
-        total += static_cast<size_t>(sent);
-    }
+    ClientOutput::send(client_fd, response);
 }
@@ -0,0 +1,58 @@
+#include "KeyWatch.hpp"
+#include <array>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+
+struct WatchedKey {
+    uint64_t version = 0;
+    uint32_t watchers = 0;
+};
+
+struct WatchShard {
+    std::mutex mutex;
+    std::unordered_map<std::string, WatchedKey> keys;
+};
+
+static constexpr size_t WATCH_SHARDS = 32;
+static std::array<WatchShard, WATCH_SHARDS> shards;
+static std::atomic<size_t> watched_count{0};
+
+static WatchShard& shardFor(const std::string& key) {
+    return shards[std::hash<std::string>{}(key) % WATCH_SHARDS];
+}
+
+uint64_t KeyWatch::watch(const std::string& key) {
+    WatchShard& shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    WatchedKey& entry = shard.keys[key];
+    if (entry.watchers++ == 0) watched_count++;
+    return entry.version;
+}
+
+void KeyWatch::unwatch(const std::string& key) {
+    WatchShard& shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.keys.find(key);
+    if (it == shard.keys.end()) return;
+    if (--it->second.watchers == 0) {
+        shard.keys.erase(it);
+        watched_count--;
+    }
+}
+
+uint64_t KeyWatch::version(const std::string& key) {
+    WatchShard& shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.keys.find(key);
+    return it == shard.keys.end() ? 0 : it->second.version;
+}
+
+void KeyWatch::touch(const std::string& key) {
+    if (watched_count.load() == 0) return;
+    WatchShard& shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.keys.find(key);
+    if (it != shard.keys.end()) it->second.version++;
+}
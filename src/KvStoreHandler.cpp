@@ -1,4 +1,8 @@
 #include "KvStoreHandler.hpp"
+#include "ClientOutput.hpp"
+#include "KeyWatch.hpp"
+#include "Propagation.hpp"
+#include "StoreLock.hpp"
 #include <iostream>
 #include <algorithm>
 #include <sys/socket.h>
@@ -6,14 +10,14 @@
 #include <set>
 #include <chrono>
 #include <sstream>
-#include "RdbReader.hpp"
+#include "RdbWriter.hpp"
 
 using Clock = std::chrono::steady_clock;
 
 std::unordered_map<std::string, ValueWithExpiry> KvStoreHandler::kv_store;
 std::mutex KvStoreHandler::store_mutex;
 
-KvStoreHandler::KvStoreHandler(int client_fd, RdbReader* rdb): client_fd(client_fd), rdbReader(rdb) {}
+KvStoreHandler::KvStoreHandler(int client_fd): client_fd(client_fd) {}
 
 bool KvStoreHandler::isKvCommand(const std::string& cmd) {
     return cmd == "SET" || cmd == "GET" || cmd == "INCR" || cmd == "KEYS";
@@ -45,23 +49,34 @@ void KvStoreHandler::handleSet(const std::vector<std::string>& tokens) {
     const std::string& key = tokens[0];
     const std::string& value = tokens[1];
     std::optional<Clock::time_point> expiry = std::nullopt;
+    // Unix time in ms the key expires at, for the AOF and replicas.
+    std::optional<int64_t> expire_at_ms;
 
     if (tokens.size() >= 4) {
         std::string option = tokens[2];
         std::transform(option.begin(), option.end(), option.begin(), ::toupper);
-        if (option == "PX") {
+        if (option == "EX" || option == "PX" || option == "EXAT" || option == "PXAT") {
+            int64_t n = 0;
             try {
-                int64_t ms = std::stoll(tokens[3]);
-                expiry = Clock::now() + std::chrono::milliseconds(ms);
+                n = std::stoll(tokens[3]);
             } catch (...) {
-                sendResponse("-ERR Invalid PX value\r\n");
+                sendResponse("-ERR Invalid " + option + " value\r\n");
                 return;
             }
+            bool seconds = option == "EX" || option == "EXAT";
+            bool absolute = option == "EXAT" || option == "PXAT";
+            int64_t ms = seconds ? n * 1000 : n;
+            int64_t unix_now = getCurrentTimeMs();
+            expire_at_ms = absolute ? ms : unix_now + ms;
+            expiry = Clock::now() + std::chrono::milliseconds(*expire_at_ms - unix_now);
         }
     }
 
-    std::lock_guard<std::mutex> lock(store_mutex);
+    StoreLock lock(store_mutex);
     kv_store[key] = {value, expiry};
+    KeyWatch::touch(key);
+    // Replaying a relative expiry would restart it, so it is logged as an absolute one.
+    if (expire_at_ms) Propagation::replace({{"SET", key, value, "PXAT", std::to_string(*expire_at_ms)}});
     sendResponse("+OK\r\n");
 }
 
@@ -73,19 +88,12 @@ void KvStoreHandler::handleGet(const std::vector<std::string>& tokens) {
 
     const std::string& key = tokens[0];
 
-    if (rdbReader) {
-        auto val = rdbReader->getValue(0, key);
-        if (val.has_value()) {
-            sendResponse("$" + std::to_string(val->size()) + "\r\n" + *val + "\r\n");
-            return;
-        }
-    }
-
-    std::lock_guard<std::mutex> lock(store_mutex);
+    StoreLock lock(store_mutex);
     auto it = kv_store.find(key);
     if (it != kv_store.end()) {
         if (it->second.expiry && Clock::now() >= it->second.expiry.value()) {
             kv_store.erase(it);
+            KeyWatch::touch(key);
             sendResponse("$-1\r\n");
             return;
         }
@@ -102,15 +110,12 @@ void KvStoreHandler::handleKeys(const std::vector<std::string>& tokens) {
     }
 
     std::set<std::string> keys_set;
-    if (rdbReader) {
-        auto rdbKeys = rdbReader->getKeys(0);
-        for (const auto &k : rdbKeys) keys_set.insert(k);
-    }
 
     {
-        std::lock_guard<std::mutex> lock(store_mutex);
+        StoreLock lock(store_mutex);
         for (auto it = kv_store.begin(); it != kv_store.end();) {
             if (it->second.expiry && Clock::now() >= it->second.expiry.value()) {
+                KeyWatch::touch(it->first);
                 it = kv_store.erase(it);
             } else {
                 keys_set.insert(it->first);
@@ -128,22 +133,15 @@ void KvStoreHandler::handleKeys(const std::vector<std::string>& tokens) {
 }
 
 bool KvStoreHandler::hasKey(const std::string& key) {
-    {
-        std::lock_guard<std::mutex> lock(store_mutex);
-        auto it = kv_store.find(key);
-        if (it != kv_store.end()) {
-            if (it->second.expiry && Clock::now() >= it->second.expiry.value()) {
-                kv_store.erase(it);
-                return false;
-            }
-            return true;
-        }
-    }
-    if (rdbReader) {
-        auto v = rdbReader->getValue(0, key);
-        return v.has_value();
+    StoreLock lock(store_mutex);
+    auto it = kv_store.find(key);
+    if (it == kv_store.end()) return false;
+    if (it->second.expiry && Clock::now() >= it->second.expiry.value()) {
+        kv_store.erase(it);
+        KeyWatch::touch(key);
+        return false;
     }
-    return false;
+    return true;
 }
 
 void KvStoreHandler::handleIncr(const std::vector<std::string>& tokens) {
@@ -154,12 +152,13 @@ void KvStoreHandler::handleIncr(const std::vector<std::string>& tokens) {
 
     const std::string& key = tokens[0];
 
-    std::lock_guard<std::mutex> lock(store_mutex);
+    StoreLock lock(store_mutex);
     auto it = kv_store.find(key);
     if (it != kv_store.end()) {
         if (it->second.expiry && Clock::now() >= it->second.expiry.value()) {
             kv_store.erase(it);
             kv_store[key] = {"1", std::nullopt};
+            KeyWatch::touch(key);
             sendResponse(":1\r\n");
             return;
         }
@@ -167,23 +166,55 @@ void KvStoreHandler::handleIncr(const std::vector<std::string>& tokens) {
             int64_t current_value = std::stoll(it->second.value);
             current_value++;
             it->second.value = std::to_string(current_value);
+            KeyWatch::touch(key);
             sendResponse(":" + std::to_string(current_value) + "\r\n");
         } catch (...) {
             sendResponse("-ERR value is not an integer or out of range\r\n");
         }
     } else {
         kv_store[key] = {"1", std::nullopt};
+        KeyWatch::touch(key);
         sendResponse(":1\r\n");
     }
 }
 
-void KvStoreHandler::sendResponse(const std::string& response) {
-    size_t total = 0;
-    while (total < response.size()) {
-        ssize_t sent = send(client_fd, response.data() + total, response.size() - total, 0);
-        if (sent <= 0) {
-            break;
+void KvStoreHandler::saveTo(RdbWriter& out) {
+    // Expiries are kept on the steady clock but stored as unix time.
+    Clock::time_point now = Clock::now();
+    int64_t unix_now = getCurrentTimeMs();
+    for (const auto& [key, entry] : kv_store) {
+        int64_t expire_ms = -1;
+        if (entry.expiry) {
+            if (*entry.expiry <= now) continue;
+            expire_ms = unix_now + std::chrono::duration_cast<std::chrono::milliseconds>(*entry.expiry - now).count();
+        }
+        out.writeKey(RdbWriter::TYPE_STRING, key, expire_ms);
+        out.writeString(entry.value);
+    }
+}
+
+size_t KvStoreHandler::restore(std::vector<RestoredString>& batch) {
+    Clock::time_point now = Clock::now();
+    int64_t unix_now = getCurrentTimeMs();
+    size_t inserted = 0;
+    StoreLock lock(store_mutex);
+    for (auto& entry : batch) {
+        std::optional<Clock::time_point> expiry;
+        if (entry.expire_ms) {
+            if (*entry.expire_ms <= unix_now) continue;
+            expiry = now + std::chrono::milliseconds(*entry.expire_ms - unix_now);
         }
-        total += static_cast<size_t>(sent);
+        kv_store[std::move(entry.key)] = {std::move(entry.value), expiry};
+        inserted++;
     }
+    return inserted;
+}
+
+void KvStoreHandler::reserve(size_t keys) {
+    StoreLock lock(store_mutex);
+    kv_store.reserve(kv_store.size() + keys);
+}
+
+void KvStoreHandler::sendResponse(const std::string& response) {
+    ClientOutput::send(client_fd, response);
 }
@@ -1,4 +1,9 @@
 #include "ListStoreHandler.hpp"
+#include "ClientOutput.hpp"
+#include "KeyWatch.hpp"
+#include "Propagation.hpp"
+#include "StoreLock.hpp"
+#include "RdbWriter.hpp"
 #include <algorithm>
 #include <iostream>
 #include <chrono>
@@ -17,7 +22,7 @@ bool ListStoreHandler::isListCommand(const std::string& cmd) {
 }
 
 bool ListStoreHandler::isWriteCommand(const std::string& cmd) {
-    static const std::unordered_set<std::string> writeCommands = {"LPUSH", "RPUSH"};
+    static const std::unordered_set<std::string> writeCommands = {"LPUSH", "RPUSH", "LPOP", "BLPOP"};
     return writeCommands.count(cmd) > 0;
 }
 
@@ -40,10 +45,11 @@ void ListStoreHandler::handleRpush(const std::vector<std::string>& tokens) {
     size_t new_size;
 
     {
-        std::lock_guard<std::mutex> lock(store_mutex);
+        StoreLock lock(store_mutex);
         auto& list = list_store[key];
         list.insert(list.end(), values.begin(), values.end());
         new_size = list.size();
+        KeyWatch::touch(key);
         cv.notify_all();
     }
 
@@ -62,10 +68,11 @@ void ListStoreHandler::handleLpush(const std::vector<std::string>& tokens) {
     size_t new_size;
 
     {
-        std::lock_guard<std::mutex> lock(store_mutex);
+        StoreLock lock(store_mutex);
         auto& list = list_store[key];
         list.insert(list.begin(), values.begin(), values.end());
         new_size = list.size();
+        KeyWatch::touch(key);
         cv.notify_all();
     }
 
@@ -89,7 +96,7 @@ void ListStoreHandler::handleLrange(const std::vector<std::string>& tokens) {
         return;
     }
 
-    std::lock_guard<std::mutex> lock(store_mutex);
+    StoreLock lock(store_mutex);
     auto it = list_store.find(key);
     if (it == list_store.end()) {
         sendResponse("*0\r\n");
@@ -124,7 +131,7 @@ void ListStoreHandler::handleLlen(const std::vector<std::string>& tokens) {
     }
 
     const std::string& key = tokens[0];
-    std::lock_guard<std::mutex> lock(store_mutex);
+    StoreLock lock(store_mutex);
     auto it = list_store.find(key);
     if (it == list_store.end()) {
         sendResponse(":0\r\n");
@@ -141,14 +148,16 @@ void ListStoreHandler::handleLpop(const std::vector<std::string>& tokens) {
     }
 
     const std::string& key = tokens[0];
-    std::lock_guard<std::mutex> lock(store_mutex);
+    StoreLock lock(store_mutex);
     auto it = list_store.find(key);
     if (it == list_store.end() || it->second.empty()) {
+        Propagation::replace({});
         sendResponse("$-1\r\n");
         return;
     }
 
     auto& list = it->second;
+    KeyWatch::touch(key);
     if (tokens.size() == 1) {
         std::string value = list.front();
         list.erase(list.begin());
@@ -176,17 +185,18 @@ void ListStoreHandler::handleBlpop(const std::vector<std::string>& tokens) {
     const std::string& key = tokens[0];
     double timeout = std::stod(tokens[1]);
 
-    std::unique_lock<std::mutex> lock(store_mutex);
+    StoreLock lock(store_mutex);
     auto list_has_data = [&]() {
         auto it = list_store.find(key);
         return it != list_store.end() && !it->second.empty();
     };
 
-    if (!list_has_data()) {
+    if (!list_has_data() && lock.canBlock()) {
         if (timeout == 0) {
-            cv.wait(lock, list_has_data);
+            cv.wait(lock.unique(), list_has_data);
         } else {
-            if (!cv.wait_for(lock, std::chrono::duration<double>(timeout), list_has_data)) {
+            if (!cv.wait_for(lock.unique(), std::chrono::duration<double>(timeout), list_has_data)) {
+                Propagation::replace({});
                 sendResponse("*-1\r\n");
                 return;
             }
@@ -195,12 +205,16 @@ void ListStoreHandler::handleBlpop(const std::vector<std::string>& tokens) {
 
     auto it = list_store.find(key);
     if (it == list_store.end() || it->second.empty()) {
+        Propagation::replace({});
         sendResponse("*-1\r\n");
         return;
     }
 
     std::string value = it->second.front();
     it->second.erase(it->second.begin());
+    KeyWatch::touch(key);
+    // Logged as the pop it turned into, so replaying it never waits.
+    Propagation::replace({{"LPOP", key}});
 
     std::string response = "*2\r\n";
     response += "$" + std::to_string(key.size()) + "\r\n" + key + "\r\n";
@@ -209,7 +223,7 @@ void ListStoreHandler::handleBlpop(const std::vector<std::string>& tokens) {
 }
 
 bool ListStoreHandler::hasKey(const std::string& key) {
-    std::lock_guard<std::mutex> lock(store_mutex);
+    StoreLock lock(store_mutex);
     auto it = list_store.find(key);
     if (it != list_store.end()) {
         return true;
@@ -217,6 +231,26 @@ bool ListStoreHandler::hasKey(const std::string& key) {
     return false;
 }
 
+void ListStoreHandler::saveTo(RdbWriter& out) {
+    for (const auto& [key, list] : list_store) {
+        if (list.empty()) continue;
+        out.writeKey(RdbWriter::TYPE_LIST, key);
+        out.writeLength(list.size());
+        for (const auto& value : list) out.writeString(value);
+    }
+}
+
+size_t ListStoreHandler::restore(std::vector<std::pair<std::string, std::vector<std::string>>>& batch) {
+    size_t inserted = 0;
+    StoreLock lock(store_mutex);
+    for (auto& [key, list] : batch) {
+        if (list.empty()) continue;
+        list_store[std::move(key)] = std::move(list);
+        inserted++;
+    }
+    return inserted;
+}
+
 void ListStoreHandler::sendResponse(const std::string& response) {
-    send(client_fd, response.c_str(), response.size(), 0);
+    ClientOutput::send(client_fd, response);
 }
\ No newline at end of file
@@ -0,0 +1,143 @@
+#include "Listpack.hpp"
+#include <stdexcept>
+
+void ListpackWriter::appendInteger(int64_t value) {
+    size_t start = elements.size();
+    if (value >= 0 && value <= 127) {
+        elements += static_cast<char>(value);
+    } else if (value >= -4096 && value <= 4095) {
+        uint64_t v = static_cast<uint64_t>(value) & 0x1FFF;
+        elements += static_cast<char>(0xC0 | (v >> 8));
+        elements += static_cast<char>(v & 0xFF);
+    } else {
+        int bytes = value >= INT16_MIN && value <= INT16_MAX ? 2 : value >= -(1 << 23) && value < (1 << 23) ? 3 : value >= INT32_MIN && value <= INT32_MAX ? 4 : 8;
+        static const unsigned char tags[] = {0, 0, 0xF1, 0xF2, 0xF3, 0, 0, 0, 0xF4};
+        elements += static_cast<char>(tags[bytes]);
+        uint64_t v = static_cast<uint64_t>(value);
+        for (int i = 0; i < bytes; ++i) elements += static_cast<char>((v >> (8 * i)) & 0xFF);
+    }
+    appendBacklen(elements.size() - start);
+    count++;
+}
+
+void ListpackWriter::appendString(std::string_view value) {
+    size_t start = elements.size();
+    size_t len = value.size();
+    if (len < 64) {
+        elements += static_cast<char>(0x80 | len);
+    } else if (len < 4096) {
+        elements += static_cast<char>(0xE0 | (len >> 8));
+        elements += static_cast<char>(len & 0xFF);
+    } else {
+        elements += static_cast<char>(0xF0);
+        for (int i = 0; i < 4; ++i) elements += static_cast<char>((len >> (8 * i)) & 0xFF);
+    }
+    elements += value;
+    appendBacklen(elements.size() - start);
+    count++;
+}
+
+// The length of the element just written, in 7-bit groups with the most significant group
+// first; every byte but the first has its high bit set.
+void ListpackWriter::appendBacklen(size_t length) {
+    int groups = length <= 127 ? 1 : length < 16383 ? 2 : length < 2097151 ? 3 : length < 268435455 ? 4 : 5;
+    for (int i = groups - 1; i >= 0; --i) {
+        unsigned char byte = (length >> (7 * i)) & 127;
+        if (i != groups - 1) byte |= 128;
+        elements += static_cast<char>(byte);
+    }
+}
+
+std::string ListpackWriter::finish() {
+    uint32_t total = static_cast<uint32_t>(6 + elements.size() + 1);
+    uint16_t n = count < 65535 ? static_cast<uint16_t>(count) : 65535;
+    std::string out;
+    out.reserve(total);
+    for (int i = 0; i < 4; ++i) out += static_cast<char>((total >> (8 * i)) & 0xFF);
+    out += static_cast<char>(n & 0xFF);
+    out += static_cast<char>(n >> 8);
+    out += elements;
+    out += static_cast<char>(0xFF);
+    elements.clear();
+    count = 0;
+    return out;
+}
+
+std::string ListpackReader::Element::text() const {
+    return is_integer ? std::to_string(integer) : std::string(string);
+}
+
+ListpackReader::ListpackReader(std::string_view listpack) : data(listpack) {
+    if (data.size() < 7) throw std::runtime_error("Truncated listpack");
+}
+
+bool ListpackReader::next(Element& out) {
+    auto need = [&](size_t n) {
+        if (data.size() - pos < n) throw std::runtime_error("Truncated listpack");
+    };
+    auto byteAt = [&](size_t i) { return static_cast<uint8_t>(data[pos + i]); };
+    auto littleEndian = [&](size_t offset, int bytes) {
+        uint64_t v = 0;
+        for (int i = 0; i < bytes; ++i) v |= static_cast<uint64_t>(byteAt(offset + i)) << (8 * i);
+        return v;
+    };
+    // Sign-extends the low `bits` bits of v.
+    auto signExtend = [](uint64_t v, int bits) {
+        uint64_t sign = uint64_t(1) << (bits - 1);
+        return static_cast<int64_t>((v ^ sign) - sign);
+    };
+
+    need(1);
+    uint8_t b = byteAt(0);
+    if (b == 0xFF) return false;
+
+    size_t size = 0;
+    out = Element{};
+    if ((b & 0x80) == 0) {
+        out.is_integer = true;
+        out.integer = b;
+        size = 1;
+    } else if ((b & 0xC0) == 0x80) {
+        size_t len = b & 0x3F;
+        need(1 + len);
+        out.string = data.substr(pos + 1, len);
+        size = 1 + len;
+    } else if ((b & 0xE0) == 0xC0) {
+        need(2);
+        out.is_integer = true;
+        out.integer = signExtend((static_cast<uint64_t>(b & 0x1F) << 8) | byteAt(1), 13);
+        size = 2;
+    } else if ((b & 0xF0) == 0xE0) {
+        need(2);
+        size_t len = (static_cast<size_t>(b & 0x0F) << 8) | byteAt(1);
+        need(2 + len);
+        out.string = data.substr(pos + 2, len);
+        size = 2 + len;
+    } else if (b == 0xF0) {
+        need(5);
+        size_t len = static_cast<size_t>(littleEndian(1, 4));
+        need(5 + len);
+        out.string = data.substr(pos + 5, len);
+        size = 5 + len;
+    } else if (b >= 0xF1 && b <= 0xF4) {
+        static const int widths[] = {2, 3, 4, 8};
+        int bytes = widths[b - 0xF1];
+        need(1 + bytes);
+        out.is_integer = true;
+        out.integer = signExtend(littleEndian(1, bytes), bytes * 8);
+        size = 1 + bytes;
+    } else {
+        throw std::runtime_error("Invalid listpack element encoding");
+    }
+
+    size_t backlen = size <= 127 ? 1 : size < 16383 ? 2 : size < 2097151 ? 3 : size < 268435455 ? 4 : 5;
+    need(size + backlen);
+    pos += size + backlen;
+    return true;
+}
+
+int64_t ListpackReader::nextInteger() {
+    Element element;
+    if (!next(element) || !element.is_integer) throw std::runtime_error("Expected an integer in listpack");
+    return element.integer;
+}
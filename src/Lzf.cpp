@@ -0,0 +1,110 @@
+#include "Lzf.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+static constexpr size_t HASH_BITS = 14;
+static constexpr size_t MAX_LITERAL = 32;
+static constexpr size_t MAX_MATCH = 264;
+static constexpr size_t MAX_OFFSET = 8192;
+
+static uint32_t hashAt(const uint8_t* p) {
+    uint32_t v = (uint32_t(p[0]) << 16) | (uint32_t(p[1]) << 8) | p[2];
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+size_t lzfCompress(std::string_view input, char* output, size_t capacity) {
+    // Entries hold input positions and are never cleared between calls: a stale entry is
+    // either ahead of the current position or fails the byte comparison below.
+    thread_local std::array<uint32_t, size_t(1) << HASH_BITS> table{};
+
+    const uint8_t* in = reinterpret_cast<const uint8_t*>(input.data());
+    const size_t len = input.size();
+    uint8_t* out = reinterpret_cast<uint8_t*>(output);
+    size_t op = 0;
+    size_t literal_start = 0;
+
+    auto flushLiterals = [&](size_t end) {
+        while (literal_start < end) {
+            size_t run = std::min(end - literal_start, MAX_LITERAL);
+            if (op + 1 + run > capacity) return false;
+            out[op++] = static_cast<uint8_t>(run - 1);
+            std::memcpy(out + op, in + literal_start, run);
+            op += run;
+            literal_start += run;
+        }
+        return true;
+    };
+
+    size_t ip = 0;
+    while (ip + 2 < len) {
+        uint32_t h = hashAt(in + ip);
+        size_t ref = table[h];
+        table[h] = static_cast<uint32_t>(ip);
+
+        if (ref < ip && ip - ref <= MAX_OFFSET && std::memcmp(in + ref, in + ip, 3) == 0) {
+            size_t max_len = std::min(len - ip, MAX_MATCH);
+            size_t match = 3;
+            while (match < max_len && in[ref + match] == in[ip + match]) match++;
+
+            if (!flushLiterals(ip)) return 0;
+            size_t offset = ip - ref - 1;
+            size_t code = match - 2;
+            if (op + 3 > capacity) return 0;
+            if (code < 7) {
+                out[op++] = static_cast<uint8_t>((code << 5) | (offset >> 8));
+            } else {
+                out[op++] = static_cast<uint8_t>((7 << 5) | (offset >> 8));
+                out[op++] = static_cast<uint8_t>(code - 7);
+            }
+            out[op++] = static_cast<uint8_t>(offset & 0xFF);
+
+            size_t end = ip + match;
+            for (ip++; ip < end && ip + 2 < len; ip++) table[hashAt(in + ip)] = static_cast<uint32_t>(ip);
+            ip = end;
+            literal_start = ip;
+        } else {
+            ip++;
+        }
+    }
+
+    if (!flushLiterals(len)) return 0;
+    return op;
+}
+
+bool lzfDecompress(std::string_view input, char* output, size_t out_len) {
+    const uint8_t* ip = reinterpret_cast<const uint8_t*>(input.data());
+    const uint8_t* in_end = ip + input.size();
+    uint8_t* out = reinterpret_cast<uint8_t*>(output);
+    size_t op = 0;
+
+    while (ip < in_end) {
+        size_t ctrl = *ip++;
+        if (ctrl < 32) {
+            size_t run = ctrl + 1;
+            if (static_cast<size_t>(in_end - ip) < run || out_len - op < run) return false;
+            std::memcpy(out + op, ip, run);
+            ip += run;
+            op += run;
+            continue;
+        }
+
+        size_t match = ctrl >> 5;
+        size_t distance = (ctrl & 0x1F) << 8;
+        if (match == 7) {
+            if (ip == in_end) return false;
+            match += *ip++;
+        }
+        if (ip == in_end) return false;
+        distance += *ip++;
+        distance += 1;
+        match += 2;
+        if (distance > op || out_len - op < match) return false;
+        // Byte by byte, since the reference may overlap the bytes being written.
+        const uint8_t* ref = out + op - distance;
+        for (size_t i = 0; i < match; ++i) out[op + i] = ref[i];
+        op += match;
+    }
+    return op == out_len;
+}
@@ -0,0 +1,43 @@
+#include "NumericCodec.hpp"
+#include <charconv>
+#include <cmath>
+
+namespace Numeric {
+    static constexpr size_t MAX_DOUBLE_CHARS = 32;
+
+    static std::string_view toChars(char* buf, double value) {
+        auto res = std::to_chars(buf, buf + MAX_DOUBLE_CHARS, value);
+        return std::string_view(buf, res.ptr - buf);
+    }
+
+    std::string formatDouble(double value) {
+        char buf[MAX_DOUBLE_CHARS];
+        return std::string(toChars(buf, value));
+    }
+
+    void appendDouble(std::string& out, double value) {
+        char buf[MAX_DOUBLE_CHARS];
+        out += toChars(buf, value);
+    }
+
+    void appendBulkDouble(std::string& out, double value) {
+        char buf[MAX_DOUBLE_CHARS];
+        std::string_view digits = toChars(buf, value);
+        out += '$';
+        out += std::to_string(digits.size());
+        out += "\r\n";
+        out += digits;
+        out += "\r\n";
+    }
+
+    std::optional<double> parseDouble(std::string_view text) {
+        if (!text.empty() && text[0] == '+') text.remove_prefix(1);
+        if (text.empty() || text[0] == '+') return std::nullopt;
+
+        double value = 0;
+        auto res = std::from_chars(text.data(), text.data() + text.size(), value);
+        if (res.ec != std::errc{} || res.ptr != text.data() + text.size()) return std::nullopt;
+        if (std::isnan(value)) return std::nullopt;
+        return value;
+    }
+}
@@ -0,0 +1,124 @@
+#include "PatternIndex.hpp"
+
+GlobMatcher::GlobMatcher(std::string_view pattern) {
+    for (size_t i = 0; i < pattern.size(); ++i) {
+        Token token;
+        char c = pattern[i];
+        if (c == '*') {
+            // Consecutive stars behave like one.
+            if (!tokens.empty() && tokens.back().kind == Token::Star) continue;
+            token.kind = Token::Star;
+        } else if (c == '?') {
+            token.kind = Token::Any;
+        } else if (c == '\\' && i + 1 < pattern.size()) {
+            token.ch = pattern[++i];
+        } else if (c == '[' && pattern.find(']', i + 1) != std::string_view::npos) {
+            token.kind = Token::Class;
+            size_t j = i + 1;
+            bool negate = j < pattern.size() && pattern[j] == '^';
+            if (negate) j++;
+            for (; pattern[j] != ']'; ++j) {
+                if (pattern[j] == '\\' && j + 1 < pattern.size() && pattern[j + 1] != ']') {
+                    token.set.set(static_cast<unsigned char>(pattern[++j]));
+                } else if (j + 2 < pattern.size() && pattern[j + 1] == '-' && pattern[j + 2] != ']') {
+                    unsigned char lo = pattern[j], hi = pattern[j + 2];
+                    if (lo > hi) std::swap(lo, hi);
+                    for (unsigned v = lo; v <= hi; ++v) token.set.set(v);
+                    j += 2;
+                } else {
+                    token.set.set(static_cast<unsigned char>(pattern[j]));
+                }
+            }
+            if (negate) token.set.flip();
+            i = j;
+        } else {
+            token.ch = c;
+        }
+
+        if (token.kind == Token::Char && tokens.empty()) prefix += token.ch;
+        else tokens.push_back(token);
+    }
+}
+
+bool GlobMatcher::matchesAfterPrefix(std::string_view text) const {
+    text.remove_prefix(prefix.size());
+
+    // Greedy matching that only backtracks to the most recent star, which is enough for
+    // globs since a later star can always absorb what an earlier one would have.
+    size_t t = 0, p = 0;
+    size_t star = std::string::npos, mark = 0;
+    while (t < text.size()) {
+        if (p < tokens.size() && tokens[p].kind == Token::Star) {
+            star = p++;
+            mark = t;
+            continue;
+        }
+        if (p < tokens.size()) {
+            const Token& token = tokens[p];
+            unsigned char c = text[t];
+            bool ok = token.kind == Token::Any || (token.kind == Token::Char && token.ch == static_cast<char>(c)) ||
+                      (token.kind == Token::Class && token.set.test(c));
+            if (ok) {
+                ++p;
+                ++t;
+                continue;
+            }
+        }
+        if (star == std::string::npos) return false;
+        p = star + 1;
+        t = ++mark;
+    }
+    while (p < tokens.size() && tokens[p].kind == Token::Star) ++p;
+    return p == tokens.size();
+}
+
+bool PatternIndex::add(const std::string& pattern, uint64_t client) {
+    GlobMatcher matcher(pattern);
+    Node* node = &root;
+    for (char c : matcher.literalPrefix()) {
+        auto& child = node->children[c];
+        if (!child) child = std::make_unique<Node>();
+        node = child.get();
+    }
+    auto it = node->patterns.find(pattern);
+    if (it == node->patterns.end()) it = node->patterns.emplace(pattern, Entry{std::move(matcher), {}}).first;
+    return it->second.subscribers.insert(client).second;
+}
+
+bool PatternIndex::remove(const std::string& pattern, uint64_t client) {
+    GlobMatcher matcher(pattern);
+    const std::string& prefix = matcher.literalPrefix();
+
+    std::vector<Node*> path{&root};
+    for (char c : prefix) {
+        auto child = path.back()->children.find(c);
+        if (child == path.back()->children.end()) return false;
+        path.push_back(child->second.get());
+    }
+
+    auto it = path.back()->patterns.find(pattern);
+    if (it == path.back()->patterns.end() || !it->second.subscribers.erase(client)) return false;
+    if (!it->second.subscribers.empty()) return true;
+    path.back()->patterns.erase(it);
+
+    // Prune nodes left without patterns or children.
+    for (size_t depth = prefix.size(); depth > 0; --depth) {
+        Node* node = path[depth];
+        if (!node->patterns.empty() || !node->children.empty()) break;
+        path[depth - 1]->children.erase(prefix[depth - 1]);
+    }
+    return true;
+}
+
+void PatternIndex::match(std::string_view channel, const std::function<void(const std::string&, const Subscribers&)>& visit) const {
+    const Node* node = &root;
+    for (size_t depth = 0;; ++depth) {
+        for (const auto& [pattern, entry] : node->patterns) {
+            if (entry.matcher.matchesAfterPrefix(channel)) visit(pattern, entry.subscribers);
+        }
+        if (depth == channel.size()) break;
+        auto child = node->children.find(channel[depth]);
+        if (child == node->children.end()) break;
+        node = child->second.get();
+    }
+}
@@ -0,0 +1,29 @@
+#include "Propagation.hpp"
+#include <utility>
+
+static thread_local bool recording = false;
+static thread_local std::vector<Propagation::Command> recorded;
+
+void Propagation::begin(const std::string& name, const std::vector<std::string>& args) {
+    Command command;
+    command.reserve(args.size() + 1);
+    command.push_back(name);
+    command.insert(command.end(), args.begin(), args.end());
+    recorded.clear();
+    recorded.push_back(std::move(command));
+    recording = true;
+}
+
+std::vector<Propagation::Command> Propagation::end() {
+    recording = false;
+    return std::exchange(recorded, {});
+}
+
+void Propagation::rewriteArgument(size_t index, std::string value) {
+    if (!recording || recorded.size() != 1 || index + 1 >= recorded[0].size()) return;
+    recorded[0][index + 1] = std::move(value);
+}
+
+void Propagation::replace(std::vector<Command> commands) {
+    if (recording) recorded = std::move(commands);
+}
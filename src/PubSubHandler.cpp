@@ -1,22 +1,61 @@
 #include "PubSubHandler.hpp"
+#include "ClientOutput.hpp"
 #include <algorithm>
 #include <iostream>
+#include <memory>
 
-std::unordered_map<int, std::unordered_set<std::string>> PubSubHandler::client_channels;
+std::unordered_map<ClientOutput::ClientId, std::unordered_set<std::string>> PubSubHandler::client_channels;
+std::unordered_map<ClientOutput::ClientId, std::unordered_set<std::string>> PubSubHandler::client_patterns;
 std::mutex PubSubHandler::store_mutex;
-std::unordered_map<std::string, std::unordered_set<int>> PubSubHandler::channel_subscribers;
+std::unordered_map<std::string, std::unordered_set<ClientOutput::ClientId>> PubSubHandler::channel_subscribers;
+PatternIndex PubSubHandler::pattern_index;
+std::array<PubSubHandler::Shard, PubSubHandler::SHARD_COUNT> PubSubHandler::shards;
 
-PubSubHandler::PubSubHandler(int client_fd) : client_fd(client_fd) {}
+PubSubHandler::PubSubHandler(int client_fd) : client_fd(client_fd), client_id(ClientOutput::clientId(client_fd)) {}
+
+PubSubHandler::~PubSubHandler() {
+    std::lock_guard<std::mutex> lock(store_mutex);
+    auto it = client_channels.find(client_id);
+    if (it != client_channels.end()) {
+        for (const auto& channel : it->second) {
+            auto subs = channel_subscribers.find(channel);
+            if (subs == channel_subscribers.end()) continue;
+            subs->second.erase(client_id);
+            if (subs->second.empty()) channel_subscribers.erase(subs);
+        }
+        client_channels.erase(it);
+    }
+    auto patterns = client_patterns.find(client_id);
+    if (patterns != client_patterns.end()) {
+        for (const auto& pattern : patterns->second) pattern_index.remove(pattern, client_id);
+        client_patterns.erase(patterns);
+    }
+    for (const auto& channel : shard_channels) {
+        Shard& shard = shardFor(channel);
+        std::lock_guard<std::mutex> shard_lock(shard.mutex);
+        auto subs = shard.subscribers.find(channel);
+        if (subs == shard.subscribers.end()) continue;
+        subs->second.erase(client_id);
+        if (subs->second.empty()) shard.subscribers.erase(subs);
+    }
+}
 
 bool PubSubHandler::isPubSubCommand(const std::string& cmd) {
-    return cmd == "SUBSCRIBE" || cmd=="PING" || cmd == "UNSUBSCRIBE" || cmd == "PUBLISH";
+    return cmd == "SUBSCRIBE" || cmd=="PING" || cmd == "UNSUBSCRIBE" || cmd == "PUBLISH" ||
+           cmd == "PSUBSCRIBE" || cmd == "PUNSUBSCRIBE" ||
+           cmd == "SSUBSCRIBE" || cmd == "SUNSUBSCRIBE" || cmd == "SPUBLISH";
 }
 
 void PubSubHandler::handleCommand(const std::string& cmd, const std::vector<std::string>& args) {
-    if (cmd == "SUBSCRIBE") handleSubscribe(args);
+    if (cmd == "SUBSCRIBE") handleSubscribe(args, false);
+    else if (cmd == "PSUBSCRIBE") handleSubscribe(args, true);
     else if (cmd == "PING") handlePing();
-    else if (cmd == "UNSUBSCRIBE") handleUnsubscribe(args);
+    else if (cmd == "UNSUBSCRIBE") handleUnsubscribe(args, false);
+    else if (cmd == "PUNSUBSCRIBE") handleUnsubscribe(args, true);
     else if (cmd == "PUBLISH") handlePublish(args);
+    else if (cmd == "SSUBSCRIBE") handleShardSubscribe(args);
+    else if (cmd == "SUNSUBSCRIBE") handleShardUnsubscribe(args);
+    else if (cmd == "SPUBLISH") handleShardPublish(args);
     else {
         if (subscribed_mode) {
             sendResponse("-ERR Can't execute '" + cmd + "': only (P|S)SUBSCRIBE / (P|S)UNSUBSCRIBE / PING / QUIT / RESET are allowed in this context\r\n");
@@ -26,30 +65,61 @@ void PubSubHandler::handleCommand(const std::string& cmd, const std::vector<std:
     }
 }
 
-void PubSubHandler::handleSubscribe(const std::vector<std::string>& args) {
+static void appendBulk(std::string& out, const std::string& value) {
+    out += "$" + std::to_string(value.size()) + "\r\n" + value + "\r\n";
+}
+
+// Confirmation pushed for each (un)subscribed name; name is null when there was nothing to
+// unsubscribe from.
+static std::string subscriptionReply(const std::string& kind, const std::string* name, size_t count) {
+    std::string response = "*3\r\n";
+    appendBulk(response, kind);
+    if (name) appendBulk(response, *name);
+    else response += "$-1\r\n";
+    response += ":" + std::to_string(count) + "\r\n";
+    return response;
+}
+
+size_t PubSubHandler::subscriptionCount() const {
+    size_t count = 0;
+    auto channels = client_channels.find(client_id);
+    if (channels != client_channels.end()) count += channels->second.size();
+    auto patterns = client_patterns.find(client_id);
+    if (patterns != client_patterns.end()) count += patterns->second.size();
+    return count;
+}
+
+void PubSubHandler::updateMode() {
+    bool subscribed = regular_count + shard_channels.size() > 0;
+    if (subscribed == subscribed_mode) return;
+    subscribed_mode = subscribed;
+    ClientOutput::setClass(client_fd, subscribed ? ClientOutput::ClientClass::PubSub : ClientOutput::ClientClass::Normal);
+}
+
+void PubSubHandler::handleSubscribe(const std::vector<std::string>& args, bool pattern) {
     if (args.empty()) {
-        sendResponse("-ERR SUBSCRIBE requires a channel name\r\n");
+        sendResponse(pattern ? "-ERR PSUBSCRIBE requires a pattern\r\n" : "-ERR SUBSCRIBE requires a channel name\r\n");
         return;
     }
 
-    const std::string& channel = args[0];
-
-    int count = 0;
+    std::string response;
+    size_t count = 0;
     {
         std::lock_guard<std::mutex> lock(store_mutex);
-        auto& channels = client_channels[client_fd];
-        channels.insert(channel);
-        channel_subscribers[channel].insert(client_fd);
-        count = static_cast<int>(channels.size());
+        for (const auto& name : args) {
+            if (pattern) {
+                if (client_patterns[client_id].insert(name).second) pattern_index.add(name, client_id);
+            } else {
+                client_channels[client_id].insert(name);
+                channel_subscribers[name].insert(client_id);
+            }
+            count = subscriptionCount();
+            response += subscriptionReply(pattern ? "psubscribe" : "subscribe", &name, count);
+        }
+        regular_count = count;
     }
 
-    subscribed_mode = true;
-
-    std::string response = "*3\r\n";
-    response += "$9\r\nsubscribe\r\n";
-    response += "$" + std::to_string(channel.size()) + "\r\n" + channel + "\r\n";
-    response += ":" + std::to_string(count) + "\r\n";
-
+    updateMode();
     sendResponse(response);
 }
 
@@ -61,36 +131,41 @@ void PubSubHandler::handlePing() {
     }
 }
 
-void PubSubHandler::handleUnsubscribe(const std::vector<std::string>& args) {
-    int count = 0;
+void PubSubHandler::handleUnsubscribe(const std::vector<std::string>& args, bool pattern) {
+    const std::string kind = pattern ? "punsubscribe" : "unsubscribe";
+    std::string response;
+    size_t count = 0;
     {
         std::lock_guard<std::mutex> lock(store_mutex);
-        auto it = client_channels.find(client_fd);
-        if (it != client_channels.end()) {
-            if (!args.empty()) {
-                for (const auto& channel : args) {
-                    it->second.erase(channel);
-                    channel_subscribers[channel].erase(client_fd);
-                    if (channel_subscribers[channel].empty()) channel_subscribers.erase(channel);
+        auto& mine = pattern ? client_patterns[client_id] : client_channels[client_id];
+        // Without arguments every current subscription of this kind is dropped.
+        std::vector<std::string> names = args;
+        if (names.empty()) names.assign(mine.begin(), mine.end());
+
+        for (const auto& name : names) {
+            if (mine.erase(name)) {
+                if (pattern) {
+                    pattern_index.remove(name, client_id);
+                } else {
+                    auto subs = channel_subscribers.find(name);
+                    if (subs != channel_subscribers.end()) {
+                        subs->second.erase(client_id);
+                        if (subs->second.empty()) channel_subscribers.erase(subs);
+                    }
                 }
-            } else {
-                for (const auto& ch : it->second) channel_subscribers[ch].erase(client_fd);
-                it->second.clear();
             }
-            count = static_cast<int>(it->second.size());
-            if (it->second.empty()) subscribed_mode = false;
+            count = subscriptionCount();
+            response += subscriptionReply(kind, &name, count);
         }
-    }
-
-    if (!args.empty()) {
-        for (const auto& channel : args) {
-            std::string response = "*3\r\n";
-            response += "$11\r\nunsubscribe\r\n";
-            response += "$" + std::to_string(channel.size()) + "\r\n" + channel + "\r\n";
-            response += ":" + std::to_string(count) + "\r\n";
-            sendResponse(response);
+        if (names.empty()) {
+            count = subscriptionCount();
+            response = subscriptionReply(kind, nullptr, count);
         }
+        regular_count = count;
     }
+
+    updateMode();
+    sendResponse(response);
 }
 
 void PubSubHandler::handlePublish(const std::vector<std::string>& args) {
@@ -101,29 +176,126 @@ void PubSubHandler::handlePublish(const std::vector<std::string>& args) {
 
     const std::string& channel = args[0];
     const std::string& message = args[1];
-    int delivered = 0;
 
+    // Serialized once and shared by every subscriber's output queue.
+    std::string resp = "*3\r\n$7\r\nmessage\r\n";
+    appendBulk(resp, channel);
+    appendBulk(resp, message);
+    auto payload = std::make_shared<const std::string>(std::move(resp));
+
+    // Pattern deliveries carry the matching pattern, so each pattern gets its own buffer.
+    std::vector<std::pair<ClientOutput::Buffer, std::vector<ClientOutput::ClientId>>> pattern_targets;
+
+    size_t delivered = 0;
+    std::vector<ClientOutput::ClientId> targets;
     {
         std::lock_guard<std::mutex> lock(store_mutex);
         auto it = channel_subscribers.find(channel);
         if (it != channel_subscribers.end()) {
-            delivered = static_cast<int>(it->second.size());
-            for (int fd : it->second) {
-                if (fd == client_fd) continue; // optional: skip sender
-                std::string resp = "*3\r\n";
-                resp += "$7\r\nmessage\r\n";
-                resp += "$" + std::to_string(channel.size()) + "\r\n" + channel + "\r\n";
-                resp += "$" + std::to_string(message.size()) + "\r\n" + message + "\r\n";
-                send(fd, resp.c_str(), resp.size(), 0);
+            delivered = it->second.size();
+            targets.reserve(it->second.size());
+            for (ClientOutput::ClientId id : it->second) {
+                if (id == client_id) continue; // optional: skip sender
+                targets.push_back(id);
             }
         }
+
+        pattern_index.match(channel, [&](const std::string& pattern, const PatternIndex::Subscribers& subscribers) {
+            delivered += subscribers.size();
+            std::string pmessage = "*4\r\n$8\r\npmessage\r\n";
+            appendBulk(pmessage, pattern);
+            appendBulk(pmessage, channel);
+            appendBulk(pmessage, message);
+            auto& [buffer, ids] = pattern_targets.emplace_back(std::make_shared<const std::string>(std::move(pmessage)), std::vector<ClientOutput::ClientId>{});
+            for (ClientOutput::ClientId id : subscribers) {
+                if (id != client_id) ids.push_back(id);
+            }
+        });
     }
+    ClientOutput::broadcast(targets, payload);
+    for (const auto& [buffer, ids] : pattern_targets) ClientOutput::broadcast(ids, buffer);
 
     sendResponse(":" + std::to_string(delivered) + "\r\n");
 }
 
+PubSubHandler::Shard& PubSubHandler::shardFor(const std::string& channel) {
+    return shards[std::hash<std::string>{}(channel) % SHARD_COUNT];
+}
+
+void PubSubHandler::handleShardSubscribe(const std::vector<std::string>& args) {
+    if (args.empty()) {
+        sendResponse("-ERR SSUBSCRIBE requires a channel name\r\n");
+        return;
+    }
+
+    std::string response;
+    for (const auto& channel : args) {
+        if (shard_channels.insert(channel).second) {
+            Shard& shard = shardFor(channel);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.subscribers[channel].insert(client_id);
+        }
+        response += subscriptionReply("ssubscribe", &channel, shard_channels.size());
+    }
+
+    updateMode();
+    sendResponse(response);
+}
+
+void PubSubHandler::handleShardUnsubscribe(const std::vector<std::string>& args) {
+    std::vector<std::string> names = args;
+    if (names.empty()) names.assign(shard_channels.begin(), shard_channels.end());
+
+    std::string response;
+    for (const auto& channel : names) {
+        if (shard_channels.erase(channel)) {
+            Shard& shard = shardFor(channel);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto subs = shard.subscribers.find(channel);
+            if (subs != shard.subscribers.end()) {
+                subs->second.erase(client_id);
+                if (subs->second.empty()) shard.subscribers.erase(subs);
+            }
+        }
+        response += subscriptionReply("sunsubscribe", &channel, shard_channels.size());
+    }
+    if (names.empty()) response = subscriptionReply("sunsubscribe", nullptr, 0);
 
+    updateMode();
+    sendResponse(response);
+}
+
+void PubSubHandler::handleShardPublish(const std::vector<std::string>& args) {
+    if (args.size() < 2) {
+        sendResponse("-ERR SPUBLISH requires channel and message\r\n");
+        return;
+    }
+
+    const std::string& channel = args[0];
+    std::string resp = "*3\r\n$8\r\nsmessage\r\n";
+    appendBulk(resp, channel);
+    appendBulk(resp, args[1]);
+    auto payload = std::make_shared<const std::string>(std::move(resp));
+
+    size_t delivered = 0;
+    std::vector<ClientOutput::ClientId> targets;
+    {
+        Shard& shard = shardFor(channel);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.subscribers.find(channel);
+        if (it != shard.subscribers.end()) {
+            delivered = it->second.size();
+            targets.reserve(it->second.size());
+            for (ClientOutput::ClientId id : it->second) {
+                if (id != client_id) targets.push_back(id);
+            }
+        }
+    }
+    ClientOutput::broadcast(targets, payload);
+
+    sendResponse(":" + std::to_string(delivered) + "\r\n");
+}
 
 void PubSubHandler::sendResponse(const std::string& response) {
-    send(client_fd, response.c_str(), response.size(), 0);
+    ClientOutput::send(client_fd, response);
 }
@@ -1,250 +1,732 @@
 #include "RdbReader.hpp"
-#include <fstream>
-#include <sstream>
+#include "KvStoreHandler.hpp"
+#include "ListStoreHandler.hpp"
+#include "SortedSetHandler.hpp"
+#include "StreamStoreHandler.hpp"
+#include "Listpack.hpp"
+#include "Lzf.hpp"
 #include <stdexcept>
-#include <chrono>
+#include <cerrno>
 #include <cstring>
 #include <iostream>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <map>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-RdbReader::RdbReader(const std::string &filepath) : filepath_(filepath) {}
+// A bounds-checked read position in the mapped file.
+struct RdbCursor {
+    const uint8_t* pos;
+    const uint8_t* end;
 
-bool RdbReader::load() {
-    std::ifstream in(filepath_, std::ios::binary);
-    if (!in.is_open()) {
-        std::cerr << "RdbReader: file not found: " << filepath_ << " (continuing without load)\n";
-        return true;
+    size_t remaining() const { return static_cast<size_t>(end - pos); }
+
+    void need(size_t n) const {
+        if (remaining() < n) throw std::runtime_error("Unexpected EOF in RDB file");
     }
-    try {
-        if (!parseFile(in)) {
-            std::cerr << "RdbReader: parseFile returned false for " << filepath_ << "\n";
-        }
-    } catch (const std::exception &ex) {
-        std::cerr << "RdbReader: exception while parsing: " << ex.what() << "\n";
-        db_data_.clear();
-    } catch (...) {
-        std::cerr << "RdbReader: unknown exception while parsing\n";
-        db_data_.clear();
+
+    uint8_t byte() {
+        need(1);
+        return *pos++;
     }
-    in.close();
-    return true;
-}
 
-const std::unordered_map<int, std::unordered_map<std::string, RdbEntry>>& RdbReader::getAllEntries() const {
-    return db_data_;
-}
+    std::string_view bytes(size_t n) {
+        need(n);
+        std::string_view out(reinterpret_cast<const char*>(pos), n);
+        pos += n;
+        return out;
+    }
 
-std::vector<std::string> RdbReader::getKeys(int db) const {
-    std::vector<std::string> result;
-    auto it = db_data_.find(db);
-    if (it == db_data_.end()) return result;
+    void skip(size_t n) {
+        need(n);
+        pos += n;
+    }
 
-    int64_t now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-        std::chrono::system_clock::now().time_since_epoch()).count();
+    uint32_t u32le() {
+        need(4);
+        uint32_t r = 0;
+        for (int i = 0; i < 4; ++i) r |= static_cast<uint32_t>(pos[i]) << (8 * i);
+        pos += 4;
+        return r;
+    }
 
-    for (const auto &kv : it->second) {
-        const RdbEntry &entry = kv.second;
-        if (entry.expiry.has_value()) {
-            if (entry.expiry.value() <= now_ms) continue; // expired -> skip
-        }
-        result.push_back(kv.first);
+    uint64_t u64le() {
+        need(8);
+        uint64_t r = 0;
+        for (int i = 0; i < 8; ++i) r |= static_cast<uint64_t>(pos[i]) << (8 * i);
+        pos += 8;
+        return r;
+    }
+
+    uint32_t u32be() {
+        need(4);
+        uint32_t r = (uint32_t(pos[0]) << 24) | (uint32_t(pos[1]) << 16) | (uint32_t(pos[2]) << 8) | uint32_t(pos[3]);
+        pos += 4;
+        return r;
     }
-    std::sort(result.begin(), result.end());
-    return result;
-}
 
-std::optional<std::string> RdbReader::getValue(int db, const std::string &key) const {
-    auto it = db_data_.find(db);
-    if (it == db_data_.end()) return std::nullopt;
-    auto it2 = it->second.find(key);
-    if (it2 == it->second.end()) return std::nullopt;
+    uint64_t u64be() {
+        need(8);
+        uint64_t r = 0;
+        for (int i = 0; i < 8; ++i) r = (r << 8) | pos[i];
+        pos += 8;
+        return r;
+    }
 
-    if (it2->second.expiry.has_value()) {
-        int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::system_clock::now().time_since_epoch()
-        ).count();
-        if (now > it2->second.expiry.value()) {
-            return std::nullopt; 
+    // Returns the length, or sets isEncoded and encType for the special string encodings.
+    uint64_t length(bool &isEncoded, int &encType) {
+        isEncoded = false;
+        encType = -1;
+        uint8_t first = byte();
+        switch (first >> 6) {
+            case 0: return first & 0x3F;
+            case 1: return (static_cast<uint64_t>(first & 0x3F) << 8) | byte();
+            case 2:
+                if (first == 0x80) return u32be();
+                if (first == 0x81) return u64be();
+                throw std::runtime_error("Unknown length encoding in RDB file");
+            default:
+                isEncoded = true;
+                encType = first & 0x3F;
+                return 0;
         }
     }
-    return it2->second.value;
-}
 
-bool RdbReader::parseFile(std::ifstream &in) {
-    std::string header = readN(in, 9);
-    if (header.size() != 9 || header.rfind("REDIS", 0) != 0) {
-        return false;
+    uint64_t length() {
+        bool e = false;
+        int t = 0;
+        uint64_t len = length(e, t);
+        if (e) throw std::runtime_error("Unexpected encoded length in RDB file");
+        return len;
     }
 
-    int current_db = 0;
+    // Reads a string straight into its own buffer: raw strings are copied once out of the
+    // mapping and compressed ones are expanded in place.
+    std::string string() {
+        bool enc = false;
+        int encType = 0;
+        uint64_t len = length(enc, encType);
+        if (!enc) return std::string(bytes(len));
 
-    while (true) {
-        uint8_t op;
-        if (!tryReadByte(in, op)) break;
+        int64_t v = 0;
+        if (encType == 0) v = static_cast<int8_t>(byte());
+        else if (encType == 1) {
+            need(2);
+            v = static_cast<int16_t>(pos[0] | (pos[1] << 8));
+            pos += 2;
+        }
+        else if (encType == 2) v = static_cast<int32_t>(u32le());
+        else if (encType == 3) {
+            uint64_t clen = length();
+            uint64_t olen = length();
+            std::string_view compressed = bytes(clen);
+            std::string out(olen, '\0');
+            if (!lzfDecompress(compressed, out.data(), out.size())) throw std::runtime_error("Invalid LZF-compressed string");
+            return out;
+        }
+        else throw std::runtime_error("Unknown string encoding type");
 
-        if (op == 0xFF) { 
-            skipBytes(in, 8);
-            break;
-        } else if (op == 0xFE) { 
-            bool e=false; int t=0;
-            uint64_t dbid = readLength(in, e, t);
-            current_db = static_cast<int>(dbid);
-            continue;
-        } else if (op == 0xFB) { 
-            bool e=false; int t=0;
-            readLength(in, e, t); 
-            readLength(in, e, t); 
-            continue;
-        } else if (op == 0xFA) { 
-            readString(in);
-            readString(in);
-            continue;
+        char buf[24];
+        auto res = std::to_chars(buf, buf + sizeof(buf), v);
+        return std::string(buf, res.ptr);
+    }
+
+    void skipString() {
+        bool enc = false;
+        int encType = 0;
+        uint64_t len = length(enc, encType);
+        if (!enc) skip(len);
+        else if (encType == 0) skip(1);
+        else if (encType == 1) skip(2);
+        else if (encType == 2) skip(4);
+        else if (encType == 3) {
+            uint64_t clen = length();
+            length();
+            skip(clen);
         }
+        else throw std::runtime_error("Unknown string encoding type");
+    }
+};
+
+// Object types, as numbered in RDB files.
+enum RdbType : uint8_t {
+    TYPE_STRING = 0,
+    TYPE_LIST = 1,
+    TYPE_SET = 2,
+    TYPE_ZSET = 3,
+    TYPE_HASH = 4,
+    TYPE_ZSET_2 = 5,
+    TYPE_HASH_ZIPMAP = 9,
+    TYPE_LIST_ZIPLIST = 10,
+    TYPE_SET_INTSET = 11,
+    TYPE_ZSET_ZIPLIST = 12,
+    TYPE_HASH_ZIPLIST = 13,
+    TYPE_LIST_QUICKLIST = 14,
+    TYPE_STREAM_LISTPACKS = 15,
+    TYPE_HASH_LISTPACK = 16,
+    TYPE_ZSET_LISTPACK = 17,
+    TYPE_LIST_QUICKLIST_2 = 18,
+    TYPE_STREAM_LISTPACKS_2 = 19,
+    TYPE_SET_LISTPACK = 20,
+    TYPE_STREAM_LISTPACKS_3 = 21,
+};
 
-        if (op == 0xFC) { 
-            uint64_t ts = readUInt64LE(in);
-            pending_expiry_ = static_cast<int64_t>(ts);
-            if (!tryReadByte(in, op)) break;
-        } else if (op == 0xFD) { 
-            uint32_t ts = readUInt32LE(in);
-            pending_expiry_ = static_cast<int64_t>(ts) * 1000;
-            if (!tryReadByte(in, op)) break;
-        }
-
-        if (op == 0x00) { 
-            std::string key = readString(in);
-            std::string value = readString(in);
-            RdbEntry entry;
-            entry.value = std::move(value);
-            entry.expiry = pending_expiry_;
-            if (entry.expiry.has_value()) {
-                int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
-                    std::chrono::system_clock::now().time_since_epoch()
-                ).count();
-                if (entry.expiry.value() <= now) {
-                    pending_expiry_.reset();
-                    continue;
+// Walks a ziplist, the compact encoding dumps from before Redis 7 use for small lists,
+// hashes and sorted sets. Elements are returned in the listpack reader's form.
+class ZiplistReader {
+public:
+    explicit ZiplistReader(std::string_view ziplist) : data(ziplist) {
+        if (data.size() < 11) throw std::runtime_error("Truncated ziplist");
+    }
+
+    bool next(ListpackReader::Element &out) {
+        need(1);
+        if (byteAt(0) == 0xFF) return false;
+        // The previous entry's length, which only backward iteration needs.
+        pos += byteAt(0) < 254 ? 1 : 5;
+        need(1);
+
+        uint8_t enc = byteAt(0);
+        out = ListpackReader::Element{};
+        size_t header = 1, len = 0;
+        switch (enc >> 6) {
+            case 0:
+                len = enc & 0x3F;
+                break;
+            case 1:
+                need(2);
+                header = 2;
+                len = (static_cast<size_t>(enc & 0x3F) << 8) | byteAt(1);
+                break;
+            case 2:
+                if (enc != 0x80) throw std::runtime_error("Invalid ziplist string encoding");
+                need(5);
+                header = 5;
+                len = (size_t(byteAt(1)) << 24) | (size_t(byteAt(2)) << 16) | (size_t(byteAt(3)) << 8) | byteAt(4);
+                break;
+            default: {
+                out.is_integer = true;
+                int bytes = 0;
+                if (enc == 0xC0) bytes = 2;
+                else if (enc == 0xD0) bytes = 4;
+                else if (enc == 0xE0) bytes = 8;
+                else if (enc == 0xF0) bytes = 3;
+                else if (enc == 0xFE) bytes = 1;
+                else if (enc >= 0xF1 && enc <= 0xFD) out.integer = (enc & 0x0F) - 1;
+                else throw std::runtime_error("Invalid ziplist integer encoding");
+                need(1 + bytes);
+                if (bytes > 0) {
+                    uint64_t v = 0;
+                    for (int i = 0; i < bytes; ++i) v |= static_cast<uint64_t>(byteAt(1 + i)) << (8 * i);
+                    uint64_t sign = uint64_t(1) << (bytes * 8 - 1);
+                    out.integer = static_cast<int64_t>((v ^ sign) - sign);
                 }
+                pos += 1 + bytes;
+                return true;
             }
-            db_data_[current_db][std::move(key)] = std::move(entry);
-            pending_expiry_.reset();
-        } else if (op == 0x01 || op == 0x02 || op == 0x03 ||    op == 0x04 || op == 0x05) {
-            bool e=false; int t=0;
-            uint64_t len = readLength(in, e, t);
-            for (uint64_t i=0;i<len;i++) {
-                readString(in);
-                if (op == 0x03 || op == 0x04 || op == 0x05) readString(in);
-            }
-        } else {
-            throw std::runtime_error("Unsupported RDB object type encountered");
         }
+        need(header + len);
+        out.string = data.substr(pos + header, len);
+        pos += header + len;
+        return true;
     }
 
-    return true;
+private:
+    std::string_view data;
+    size_t pos = 10;
+
+    void need(size_t n) const {
+        if (data.size() - pos < n) throw std::runtime_error("Truncated ziplist");
+    }
+    uint8_t byteAt(size_t i) const { return static_cast<uint8_t>(data[pos + i]); }
+};
+
+static double parseScore(const ListpackReader::Element &element) {
+    if (element.is_integer) return static_cast<double>(element.integer);
+    std::string text(element.string);
+    char* end = nullptr;
+    double score = std::strtod(text.c_str(), &end);
+    if (text.empty() || *end != '\0') throw std::runtime_error("Invalid sorted set score");
+    return score;
 }
 
-std::string RdbReader::readN(std::ifstream &in, size_t n) {
-    std::string s;
-    s.resize(n);
-    in.read(&s[0], static_cast<std::streamsize>(n));
-    if (static_cast<size_t>(in.gcount()) != n) throw std::runtime_error("Unexpected EOF reading bytes");
-    return s;
+// Appends the elements of a ziplist or listpack to out as strings.
+template <typename Reader>
+static void readPacked(std::string_view blob, std::vector<std::string> &out) {
+    Reader reader(blob);
+    ListpackReader::Element element;
+    while (reader.next(element)) out.push_back(element.text());
 }
 
-bool RdbReader::tryReadByte(std::ifstream &in, uint8_t &out) {
-    char c;
-    if (!in.get(c)) return false;
-    out = static_cast<uint8_t>(static_cast<unsigned char>(c));
-    return true;
+// Reads member-score pairs from a ziplist or listpack.
+template <typename Reader>
+static void readPackedZset(std::string_view blob, std::vector<std::pair<std::string, double>> &out) {
+    Reader reader(blob);
+    ListpackReader::Element member, score;
+    while (reader.next(member)) {
+        if (!reader.next(score)) throw std::runtime_error("Sorted set member without a score");
+        out.emplace_back(member.text(), parseScore(score));
+    }
 }
 
-uint8_t RdbReader::readByte(std::ifstream &in) {
-    uint8_t b;
-    if (!tryReadByte(in, b)) throw std::runtime_error("Unexpected EOF reading byte");
-    return b;
+static StreamId readStreamId(RdbCursor &in) {
+    return StreamId{in.u64be(), in.u64be()};
 }
 
-void RdbReader::skipBytes(std::ifstream &in, size_t n) {
-    in.ignore(static_cast<std::streamsize>(n));
+static bool isStreamType(uint8_t type) {
+    return type == TYPE_STREAM_LISTPACKS || type == TYPE_STREAM_LISTPACKS_2 || type == TYPE_STREAM_LISTPACKS_3;
 }
 
-uint32_t RdbReader::readUInt32LE(std::ifstream &in) {
-    uint32_t r = 0;
-    for (int i = 0; i < 4; ++i) r |= (static_cast<uint32_t>(readByte(in)) << (8 * i));
-    return r;
+// Sets and hashes are skipped: this server has no store for them.
+static bool hasStore(uint8_t type) {
+    switch (type) {
+        case TYPE_SET: case TYPE_HASH: case TYPE_HASH_ZIPMAP: case TYPE_SET_INTSET:
+        case TYPE_HASH_ZIPLIST: case TYPE_HASH_LISTPACK: case TYPE_SET_LISTPACK:
+            return false;
+        default:
+            return true;
+    }
 }
 
-uint64_t RdbReader::readUInt64LE(std::ifstream &in) {
-    uint64_t r = 0;
-    for (int i = 0; i < 8; ++i) r |= (static_cast<uint64_t>(readByte(in)) << (8 * i));
-    return r;
+// Moves past the value of an object without decoding it.
+static void skipValue(RdbCursor &in, uint8_t type) {
+    switch (type) {
+        case TYPE_STRING: case TYPE_HASH_ZIPMAP: case TYPE_LIST_ZIPLIST: case TYPE_SET_INTSET:
+        case TYPE_ZSET_ZIPLIST: case TYPE_HASH_ZIPLIST: case TYPE_HASH_LISTPACK: case TYPE_ZSET_LISTPACK:
+        case TYPE_SET_LISTPACK:
+            in.skipString();
+            return;
+        case TYPE_LIST: case TYPE_SET: case TYPE_LIST_QUICKLIST: {
+            uint64_t n = in.length();
+            for (uint64_t i = 0; i < n; ++i) in.skipString();
+            return;
+        }
+        case TYPE_HASH: {
+            uint64_t n = in.length();
+            for (uint64_t i = 0; i < 2 * n; ++i) in.skipString();
+            return;
+        }
+        case TYPE_ZSET: {
+            uint64_t n = in.length();
+            for (uint64_t i = 0; i < n; ++i) {
+                in.skipString();
+                uint8_t len = in.byte();
+                if (len < 253) in.skip(len);
+            }
+            return;
+        }
+        case TYPE_ZSET_2: {
+            uint64_t n = in.length();
+            for (uint64_t i = 0; i < n; ++i) {
+                in.skipString();
+                in.skip(8);
+            }
+            return;
+        }
+        case TYPE_LIST_QUICKLIST_2: {
+            uint64_t n = in.length();
+            for (uint64_t i = 0; i < n; ++i) {
+                in.length();
+                in.skipString();
+            }
+            return;
+        }
+        case TYPE_STREAM_LISTPACKS: case TYPE_STREAM_LISTPACKS_2: case TYPE_STREAM_LISTPACKS_3: {
+            uint64_t nodes = in.length();
+            for (uint64_t i = 0; i < 2 * nodes; ++i) in.skipString();
+            int metadata = type == TYPE_STREAM_LISTPACKS ? 3 : 8;
+            for (int i = 0; i < metadata; ++i) in.length();
+            uint64_t groups = in.length();
+            for (uint64_t g = 0; g < groups; ++g) {
+                in.skipString();
+                in.length();
+                in.length();
+                if (type != TYPE_STREAM_LISTPACKS) in.length();
+                uint64_t pel = in.length();
+                for (uint64_t i = 0; i < pel; ++i) {
+                    in.skip(16 + 8);
+                    in.length();
+                }
+                uint64_t consumers = in.length();
+                for (uint64_t c = 0; c < consumers; ++c) {
+                    in.skipString();
+                    in.skip(type == TYPE_STREAM_LISTPACKS_3 ? 16 : 8);
+                    uint64_t owned = in.length();
+                    in.skip(16 * owned);
+                }
+            }
+            return;
+        }
+        default:
+            throw std::runtime_error("Unsupported RDB object type " + std::to_string(type));
+    }
 }
 
-uint32_t RdbReader::readUInt32BE(std::ifstream &in) {
-    uint32_t r = 0;
-    r |= static_cast<uint32_t>(readByte(in)) << 24;
-    r |= static_cast<uint32_t>(readByte(in)) << 16;
-    r |= static_cast<uint32_t>(readByte(in)) << 8;
-    r |= static_cast<uint32_t>(readByte(in));
-    return r;
+static std::vector<std::string> readList(RdbCursor &in, uint8_t type) {
+    std::vector<std::string> list;
+    if (type == TYPE_LIST_ZIPLIST) {
+        readPacked<ZiplistReader>(in.string(), list);
+        return list;
+    }
+    uint64_t n = in.length();
+    for (uint64_t i = 0; i < n; ++i) {
+        if (type == TYPE_LIST) {
+            list.push_back(in.string());
+        } else if (type == TYPE_LIST_QUICKLIST) {
+            readPacked<ZiplistReader>(in.string(), list);
+        } else {
+            // Quicklist 2 nodes are either one plain element or a listpack of them.
+            uint64_t container = in.length();
+            if (container == 1) list.push_back(in.string());
+            else readPacked<ListpackReader>(in.string(), list);
+        }
+    }
+    return list;
 }
 
-uint64_t RdbReader::readUInt64BE(std::ifstream &in) {
-    uint64_t r = 0;
-    for (int i = 0; i < 8; ++i) {
-        r = (r << 8) | static_cast<uint64_t>(readByte(in));
+static std::vector<std::pair<std::string, double>> readZset(RdbCursor &in, uint8_t type) {
+    std::vector<std::pair<std::string, double>> members;
+    if (type == TYPE_ZSET_ZIPLIST) {
+        readPackedZset<ZiplistReader>(in.string(), members);
+        return members;
+    }
+    if (type == TYPE_ZSET_LISTPACK) {
+        readPackedZset<ListpackReader>(in.string(), members);
+        return members;
     }
-    return r;
+    uint64_t n = in.length();
+    members.reserve(n);
+    for (uint64_t i = 0; i < n; ++i) {
+        std::string member = in.string();
+        double score = 0;
+        if (type == TYPE_ZSET_2) {
+            uint64_t bits = in.u64le();
+            std::memcpy(&score, &bits, sizeof(score));
+        } else {
+            // Version 1 scores are text, with three lengths reserved for nan and infinities.
+            uint8_t len = in.byte();
+            if (len == 253) score = std::nan("");
+            else if (len == 254) score = INFINITY;
+            else if (len == 255) score = -INFINITY;
+            else score = std::strtod(std::string(in.bytes(len)).c_str(), nullptr);
+        }
+        members.emplace_back(std::move(member), score);
+    }
+    return members;
 }
 
-uint64_t RdbReader::readLength(std::ifstream &in, bool &isEncoded, int &encType) {
-    isEncoded = false;
-    encType = -1;
-    uint8_t first = readByte(in);
-    uint8_t top = (first & 0xC0) >> 6;
-    if (top == 0) {
-        return static_cast<uint64_t>(first & 0x3F);
-    } else if (top == 1) {
-        uint8_t second = readByte(in);
-        return ((static_cast<uint64_t>(first & 0x3F) << 8) | static_cast<uint64_t>(second));
-    } else if (top == 2) {
-        return static_cast<uint64_t>(readUInt32BE(in));
-    } else {
-        isEncoded = true;
-        encType = static_cast<int>(first & 0x3F);
-        return 0;
+static Stream readStream(RdbCursor &in, uint8_t type) {
+    Stream stream;
+    uint64_t nodes = in.length();
+    for (uint64_t i = 0; i < nodes; ++i) {
+        std::string master = in.string();
+        if (master.size() != 16) throw std::runtime_error("Invalid stream node ID");
+        RdbCursor id_in{reinterpret_cast<const uint8_t*>(master.data()), reinterpret_cast<const uint8_t*>(master.data()) + 16};
+        StreamStoreHandler::loadNode(stream, readStreamId(id_in), in.string());
+    }
+    in.length();
+    StreamId last{in.length(), in.length()};
+    if (type != TYPE_STREAM_LISTPACKS) {
+        // The first ID is derived again from the entries.
+        in.length();
+        in.length();
+        StreamId max_deleted{in.length(), in.length()};
+        stream.setMaxDeletedId(max_deleted);
+        stream.setEntriesAdded(in.length());
     }
+    if (last > stream.lastId()) stream.setLastId(last);
+
+    uint64_t groups = in.length();
+    for (uint64_t g = 0; g < groups; ++g) {
+        ConsumerGroup& group = stream.groups()[in.string()];
+        group.last_delivered = StreamId{in.length(), in.length()};
+        if (type != TYPE_STREAM_LISTPACKS) in.length();
+
+        // The PEL carries delivery times and counts; owners come with the consumers below.
+        std::map<StreamId, std::pair<int64_t, uint64_t>> deliveries;
+        uint64_t pel = in.length();
+        for (uint64_t i = 0; i < pel; ++i) {
+            StreamId id = readStreamId(in);
+            int64_t delivery_time = static_cast<int64_t>(in.u64le());
+            deliveries[id] = {delivery_time, in.length()};
+        }
+
+        uint64_t consumers = in.length();
+        for (uint64_t c = 0; c < consumers; ++c) {
+            std::string name = in.string();
+            int64_t seen_time = static_cast<int64_t>(in.u64le());
+            if (type == TYPE_STREAM_LISTPACKS_3) in.u64le();
+            group.consumer(name, seen_time);
+            uint64_t owned = in.length();
+            for (uint64_t i = 0; i < owned; ++i) {
+                StreamId id = readStreamId(in);
+                PendingEntry& entry = group.assign(id, name, seen_time);
+                auto it = deliveries.find(id);
+                if (it != deliveries.end()) {
+                    entry.delivery_time = it->second.first;
+                    entry.delivery_count = it->second.second;
+                }
+            }
+        }
+    }
+    return stream;
 }
 
-std::string RdbReader::readString(std::ifstream &in) {
-    bool enc=false; int encType=0;
-    uint64_t len = readLength(in, enc, encType);
-    if (enc) {
-        if (encType == 0) {
-            int8_t v = static_cast<int8_t>(readByte(in));
-            return std::to_string((int)v);
-        } else if (encType == 1) {
-            uint8_t b0 = readByte(in);
-            uint8_t b1 = readByte(in);
-            int16_t v = static_cast<int16_t>(static_cast<uint16_t>(b0) | (static_cast<uint16_t>(b1) << 8));
-            return std::to_string((int)v);
-        } else if (encType == 2) {
-            uint32_t v = readUInt32LE(in);
-            return std::to_string(v);
-        } else if (encType == 3) {
-            bool t=false; int dummy=0;
-            uint64_t clen = readLength(in, t, dummy);
-            uint64_t olen = readLength(in, t, dummy);
-            skipBytes(in, static_cast<size_t>(clen));
-            throw std::runtime_error("Encountered LZF-compressed string; unsupported in this RdbReader.");
-        } else {
-            throw std::runtime_error("Unknown string encoding type");
+// A key-value entry located by the scanner but not decoded yet.
+struct RdbEntryRef {
+    uint8_t type;
+    std::optional<int64_t> expire_ms;
+    const uint8_t* begin;
+    const uint8_t* end;
+};
+
+// Bounded hand-off of entry batches from the scanner to the workers.
+class RdbLoadQueue {
+public:
+    explicit RdbLoadQueue(size_t capacity) : capacity(capacity) {}
+
+    // Blocks while the queue is full; returns false once the load was aborted.
+    bool push(std::vector<RdbEntryRef> batch) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [&] { return batches.size() < capacity || aborted; });
+        if (aborted) return false;
+        batches.push_back(std::move(batch));
+        not_empty.notify_one();
+        return true;
+    }
+
+    // Returns false when there is nothing left to decode.
+    bool pop(std::vector<RdbEntryRef> &batch) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [&] { return !batches.empty() || closed || aborted; });
+        if (batches.empty() || aborted) return false;
+        batch = std::move(batches.front());
+        batches.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+    void abort() {
+        std::lock_guard<std::mutex> lock(mutex);
+        aborted = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+private:
+    size_t capacity;
+    std::deque<std::vector<RdbEntryRef>> batches;
+    std::mutex mutex;
+    std::condition_variable not_empty, not_full;
+    bool closed = false;
+    bool aborted = false;
+};
+
+static constexpr size_t LOAD_BATCH_SIZE = 1024;
+
+// Read-only mapping of a whole file, unmapped on scope exit.
+struct MappedFile {
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+
+    ~MappedFile() {
+        if (data) munmap(const_cast<uint8_t*>(data), size);
+    }
+};
+
+RdbReader::RdbReader(const std::string &filepath, size_t workers)
+    : filepath_(filepath), workers_(workers ? workers : std::max(1u, std::thread::hardware_concurrency())) {}
+
+bool RdbReader::load() {
+    int fd = open(filepath_.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "RdbReader: file not found: " << filepath_ << " (continuing without load)\n";
+        return true;
+    }
+    struct stat st{};
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        std::cerr << "RdbReader: empty or unreadable file: " << filepath_ << "\n";
+        return true;
+    }
+
+    MappedFile file;
+    void* addr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        std::cerr << "RdbReader: mmap failed for " << filepath_ << ": " << strerror(errno) << "\n";
+        return false;
+    }
+    file.data = static_cast<const uint8_t*>(addr);
+    file.size = static_cast<size_t>(st.st_size);
+    madvise(addr, file.size, MADV_SEQUENTIAL);
+
+    RdbCursor in{file.data, file.data + file.size};
+    RdbLoadQueue queue(workers_ * 4);
+    std::mutex error_mutex;
+    std::string error;
+    auto fail = [&](const std::string& what) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (error.empty()) error = what;
+        queue.abort();
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < workers_; ++i) {
+        workers.emplace_back([&]() {
+            std::vector<RdbEntryRef> batch;
+            try {
+                while (queue.pop(batch)) decode(batch);
+            } catch (const std::exception &ex) {
+                fail(ex.what());
+            }
+        });
+    }
+
+    try {
+        if (!scan(in, queue)) {
+            std::cerr << "RdbReader: scan returned false for " << filepath_ << "\n";
         }
-    } else {
-        if (len == 0) return std::string();
-        std::string s;
-        s.resize(len);
-        in.read(&s[0], static_cast<std::streamsize>(len));
-        if (static_cast<uint64_t>(in.gcount()) != len) throw std::runtime_error("Unexpected EOF reading string payload");
-        return s;
+    } catch (const std::exception &ex) {
+        fail(ex.what());
+    }
+    queue.close();
+    for (auto& worker : workers) worker.join();
+
+    if (!error.empty()) {
+        std::cerr << "RdbReader: exception while parsing: " << error << "\n";
+        end_offset_ = 0;
     }
+    return true;
+}
+
+bool RdbReader::scan(RdbCursor &in, RdbLoadQueue &queue) {
+    const uint8_t* start = in.pos;
+    if (in.remaining() < 9 || in.bytes(5) != "REDIS") {
+        return false;
+    }
+    in.skip(4);
+
+    int current_db = 0;
+    std::optional<int64_t> pending_expiry;
+    std::vector<RdbEntryRef> batch;
+    batch.reserve(LOAD_BATCH_SIZE);
+
+    while (in.remaining() > 0) {
+        uint8_t op = in.byte();
+
+        if (op == 0xFF) {
+            // Dumps before version 5 have no checksum.
+            in.skip(std::min<size_t>(8, in.remaining()));
+            end_offset_ = static_cast<size_t>(in.pos - start);
+            break;
+        } else if (op == 0xFE) {
+            current_db = static_cast<int>(in.length());
+            continue;
+        } else if (op == 0xFB) {
+            uint64_t db_size = in.length();
+            in.length();
+            if (current_db == 0) KvStoreHandler::reserve(static_cast<size_t>(db_size));
+            continue;
+        } else if (op == 0xFA) {
+            in.skipString();
+            in.skipString();
+            continue;
+        } else if (op == 0xFC) {
+            pending_expiry = static_cast<int64_t>(in.u64le());
+            continue;
+        } else if (op == 0xFD) {
+            pending_expiry = static_cast<int64_t>(in.u32le()) * 1000;
+            continue;
+        } else if (op == 0xF8) {
+            // LRU idle time and LFU frequency of the next key.
+            in.length();
+            continue;
+        } else if (op == 0xF9) {
+            in.byte();
+            continue;
+        } else if (op == 0xF5) {
+            // Function library source.
+            in.skipString();
+            continue;
+        } else if (op == 0xF4) {
+            // Cluster slot sizes.
+            for (int i = 0; i < 3; ++i) in.length();
+            continue;
+        }
+
+        RdbEntryRef entry{op, pending_expiry, in.pos, nullptr};
+        pending_expiry.reset();
+
+        in.skipString();
+        skipValue(in, op);
+        if (current_db != 0) continue;
+        if (!hasStore(op)) {
+            keys_skipped_++;
+            continue;
+        }
+
+        entry.end = in.pos;
+        batch.push_back(entry);
+        if (batch.size() == LOAD_BATCH_SIZE) {
+            if (!queue.push(std::move(batch))) return true;
+            batch.clear();
+            batch.reserve(LOAD_BATCH_SIZE);
+        }
+    }
+
+    if (!batch.empty()) queue.push(std::move(batch));
+    return true;
+}
+
+void RdbReader::decode(std::vector<RdbEntryRef> &batch) {
+    std::vector<RestoredString> strings;
+    std::vector<std::pair<std::string, std::vector<std::string>>> lists;
+    std::vector<std::pair<std::string, std::vector<std::pair<std::string, double>>>> zsets;
+    std::vector<std::pair<std::string, Stream>> streams;
+    int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+    for (const auto& entry : batch) {
+        RdbCursor in{entry.begin, entry.end};
+        std::string key = in.string();
+        if (entry.type == TYPE_STRING) {
+            strings.push_back({std::move(key), in.string(), entry.expire_ms});
+            continue;
+        }
+        // Only strings can expire here: other keys are dropped if already expired and
+        // otherwise loaded without their TTL.
+        if (entry.expire_ms && *entry.expire_ms <= now) continue;
+        switch (entry.type) {
+            case TYPE_LIST: case TYPE_LIST_ZIPLIST: case TYPE_LIST_QUICKLIST: case TYPE_LIST_QUICKLIST_2:
+                lists.emplace_back(std::move(key), readList(in, entry.type));
+                break;
+            case TYPE_ZSET: case TYPE_ZSET_2: case TYPE_ZSET_ZIPLIST: case TYPE_ZSET_LISTPACK:
+                zsets.emplace_back(std::move(key), readZset(in, entry.type));
+                break;
+            default:
+                if (!isStreamType(entry.type)) throw std::runtime_error("Unsupported RDB object type " + std::to_string(entry.type));
+                streams.emplace_back(std::move(key), readStream(in, entry.type));
+        }
+    }
+
+    if (!strings.empty()) keys_loaded_ += KvStoreHandler::restore(strings);
+    if (!lists.empty()) keys_loaded_ += ListStoreHandler::restore(lists);
+    if (!zsets.empty()) keys_loaded_ += SortedSetHandler::restore(zsets);
+    if (!streams.empty()) keys_loaded_ += StreamStoreHandler::restore(streams);
 }
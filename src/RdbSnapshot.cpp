@@ -0,0 +1,104 @@
+#include "RdbSnapshot.hpp"
+#include "Handler.hpp"
+#include "RdbWriter.hpp"
+#include "StoreLock.hpp"
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <fcntl.h>
+#include <iostream>
+#include <mutex>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+static std::mutex state_mutex;
+static pid_t child_pid = -1;
+static int64_t last_save_time = 0;
+static bool last_bgsave_ok = true;
+
+static int64_t unixSeconds() {
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+bool RdbSnapshot::writeFile(const std::string& path) {
+    std::string temp = path + ".tmp-" + std::to_string(getpid());
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+
+    bool ok = writeTo(fd) && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+
+    if (ok && rename(temp.c_str(), path.c_str()) == 0) return true;
+    unlink(temp.c_str());
+    return false;
+}
+
+bool RdbSnapshot::writeTo(int fd) {
+    RdbWriter out(fd);
+    out.writeHeader();
+    KvStoreHandler::saveTo(out);
+    ListStoreHandler::saveTo(out);
+    SortedSetHandler::saveTo(out);
+    StreamStoreHandler::saveTo(out);
+    return out.finish();
+}
+
+RdbSnapshot::Result RdbSnapshot::save(const std::string& path) {
+    std::lock_guard<std::mutex> state(state_mutex);
+    if (child_pid != -1) return Result::AlreadyRunning;
+
+    StoreLock::acquireBatch(Handler::allStores());
+    bool ok = writeFile(path);
+    StoreLock::releaseBatch();
+
+    if (!ok) return Result::Failed;
+    last_save_time = unixSeconds();
+    return Result::Ok;
+}
+
+RdbSnapshot::Result RdbSnapshot::saveInBackground(const std::string& path) {
+    std::lock_guard<std::mutex> state(state_mutex);
+    if (child_pid != -1) return Result::AlreadyRunning;
+
+    StoreLock::acquireBatch(Handler::allStores());
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Only this thread exists in the child; it owns the store locks it inherited.
+        _exit(writeFile(path) ? 0 : 1);
+    }
+    StoreLock::releaseBatch();
+
+    if (pid < 0) {
+        std::cerr << "BGSAVE: fork failed\n";
+        return Result::Failed;
+    }
+    child_pid = pid;
+
+    std::thread([pid]() {
+        int status = 0;
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+        bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        std::lock_guard<std::mutex> state(state_mutex);
+        child_pid = -1;
+        last_bgsave_ok = ok;
+        if (ok) last_save_time = unixSeconds();
+        else std::cerr << "BGSAVE: background save failed\n";
+    }).detach();
+    return Result::Ok;
+}
+
+bool RdbSnapshot::inProgress() {
+    std::lock_guard<std::mutex> state(state_mutex);
+    return child_pid != -1;
+}
+
+int64_t RdbSnapshot::lastSaveTime() {
+    std::lock_guard<std::mutex> state(state_mutex);
+    return last_save_time;
+}
+
+bool RdbSnapshot::lastBackgroundSaveOk() {
+    std::lock_guard<std::mutex> state(state_mutex);
+    return last_bgsave_ok;
+}
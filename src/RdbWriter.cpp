@@ -0,0 +1,164 @@
+#include "RdbWriter.hpp"
+#include "Lzf.hpp"
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <unistd.h>
+
+static constexpr uint8_t OP_AUX = 0xFA;
+static constexpr uint8_t OP_EXPIRETIME_MS = 0xFC;
+static constexpr uint8_t OP_SELECTDB = 0xFE;
+static constexpr uint8_t OP_EOF = 0xFF;
+
+// CRC-64/Jones, reflected, as Redis checksums RDB files.
+static const std::array<uint64_t, 256>& crcTable() {
+    static const std::array<uint64_t, 256> table = [] {
+        std::array<uint64_t, 256> t{};
+        for (uint64_t i = 0; i < 256; ++i) {
+            uint64_t crc = i;
+            for (int bit = 0; bit < 8; ++bit) crc = crc & 1 ? (crc >> 1) ^ 0x95AC9329AC4BC9B5ULL : crc >> 1;
+            t[i] = crc;
+        }
+        return t;
+    }();
+    return table;
+}
+
+static uint64_t crc64(uint64_t crc, std::string_view bytes) {
+    const auto& table = crcTable();
+    for (unsigned char c : bytes) crc = table[(crc ^ c) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+static bool writeAll(int fd, std::string_view bytes) {
+    while (!bytes.empty()) {
+        ssize_t n = ::write(fd, bytes.data(), bytes.size());
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        bytes.remove_prefix(static_cast<size_t>(n));
+    }
+    return true;
+}
+
+void RdbWriter::writeHeader() {
+    writeRaw("REDIS0011");
+    auto aux = [this](std::string_view name, std::string_view value) {
+        writeByte(OP_AUX);
+        writeString(name);
+        writeString(value);
+    };
+    int64_t now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    aux("redis-ver", "7.2.0");
+    aux("redis-bits", std::to_string(sizeof(void*) * 8));
+    aux("ctime", std::to_string(now));
+    writeByte(OP_SELECTDB);
+    writeLength(0);
+}
+
+void RdbWriter::writeKey(Type type, std::string_view key, int64_t expire_ms) {
+    if (expire_ms >= 0) {
+        writeByte(OP_EXPIRETIME_MS);
+        writeMillis(expire_ms);
+    }
+    writeByte(type);
+    writeString(key);
+}
+
+void RdbWriter::writeLength(uint64_t length) {
+    if (length < (1 << 6)) {
+        writeByte(static_cast<uint8_t>(length));
+    } else if (length < (1 << 14)) {
+        writeByte(static_cast<uint8_t>(0x40 | (length >> 8)));
+        writeByte(static_cast<uint8_t>(length & 0xFF));
+    } else if (length <= UINT32_MAX) {
+        writeByte(0x80);
+        for (int i = 3; i >= 0; --i) writeByte(static_cast<uint8_t>(length >> (8 * i)));
+    } else {
+        writeByte(0x81);
+        for (int i = 7; i >= 0; --i) writeByte(static_cast<uint8_t>(length >> (8 * i)));
+    }
+}
+
+void RdbWriter::writeString(std::string_view value) {
+    // Only the canonical form round-trips, so "007" or "+1" stay strings.
+    int64_t number = 0;
+    if (!value.empty() && value.size() <= 11) {
+        auto res = std::from_chars(value.data(), value.data() + value.size(), number);
+        if (res.ec == std::errc{} && res.ptr == value.data() + value.size() && std::to_string(number) == value) {
+            if (number >= INT8_MIN && number <= INT8_MAX) {
+                writeByte(0xC0);
+                writeByte(static_cast<uint8_t>(number));
+                return;
+            }
+            if (number >= INT16_MIN && number <= INT16_MAX) {
+                writeByte(0xC1);
+                for (int i = 0; i < 2; ++i) writeByte(static_cast<uint8_t>(static_cast<uint64_t>(number) >> (8 * i)));
+                return;
+            }
+            if (number >= INT32_MIN && number <= INT32_MAX) {
+                writeByte(0xC2);
+                for (int i = 0; i < 4; ++i) writeByte(static_cast<uint8_t>(static_cast<uint64_t>(number) >> (8 * i)));
+                return;
+            }
+        }
+    }
+    // As Redis does, only strings that shrink by at least four bytes are stored compressed.
+    if (value.size() > COMPRESS_MIN_LENGTH) {
+        compress_buffer.resize(value.size() - 4);
+        size_t compressed = lzfCompress(value, compress_buffer.data(), compress_buffer.size());
+        if (compressed > 0) {
+            writeByte(0xC3);
+            writeLength(compressed);
+            writeLength(value.size());
+            writeRaw(std::string_view(compress_buffer.data(), compressed));
+            return;
+        }
+    }
+    writeLength(value.size());
+    writeRaw(value);
+}
+
+void RdbWriter::writeBinaryDouble(double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    for (int i = 0; i < 8; ++i) writeByte(static_cast<uint8_t>(bits >> (8 * i)));
+}
+
+void RdbWriter::writeMillis(int64_t ms) {
+    uint64_t bits = static_cast<uint64_t>(ms);
+    for (int i = 0; i < 8; ++i) writeByte(static_cast<uint8_t>(bits >> (8 * i)));
+}
+
+void RdbWriter::writeRaw(std::string_view bytes) {
+    if (buffer.size() + bytes.size() > BUFFER_SIZE) flush();
+    if (bytes.size() >= BUFFER_SIZE) {
+        crc = crc64(crc, bytes);
+        if (!failed) failed = !writeAll(fd, bytes);
+        return;
+    }
+    buffer.append(bytes);
+}
+
+void RdbWriter::writeByte(uint8_t byte) {
+    if (buffer.size() + 1 > BUFFER_SIZE) flush();
+    buffer += static_cast<char>(byte);
+}
+
+void RdbWriter::flush() {
+    crc = crc64(crc, buffer);
+    if (!failed) failed = !writeAll(fd, buffer);
+    buffer.clear();
+}
+
+bool RdbWriter::finish() {
+    writeByte(OP_EOF);
+    flush();
+    // The checksum covers everything before it and is stored little-endian.
+    uint64_t checksum = crc;
+    for (int i = 0; i < 8; ++i) buffer += static_cast<char>((checksum >> (8 * i)) & 0xFF);
+    if (!failed) failed = !writeAll(fd, buffer);
+    buffer.clear();
+    return !failed;
+}
@@ -1,26 +1,31 @@
 #include "ReplicationManager.hpp"
+#include "ClientOutput.hpp"
+#include <algorithm>
+#include <memory>
 #include <sstream>
 
 void ReplicationManager::addReplica(int fd) {
     std::lock_guard<std::mutex> lock(mtx);
-    replica_fds.push_back(fd);
+    replica_ids.push_back(ClientOutput::clientId(fd));
+    ClientOutput::setClass(fd, ClientOutput::ClientClass::Replica);
 }
 
 void ReplicationManager::removeReplica(int fd) {
     std::lock_guard<std::mutex> lock(mtx);
-    replica_fds.erase(std::remove(replica_fds.begin(), replica_fds.end(), fd), replica_fds.end());
+    ClientOutput::ClientId id = ClientOutput::clientId(fd);
+    replica_ids.erase(std::remove(replica_ids.begin(), replica_ids.end(), id), replica_ids.end());
 }
 
-void ReplicationManager::propagateCommand(const std::vector<std::string>& cmdParts) {
+void ReplicationManager::propagateCommands(const std::vector<std::vector<std::string>>& commands) {
     std::ostringstream oss;
-    oss << "*" << cmdParts.size() << "\r\n";
-    for (const auto& arg : cmdParts) {
-        oss << "$" << arg.size() << "\r\n" << arg << "\r\n";
+    for (const auto& cmdParts : commands) {
+        oss << "*" << cmdParts.size() << "\r\n";
+        for (const auto& arg : cmdParts) {
+            oss << "$" << arg.size() << "\r\n" << arg << "\r\n";
+        }
     }
-    std::string resp = oss.str();
+    auto resp = std::make_shared<const std::string>(oss.str());
 
     std::lock_guard<std::mutex> lock(mtx);
-    for (int fd : replica_fds) {
-        send(fd, resp.c_str(), resp.size(), 0);
-    }
+    ClientOutput::broadcast(replica_ids, resp);
 }
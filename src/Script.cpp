@@ -0,0 +1,1199 @@
+#include "Script.hpp"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+ScriptValue ScriptValue::fromBool(bool value) {
+    ScriptValue v;
+    v.type = Type::Boolean;
+    v.boolean = value;
+    return v;
+}
+
+ScriptValue ScriptValue::fromNumber(double value) {
+    ScriptValue v;
+    v.type = Type::Number;
+    v.number = value;
+    return v;
+}
+
+ScriptValue ScriptValue::fromString(std::string value) {
+    ScriptValue v;
+    v.type = Type::String;
+    v.string = std::move(value);
+    return v;
+}
+
+ScriptValue ScriptValue::fromTable(std::shared_ptr<ScriptTable> value) {
+    ScriptValue v;
+    v.type = Type::Table;
+    v.table = std::move(value);
+    return v;
+}
+
+ScriptValue ScriptValue::fromFunction(Function value) {
+    ScriptValue v;
+    v.type = Type::Function;
+    v.function = std::make_shared<const Function>(std::move(value));
+    return v;
+}
+
+const char* ScriptValue::typeName() const {
+    switch (type) {
+        case Type::Nil: return "nil";
+        case Type::Boolean: return "boolean";
+        case Type::Number: return "number";
+        case Type::String: return "string";
+        case Type::Table: return "table";
+        case Type::Function: return "function";
+    }
+    return "nil";
+}
+
+static bool arrayIndex(const ScriptValue& key, size_t& index) {
+    if (key.type != ScriptValue::Type::Number || key.number < 1 || key.number > 1e15 || std::floor(key.number) != key.number) return false;
+    index = static_cast<size_t>(key.number);
+    return true;
+}
+
+ScriptValue ScriptTable::get(const ScriptValue& key) const {
+    size_t index;
+    if (arrayIndex(key, index)) {
+        if (index <= array.size()) return array[index - 1];
+    }
+    if (key.type == ScriptValue::Type::Number) {
+        auto it = numbers.find(key.number);
+        return it == numbers.end() ? ScriptValue() : it->second;
+    }
+    if (key.type == ScriptValue::Type::String) {
+        auto it = fields.find(key.string);
+        return it == fields.end() ? ScriptValue() : it->second;
+    }
+    return ScriptValue();
+}
+
+void ScriptTable::set(const ScriptValue& key, ScriptValue value) {
+    if (readonly) throw ScriptError("ERR Attempt to modify a readonly table");
+    bool remove = value.type == ScriptValue::Type::Nil;
+
+    size_t index;
+    if (arrayIndex(key, index) && index <= array.size() + 1) {
+        if (index <= array.size()) {
+            array[index - 1] = std::move(value);
+            while (!array.empty() && array.back().type == ScriptValue::Type::Nil) array.pop_back();
+        } else if (!remove) {
+            array.push_back(std::move(value));
+            // Keys that were stored sparsely join the array once it reaches them.
+            for (auto it = numbers.find(double(array.size() + 1)); it != numbers.end(); it = numbers.find(double(array.size() + 1))) {
+                array.push_back(std::move(it->second));
+                numbers.erase(it);
+            }
+        }
+        return;
+    }
+    if (key.type == ScriptValue::Type::Number) {
+        if (std::isnan(key.number)) throw ScriptError("ERR table index is NaN");
+        if (remove) numbers.erase(key.number);
+        else numbers[key.number] = std::move(value);
+    } else if (key.type == ScriptValue::Type::String) {
+        if (remove) fields.erase(key.string);
+        else fields[key.string] = std::move(value);
+    } else if (key.type == ScriptValue::Type::Nil) {
+        throw ScriptError("ERR table index is nil");
+    } else {
+        throw ScriptError(std::string("ERR unsupported table key type ") + key.typeName());
+    }
+}
+
+struct Script::Expr {
+    enum Kind { Nil, True, False, Number, String, Local, Global, Index, Call, Table, Binary, Unary, And, Or } kind;
+    enum Op { Add, Sub, Mul, Div, Mod, Pow, Concat, Eq, Ne, Lt, Le, Gt, Ge, Neg, Not, Len } op = Add;
+    int line = 0;
+    double number = 0;
+    std::string text;
+    // Local frame slot, or index into the script's global names.
+    size_t slot = 0;
+    // Operands; callee then arguments; table then key; or table constructor values.
+    std::vector<std::unique_ptr<Expr>> children;
+    // Table constructor keys, null for positional values.
+    std::vector<std::unique_ptr<Expr>> keys;
+};
+
+struct Script::Stmt {
+    enum Kind { Local, Assign, Call, If, While, Repeat, NumericFor, GenericFor, Do, Break, Return } kind;
+    int line = 0;
+    // Variables declared by local and for statements.
+    std::vector<size_t> slots;
+    std::vector<std::unique_ptr<Expr>> targets;
+    // Assigned values, branch and loop conditions, for bounds, or the call.
+    std::vector<std::unique_ptr<Expr>> exprs;
+    // If branches followed by an optional else block, or a loop body.
+    std::vector<Block> blocks;
+    // Generic for: pairs() rather than ipairs().
+    bool all_pairs = false;
+};
+
+namespace {
+
+struct Token {
+    enum Kind { End, Name, Number, String, Symbol } kind = End;
+    std::string text;
+    double number = 0;
+    int line = 1;
+};
+
+[[noreturn]] void syntaxError(int line, const std::string& message) {
+    throw ScriptError("ERR Error compiling script: user_script:" + std::to_string(line) + ": " + message);
+}
+
+class Lexer {
+public:
+    explicit Lexer(const std::string& source) : src(source) {}
+
+    Token next() {
+        skipSpaceAndComments();
+        Token token;
+        token.line = line;
+        if (pos >= src.size()) return token;
+
+        char c = src[pos];
+        if (std::isalpha(static_cast<unsigned char>(c)) || c == '_') {
+            size_t start = pos;
+            while (pos < src.size() && (std::isalnum(static_cast<unsigned char>(src[pos])) || src[pos] == '_')) pos++;
+            token.kind = Token::Name;
+            token.text = src.substr(start, pos - start);
+        } else if (std::isdigit(static_cast<unsigned char>(c)) || (c == '.' && pos + 1 < src.size() && std::isdigit(static_cast<unsigned char>(src[pos + 1])))) {
+            const char* begin = src.c_str() + pos;
+            char* end = nullptr;
+            token.number = std::strtod(begin, &end);
+            if (end == begin || (end < src.c_str() + src.size() && (std::isalpha(static_cast<unsigned char>(*end)) || *end == '_'))) {
+                syntaxError(line, "malformed number near '" + src.substr(pos, 10) + "'");
+            }
+            pos += end - begin;
+            token.kind = Token::Number;
+        } else if (c == '"' || c == '\'') {
+            token.kind = Token::String;
+            token.text = readQuoted(c);
+        } else if (c == '[' && (peek(1) == '[' || peek(1) == '=')) {
+            token.kind = Token::String;
+            token.text = readLong();
+        } else {
+            static const char* symbols[] = {"...", "..", "==", "~=", "<=", ">="};
+            token.kind = Token::Symbol;
+            for (const char* symbol : symbols) {
+                if (src.compare(pos, std::strlen(symbol), symbol) == 0) {
+                    token.text = symbol;
+                    break;
+                }
+            }
+            if (token.text.empty()) {
+                if (c == '\0' || !std::strchr("+-*/%^#<>=(){}[];:,.", c)) syntaxError(line, std::string("unexpected symbol near '") + c + "'");
+                token.text = std::string(1, c);
+            }
+            pos += token.text.size();
+        }
+        return token;
+    }
+
+private:
+    const std::string& src;
+    size_t pos = 0;
+    int line = 1;
+
+    char peek(size_t ahead) const { return pos + ahead < src.size() ? src[pos + ahead] : '\0'; }
+
+    void skipSpaceAndComments() {
+        while (pos < src.size()) {
+            char c = src[pos];
+            if (c == '\n') {
+                line++;
+                pos++;
+            } else if (std::isspace(static_cast<unsigned char>(c))) {
+                pos++;
+            } else if (c == '-' && peek(1) == '-') {
+                pos += 2;
+                if (peek(0) == '[' && (peek(1) == '[' || peek(1) == '=')) {
+                    readLong();
+                } else {
+                    while (pos < src.size() && src[pos] != '\n') pos++;
+                }
+            } else {
+                break;
+            }
+        }
+    }
+
+    std::string readQuoted(char quote) {
+        std::string out;
+        pos++;
+        while (true) {
+            if (pos >= src.size() || src[pos] == '\n') syntaxError(line, "unfinished string");
+            char c = src[pos++];
+            if (c == quote) break;
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (pos >= src.size()) syntaxError(line, "unfinished string");
+            char e = src[pos++];
+            switch (e) {
+                case 'n': out += '\n'; break;
+                case 't': out += '\t'; break;
+                case 'r': out += '\r'; break;
+                case 'a': out += '\a'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'v': out += '\v'; break;
+                case '\n': out += '\n'; line++; break;
+                default:
+                    if (std::isdigit(static_cast<unsigned char>(e))) {
+                        int value = e - '0';
+                        for (int i = 0; i < 2 && std::isdigit(static_cast<unsigned char>(peek(0))); ++i) value = value * 10 + (src[pos++] - '0');
+                        if (value > 255) syntaxError(line, "escape sequence too large");
+                        out += static_cast<char>(value);
+                    } else {
+                        out += e;
+                    }
+            }
+        }
+        return out;
+    }
+
+    // [[...]] or [==[...]==]; a newline right after the opening bracket is dropped.
+    std::string readLong() {
+        size_t level = 0;
+        pos++;
+        while (peek(0) == '=') {
+            level++;
+            pos++;
+        }
+        if (peek(0) != '[') syntaxError(line, "invalid long string delimiter");
+        pos++;
+        if (peek(0) == '\n') {
+            line++;
+            pos++;
+        }
+        std::string close = "]" + std::string(level, '=') + "]";
+        size_t end = src.find(close, pos);
+        if (end == std::string::npos) syntaxError(line, "unfinished long string");
+        std::string out = src.substr(pos, end - pos);
+        line += static_cast<int>(std::count(out.begin(), out.end(), '\n'));
+        pos = end + close.size();
+        return out;
+    }
+};
+
+bool isKeyword(const std::string& name) {
+    static const char* keywords[] = {"and", "break", "do", "else", "elseif", "end", "false", "for", "function", "if", "in",
+                                     "local", "nil", "not", "or", "repeat", "return", "then", "true", "until", "while"};
+    for (const char* keyword : keywords) {
+        if (name == keyword) return true;
+    }
+    return false;
+}
+
+using Expr = Script::Expr;
+using Stmt = Script::Stmt;
+using Block = Script::Block;
+using ExprPtr = std::unique_ptr<Expr>;
+
+class Compiler {
+public:
+    Compiler(const std::string& source, std::vector<std::string>& globals, size_t& slots)
+        : lexer(source), global_names(globals), slot_count(slots) {
+        current = lexer.next();
+        lookahead = lexer.next();
+    }
+
+    Block compileChunk() {
+        Block block = parseBlock();
+        if (current.kind != Token::End) syntaxError(current.line, "'<eof>' expected near '" + describe(current) + "'");
+        return block;
+    }
+
+private:
+    Lexer lexer;
+    Token current;
+    Token lookahead;
+    std::vector<std::string>& global_names;
+    size_t& slot_count;
+    std::vector<std::vector<std::pair<std::string, size_t>>> scopes;
+
+    static std::string describe(const Token& token) {
+        if (token.kind == Token::End) return "<eof>";
+        if (token.kind == Token::Number) return "number";
+        return token.text;
+    }
+
+    void advance() {
+        current = std::move(lookahead);
+        lookahead = lexer.next();
+    }
+
+    bool check(const char* text) const {
+        return (current.kind == Token::Symbol || current.kind == Token::Name) && current.text == text;
+    }
+
+    bool accept(const char* text) {
+        if (!check(text)) return false;
+        advance();
+        return true;
+    }
+
+    void expect(const char* text) {
+        if (!accept(text)) syntaxError(current.line, std::string("'") + text + "' expected near '" + describe(current) + "'");
+    }
+
+    std::string expectName() {
+        if (current.kind != Token::Name || isKeyword(current.text)) syntaxError(current.line, "<name> expected near '" + describe(current) + "'");
+        std::string name = current.text;
+        advance();
+        return name;
+    }
+
+    size_t declare(const std::string& name) {
+        scopes.back().emplace_back(name, slot_count);
+        return slot_count++;
+    }
+
+    ExprPtr makeExpr(Expr::Kind kind, int line) {
+        auto expr = std::make_unique<Expr>();
+        expr->kind = kind;
+        expr->line = line;
+        return expr;
+    }
+
+    ExprPtr resolve(const std::string& name, int line) {
+        for (auto scope = scopes.rbegin(); scope != scopes.rend(); ++scope) {
+            for (auto it = scope->rbegin(); it != scope->rend(); ++it) {
+                if (it->first == name) {
+                    auto expr = makeExpr(Expr::Local, line);
+                    expr->slot = it->second;
+                    return expr;
+                }
+            }
+        }
+        auto expr = makeExpr(Expr::Global, line);
+        auto it = std::find(global_names.begin(), global_names.end(), name);
+        expr->slot = it - global_names.begin();
+        if (it == global_names.end()) global_names.push_back(name);
+        return expr;
+    }
+
+    bool blockEnds() const {
+        return current.kind == Token::End || check("end") || check("else") || check("elseif") || check("until");
+    }
+
+    Block parseBlock() {
+        scopes.emplace_back();
+        Block block = parseStatements();
+        scopes.pop_back();
+        return block;
+    }
+
+    Block parseStatements() {
+        Block block;
+        while (!blockEnds()) {
+            if (check("return")) {
+                auto stmt = std::make_unique<Stmt>();
+                stmt->kind = Stmt::Return;
+                stmt->line = current.line;
+                advance();
+                if (!blockEnds() && !check(";")) stmt->exprs = parseExprList();
+                accept(";");
+                block.push_back(std::move(stmt));
+                if (!blockEnds()) syntaxError(current.line, "'end' expected near '" + describe(current) + "'");
+                break;
+            }
+            block.push_back(parseStatement());
+            accept(";");
+        }
+        return block;
+    }
+
+    std::vector<ExprPtr> parseExprList() {
+        std::vector<ExprPtr> list;
+        list.push_back(parseExpr());
+        while (accept(",")) list.push_back(parseExpr());
+        return list;
+    }
+
+    std::unique_ptr<Stmt> parseStatement() {
+        auto stmt = std::make_unique<Stmt>();
+        stmt->line = current.line;
+
+        if (accept("local")) {
+            if (check("function")) syntaxError(current.line, "function definitions are not supported");
+            stmt->kind = Stmt::Local;
+            std::vector<std::string> names{expectName()};
+            while (accept(",")) names.push_back(expectName());
+            if (accept("=")) stmt->exprs = parseExprList();
+            // The new locals are only visible after their initializers.
+            for (const auto& name : names) stmt->slots.push_back(declare(name));
+        } else if (accept("if")) {
+            stmt->kind = Stmt::If;
+            stmt->exprs.push_back(parseExpr());
+            expect("then");
+            stmt->blocks.push_back(parseBlock());
+            while (accept("elseif")) {
+                stmt->exprs.push_back(parseExpr());
+                expect("then");
+                stmt->blocks.push_back(parseBlock());
+            }
+            if (accept("else")) stmt->blocks.push_back(parseBlock());
+            expect("end");
+        } else if (accept("while")) {
+            stmt->kind = Stmt::While;
+            stmt->exprs.push_back(parseExpr());
+            expect("do");
+            stmt->blocks.push_back(parseBlock());
+            expect("end");
+        } else if (accept("repeat")) {
+            stmt->kind = Stmt::Repeat;
+            // The condition can see the body's locals.
+            scopes.emplace_back();
+            stmt->blocks.push_back(parseStatements());
+            expect("until");
+            stmt->exprs.push_back(parseExpr());
+            scopes.pop_back();
+        } else if (accept("for")) {
+            parseFor(*stmt);
+        } else if (accept("do")) {
+            stmt->kind = Stmt::Do;
+            stmt->blocks.push_back(parseBlock());
+            expect("end");
+        } else if (accept("break")) {
+            stmt->kind = Stmt::Break;
+        } else if (check("function")) {
+            syntaxError(current.line, "function definitions are not supported");
+        } else {
+            ExprPtr expr = parseSuffixed();
+            if (check("=") || check(",")) {
+                stmt->kind = Stmt::Assign;
+                stmt->targets.push_back(std::move(expr));
+                while (accept(",")) stmt->targets.push_back(parseSuffixed());
+                expect("=");
+                stmt->exprs = parseExprList();
+                for (const auto& target : stmt->targets) {
+                    if (target->kind != Expr::Local && target->kind != Expr::Global && target->kind != Expr::Index) {
+                        syntaxError(stmt->line, "syntax error near '='");
+                    }
+                }
+            } else if (expr->kind == Expr::Call) {
+                stmt->kind = Stmt::Call;
+                stmt->exprs.push_back(std::move(expr));
+            } else {
+                syntaxError(stmt->line, "syntax error near '" + describe(current) + "'");
+            }
+        }
+        return stmt;
+    }
+
+    void parseFor(Stmt& stmt) {
+        std::string first = expectName();
+        if (accept("=")) {
+            stmt.kind = Stmt::NumericFor;
+            stmt.exprs.push_back(parseExpr());
+            expect(",");
+            stmt.exprs.push_back(parseExpr());
+            if (accept(",")) stmt.exprs.push_back(parseExpr());
+            expect("do");
+            scopes.emplace_back();
+            stmt.slots.push_back(declare(first));
+        } else {
+            stmt.kind = Stmt::GenericFor;
+            std::vector<std::string> names{first};
+            while (accept(",")) names.push_back(expectName());
+            expect("in");
+            int line = current.line;
+            ExprPtr source = parseExpr();
+            // Without user functions there is no iterator protocol; ipairs and pairs are built in.
+            bool ok = source->kind == Expr::Call && source->children.size() == 2 && source->children[0]->kind == Expr::Global;
+            std::string iterator = ok ? global_names[source->children[0]->slot] : "";
+            if (iterator != "ipairs" && iterator != "pairs") syntaxError(line, "generic for only supports ipairs(t) and pairs(t)");
+            stmt.all_pairs = iterator == "pairs";
+            stmt.exprs.push_back(std::move(source->children[1]));
+            expect("do");
+            scopes.emplace_back();
+            for (const auto& name : names) stmt.slots.push_back(declare(name));
+        }
+        stmt.blocks.push_back(parseStatements());
+        scopes.pop_back();
+        expect("end");
+    }
+
+    // Binary operator priorities (left, right) as in Lua; right-associative ones bind
+    // tighter on the right.
+    static bool binaryOp(const Token& token, Expr::Kind& kind, Expr::Op& op, int& left, int& right) {
+        static const struct {
+            const char* text;
+            Expr::Kind kind;
+            Expr::Op op;
+            int left, right;
+        } ops[] = {
+            {"or", Expr::Or, Expr::Add, 1, 1},       {"and", Expr::And, Expr::Add, 2, 2},
+            {"<", Expr::Binary, Expr::Lt, 3, 3},     {">", Expr::Binary, Expr::Gt, 3, 3},
+            {"<=", Expr::Binary, Expr::Le, 3, 3},    {">=", Expr::Binary, Expr::Ge, 3, 3},
+            {"~=", Expr::Binary, Expr::Ne, 3, 3},    {"==", Expr::Binary, Expr::Eq, 3, 3},
+            {"..", Expr::Binary, Expr::Concat, 5, 4}, {"+", Expr::Binary, Expr::Add, 6, 6},
+            {"-", Expr::Binary, Expr::Sub, 6, 6},    {"*", Expr::Binary, Expr::Mul, 7, 7},
+            {"/", Expr::Binary, Expr::Div, 7, 7},    {"%", Expr::Binary, Expr::Mod, 7, 7},
+            {"^", Expr::Binary, Expr::Pow, 10, 9},
+        };
+        if (token.kind != Token::Symbol && token.kind != Token::Name) return false;
+        for (const auto& entry : ops) {
+            if (token.text == entry.text) {
+                kind = entry.kind;
+                op = entry.op;
+                left = entry.left;
+                right = entry.right;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static constexpr int UNARY_PRIORITY = 8;
+
+    ExprPtr parseExpr(int limit = 0) {
+        ExprPtr left;
+        int line = current.line;
+        if (check("not") || check("-") || check("#")) {
+            Expr::Op op = check("not") ? Expr::Not : check("-") ? Expr::Neg : Expr::Len;
+            advance();
+            left = makeExpr(Expr::Unary, line);
+            left->op = op;
+            left->children.push_back(parseExpr(UNARY_PRIORITY));
+        } else {
+            left = parseSimple();
+        }
+
+        Expr::Kind kind;
+        Expr::Op op;
+        int lp, rp;
+        while (binaryOp(current, kind, op, lp, rp) && lp > limit) {
+            line = current.line;
+            advance();
+            auto expr = makeExpr(kind, line);
+            expr->op = op;
+            expr->children.push_back(std::move(left));
+            expr->children.push_back(parseExpr(rp));
+            left = std::move(expr);
+        }
+        return left;
+    }
+
+    ExprPtr parseSimple() {
+        int line = current.line;
+        if (current.kind == Token::Number) {
+            auto expr = makeExpr(Expr::Number, line);
+            expr->number = current.number;
+            advance();
+            return expr;
+        }
+        if (current.kind == Token::String) {
+            auto expr = makeExpr(Expr::String, line);
+            expr->text = std::move(current.text);
+            advance();
+            return expr;
+        }
+        if (accept("nil")) return makeExpr(Expr::Nil, line);
+        if (accept("true")) return makeExpr(Expr::True, line);
+        if (accept("false")) return makeExpr(Expr::False, line);
+        if (check("{")) return parseTable();
+        if (check("function")) syntaxError(line, "function definitions are not supported");
+        return parseSuffixed();
+    }
+
+    ExprPtr parsePrimary() {
+        int line = current.line;
+        if (accept("(")) {
+            ExprPtr expr = parseExpr();
+            expect(")");
+            return expr;
+        }
+        if (current.kind != Token::Name || isKeyword(current.text)) syntaxError(line, "unexpected symbol near '" + describe(current) + "'");
+        return resolve(expectName(), line);
+    }
+
+    ExprPtr parseSuffixed() {
+        ExprPtr expr = parsePrimary();
+        while (true) {
+            int line = current.line;
+            if (accept(".")) {
+                auto index = makeExpr(Expr::Index, line);
+                auto key = makeExpr(Expr::String, line);
+                key->text = expectName();
+                index->children.push_back(std::move(expr));
+                index->children.push_back(std::move(key));
+                expr = std::move(index);
+            } else if (accept("[")) {
+                auto index = makeExpr(Expr::Index, line);
+                index->children.push_back(std::move(expr));
+                index->children.push_back(parseExpr());
+                expect("]");
+                expr = std::move(index);
+            } else if (check("(") || check("{") || current.kind == Token::String) {
+                auto call = makeExpr(Expr::Call, line);
+                call->children.push_back(std::move(expr));
+                if (accept("(")) {
+                    if (!check(")")) {
+                        for (auto& arg : parseExprList()) call->children.push_back(std::move(arg));
+                    }
+                    expect(")");
+                } else {
+                    call->children.push_back(parseSimple());
+                }
+                expr = std::move(call);
+            } else if (check(":")) {
+                syntaxError(line, "method calls are not supported");
+            } else {
+                return expr;
+            }
+        }
+    }
+
+    ExprPtr parseTable() {
+        auto table = makeExpr(Expr::Table, current.line);
+        expect("{");
+        while (!check("}")) {
+            if (accept("[")) {
+                table->keys.push_back(parseExpr());
+                expect("]");
+                expect("=");
+            } else if (current.kind == Token::Name && !isKeyword(current.text) && lookahead.kind == Token::Symbol && lookahead.text == "=") {
+                auto key = makeExpr(Expr::String, current.line);
+                key->text = expectName();
+                expect("=");
+                table->keys.push_back(std::move(key));
+            } else {
+                table->keys.push_back(nullptr);
+            }
+            table->children.push_back(parseExpr());
+            if (!accept(",") && !accept(";")) break;
+        }
+        expect("}");
+        return table;
+    }
+};
+
+}
+
+std::string ScriptValue::formatNumber(double value) {
+    if (std::isinf(value)) return value > 0 ? "inf" : "-inf";
+    if (std::isnan(value)) return "nan";
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.14g", value);
+    return buf;
+}
+
+namespace {
+
+bool parseNumber(const std::string& text, double& out) {
+    const char* begin = text.c_str();
+    char* end = nullptr;
+    out = std::strtod(begin, &end);
+    if (end == begin) return false;
+    while (*end && std::isspace(static_cast<unsigned char>(*end))) end++;
+    return *end == '\0';
+}
+
+}
+
+Script::Script(const std::string& source) {
+    Compiler compiler(source, global_names, slot_count);
+    body = compiler.compileChunk();
+}
+
+Script::~Script() = default;
+
+class ScriptRunner {
+public:
+    ScriptRunner(const Script& script, std::vector<const ScriptValue*> globals, int64_t budget_ms, const bool& has_written)
+        : script(script), locals(script.slot_count), globals(std::move(globals)), budget_ms(budget_ms), has_written(has_written),
+          deadline(std::chrono::steady_clock::now() + std::chrono::milliseconds(budget_ms)) {}
+
+    ScriptValue run() {
+        exec(script.body);
+        return std::move(result);
+    }
+
+private:
+    enum class Flow { Normal, Break, Return };
+
+    const Script& script;
+    std::vector<ScriptValue> locals;
+    std::vector<const ScriptValue*> globals;
+    int64_t budget_ms;
+    const bool& has_written;
+    std::chrono::steady_clock::time_point deadline;
+    uint32_t steps = 0;
+    ScriptValue result;
+
+    [[noreturn]] static void fail(int line, const std::string& message) {
+        throw ScriptError("ERR user_script:" + std::to_string(line) + ": " + message);
+    }
+
+    // The clock is only read every few thousand steps.
+    void tick() {
+        if ((++steps & 4095) != 0) return;
+        if (!has_written && std::chrono::steady_clock::now() > deadline) {
+            throw ScriptError("ERR script exceeded its time budget of " + std::to_string(budget_ms) + " ms");
+        }
+    }
+
+    double toNumber(const ScriptValue& value, int line, const char* what) {
+        if (value.type == ScriptValue::Type::Number) return value.number;
+        double number;
+        if (value.type == ScriptValue::Type::String && parseNumber(value.string, number)) return number;
+        fail(line, std::string("attempt to ") + what + " a " + value.typeName() + " value");
+    }
+
+    std::string toConcatString(const ScriptValue& value, int line) {
+        if (value.type == ScriptValue::Type::String) return value.string;
+        if (value.type == ScriptValue::Type::Number) return ScriptValue::formatNumber(value.number);
+        fail(line, std::string("attempt to concatenate a ") + value.typeName() + " value");
+    }
+
+    static bool equals(const ScriptValue& a, const ScriptValue& b) {
+        if (a.type != b.type) return false;
+        switch (a.type) {
+            case ScriptValue::Type::Nil: return true;
+            case ScriptValue::Type::Boolean: return a.boolean == b.boolean;
+            case ScriptValue::Type::Number: return a.number == b.number;
+            case ScriptValue::Type::String: return a.string == b.string;
+            case ScriptValue::Type::Table: return a.table == b.table;
+            case ScriptValue::Type::Function: return a.function == b.function;
+        }
+        return false;
+    }
+
+    bool lessThan(const ScriptValue& a, const ScriptValue& b, bool or_equal, int line) {
+        if (a.type == ScriptValue::Type::Number && b.type == ScriptValue::Type::Number) {
+            return or_equal ? a.number <= b.number : a.number < b.number;
+        }
+        if (a.type == ScriptValue::Type::String && b.type == ScriptValue::Type::String) {
+            return or_equal ? a.string <= b.string : a.string < b.string;
+        }
+        fail(line, std::string("attempt to compare ") + a.typeName() + " with " + b.typeName());
+    }
+
+    ScriptValue binary(const Script::Expr& expr) {
+        ScriptValue a = eval(*expr.children[0]);
+        ScriptValue b = eval(*expr.children[1]);
+        switch (expr.op) {
+            case Script::Expr::Eq: return ScriptValue::fromBool(equals(a, b));
+            case Script::Expr::Ne: return ScriptValue::fromBool(!equals(a, b));
+            case Script::Expr::Lt: return ScriptValue::fromBool(lessThan(a, b, false, expr.line));
+            case Script::Expr::Le: return ScriptValue::fromBool(lessThan(a, b, true, expr.line));
+            case Script::Expr::Gt: return ScriptValue::fromBool(lessThan(b, a, false, expr.line));
+            case Script::Expr::Ge: return ScriptValue::fromBool(lessThan(b, a, true, expr.line));
+            case Script::Expr::Concat: return ScriptValue::fromString(toConcatString(a, expr.line) + toConcatString(b, expr.line));
+            default: break;
+        }
+        double x = toNumber(a, expr.line, "perform arithmetic on");
+        double y = toNumber(b, expr.line, "perform arithmetic on");
+        switch (expr.op) {
+            case Script::Expr::Add: return ScriptValue::fromNumber(x + y);
+            case Script::Expr::Sub: return ScriptValue::fromNumber(x - y);
+            case Script::Expr::Mul: return ScriptValue::fromNumber(x * y);
+            case Script::Expr::Div: return ScriptValue::fromNumber(x / y);
+            case Script::Expr::Mod: return ScriptValue::fromNumber(x - std::floor(x / y) * y);
+            case Script::Expr::Pow: return ScriptValue::fromNumber(std::pow(x, y));
+            default: fail(expr.line, "invalid operator");
+        }
+    }
+
+    ScriptValue index(const ScriptValue& object, const ScriptValue& key, int line) {
+        if (object.type != ScriptValue::Type::Table) fail(line, std::string("attempt to index a ") + object.typeName() + " value");
+        return object.table->get(key);
+    }
+
+    ScriptValue eval(const Script::Expr& expr) {
+        using Expr = Script::Expr;
+        switch (expr.kind) {
+            case Expr::Nil: return ScriptValue();
+            case Expr::True: return ScriptValue::fromBool(true);
+            case Expr::False: return ScriptValue::fromBool(false);
+            case Expr::Number: return ScriptValue::fromNumber(expr.number);
+            case Expr::String: return ScriptValue::fromString(expr.text);
+            case Expr::Local: return locals[expr.slot];
+            case Expr::Global:
+                if (!globals[expr.slot]) {
+                    fail(expr.line, "Script attempted to access nonexistent global variable '" + script.global_names[expr.slot] + "'");
+                }
+                return *globals[expr.slot];
+            case Expr::Index: {
+                ScriptValue object = eval(*expr.children[0]);
+                return index(object, eval(*expr.children[1]), expr.line);
+            }
+            case Expr::Call: {
+                ScriptValue callee = eval(*expr.children[0]);
+                if (callee.type != ScriptValue::Type::Function) fail(expr.line, std::string("attempt to call a ") + callee.typeName() + " value");
+                std::vector<ScriptValue> args;
+                args.reserve(expr.children.size() - 1);
+                for (size_t i = 1; i < expr.children.size(); ++i) args.push_back(eval(*expr.children[i]));
+                try {
+                    return (*callee.function)(args);
+                } catch (const std::invalid_argument& e) {
+                    // Built-ins report bad arguments without knowing the line.
+                    fail(expr.line, e.what());
+                }
+            }
+            case Expr::Table: {
+                auto table = std::make_shared<ScriptTable>();
+                double position = 1;
+                for (size_t i = 0; i < expr.children.size(); ++i) {
+                    ScriptValue value = eval(*expr.children[i]);
+                    if (expr.keys[i]) table->set(eval(*expr.keys[i]), std::move(value));
+                    else table->set(ScriptValue::fromNumber(position++), std::move(value));
+                }
+                return ScriptValue::fromTable(std::move(table));
+            }
+            case Expr::Binary: return binary(expr);
+            case Expr::Unary: {
+                ScriptValue operand = eval(*expr.children[0]);
+                if (expr.op == Expr::Not) return ScriptValue::fromBool(!operand.truthy());
+                if (expr.op == Expr::Neg) return ScriptValue::fromNumber(-toNumber(operand, expr.line, "perform arithmetic on"));
+                if (operand.type == ScriptValue::Type::String) return ScriptValue::fromNumber(double(operand.string.size()));
+                if (operand.type == ScriptValue::Type::Table) return ScriptValue::fromNumber(double(operand.table->array.size()));
+                fail(expr.line, std::string("attempt to get length of a ") + operand.typeName() + " value");
+            }
+            case Expr::And: {
+                ScriptValue left = eval(*expr.children[0]);
+                return left.truthy() ? eval(*expr.children[1]) : left;
+            }
+            case Expr::Or: {
+                ScriptValue left = eval(*expr.children[0]);
+                return left.truthy() ? left : eval(*expr.children[1]);
+            }
+        }
+        return ScriptValue();
+    }
+
+    // Evaluates a list of expressions into exactly count values, padding with nil.
+    std::vector<ScriptValue> evalList(const std::vector<std::unique_ptr<Script::Expr>>& exprs, size_t count) {
+        std::vector<ScriptValue> values;
+        values.reserve(std::max(count, exprs.size()));
+        for (const auto& expr : exprs) values.push_back(eval(*expr));
+        values.resize(count);
+        return values;
+    }
+
+    void assign(const Script::Expr& target, ScriptValue value) {
+        if (target.kind == Script::Expr::Local) {
+            locals[target.slot] = std::move(value);
+        } else if (target.kind == Script::Expr::Global) {
+            fail(target.line, "Script attempted to create global variable '" + script.global_names[target.slot] + "'");
+        } else {
+            ScriptValue object = eval(*target.children[0]);
+            ScriptValue key = eval(*target.children[1]);
+            if (object.type != ScriptValue::Type::Table) fail(target.line, std::string("attempt to index a ") + object.typeName() + " value");
+            try {
+                object.table->set(key, std::move(value));
+            } catch (const ScriptError& e) {
+                // Table errors carry the "ERR " code; report them at this line.
+                fail(target.line, std::string(e.what()).substr(4));
+            }
+        }
+    }
+
+    Flow exec(const Script::Block& block) {
+        for (const auto& stmt : block) {
+            Flow flow = exec(*stmt);
+            if (flow != Flow::Normal) return flow;
+        }
+        return Flow::Normal;
+    }
+
+    Flow loopBody(const Script::Stmt& stmt, bool& stop) {
+        tick();
+        Flow flow = exec(stmt.blocks[0]);
+        stop = flow != Flow::Normal;
+        return flow == Flow::Break ? Flow::Normal : flow;
+    }
+
+    Flow exec(const Script::Stmt& stmt) {
+        using Stmt = Script::Stmt;
+        tick();
+        switch (stmt.kind) {
+            case Stmt::Local: {
+                auto values = evalList(stmt.exprs, stmt.slots.size());
+                for (size_t i = 0; i < stmt.slots.size(); ++i) locals[stmt.slots[i]] = std::move(values[i]);
+                return Flow::Normal;
+            }
+            case Stmt::Assign: {
+                auto values = evalList(stmt.exprs, stmt.targets.size());
+                for (size_t i = 0; i < stmt.targets.size(); ++i) assign(*stmt.targets[i], std::move(values[i]));
+                return Flow::Normal;
+            }
+            case Stmt::Call:
+                eval(*stmt.exprs[0]);
+                return Flow::Normal;
+            case Stmt::If:
+                for (size_t i = 0; i < stmt.exprs.size(); ++i) {
+                    if (eval(*stmt.exprs[i]).truthy()) return exec(stmt.blocks[i]);
+                }
+                if (stmt.blocks.size() > stmt.exprs.size()) return exec(stmt.blocks.back());
+                return Flow::Normal;
+            case Stmt::While: {
+                bool stop = false;
+                Flow flow = Flow::Normal;
+                while (!stop && eval(*stmt.exprs[0]).truthy()) flow = loopBody(stmt, stop);
+                return flow;
+            }
+            case Stmt::Repeat: {
+                bool stop = false;
+                Flow flow = Flow::Normal;
+                do {
+                    flow = loopBody(stmt, stop);
+                } while (!stop && !eval(*stmt.exprs[0]).truthy());
+                return flow;
+            }
+            case Stmt::NumericFor: {
+                double start = toNumber(eval(*stmt.exprs[0]), stmt.line, "use as 'for' initial value");
+                double limit = toNumber(eval(*stmt.exprs[1]), stmt.line, "use as 'for' limit");
+                double step = stmt.exprs.size() > 2 ? toNumber(eval(*stmt.exprs[2]), stmt.line, "use as 'for' step") : 1;
+                if (step == 0) fail(stmt.line, "'for' step is zero");
+                bool stop = false;
+                Flow flow = Flow::Normal;
+                for (double i = start; !stop && (step > 0 ? i <= limit : i >= limit); i += step) {
+                    locals[stmt.slots[0]] = ScriptValue::fromNumber(i);
+                    flow = loopBody(stmt, stop);
+                }
+                return flow;
+            }
+            case Stmt::GenericFor: return genericFor(stmt);
+            case Stmt::Do: return exec(stmt.blocks[0]);
+            case Stmt::Break: return Flow::Break;
+            case Stmt::Return:
+                result = stmt.exprs.empty() ? ScriptValue() : eval(*stmt.exprs[0]);
+                return Flow::Return;
+        }
+        return Flow::Normal;
+    }
+
+    Flow genericFor(const Script::Stmt& stmt) {
+        ScriptValue source = eval(*stmt.exprs[0]);
+        if (source.type != ScriptValue::Type::Table) {
+            fail(stmt.line, std::string("bad argument #1 to '") + (stmt.all_pairs ? "pairs" : "ipairs") + "' (table expected, got " + source.typeName() + ")");
+        }
+        const ScriptTable& table = *source.table;
+        bool stop = false;
+        Flow flow = Flow::Normal;
+        auto visit = [&](ScriptValue key, ScriptValue value) {
+            locals[stmt.slots[0]] = std::move(key);
+            if (stmt.slots.size() > 1) locals[stmt.slots[1]] = std::move(value);
+            for (size_t i = 2; i < stmt.slots.size(); ++i) locals[stmt.slots[i]] = ScriptValue();
+            flow = loopBody(stmt, stop);
+        };
+
+        if (!stmt.all_pairs) {
+            for (double i = 1; !stop; ++i) {
+                ScriptValue value = table.get(ScriptValue::fromNumber(i));
+                if (value.type == ScriptValue::Type::Nil) break;
+                visit(ScriptValue::fromNumber(i), std::move(value));
+            }
+            return flow;
+        }
+
+        // The body may modify the table, so iterate over a snapshot of its entries.
+        std::vector<std::pair<ScriptValue, ScriptValue>> entries;
+        for (size_t i = 0; i < table.array.size(); ++i) entries.emplace_back(ScriptValue::fromNumber(double(i + 1)), table.array[i]);
+        for (const auto& [key, value] : table.numbers) entries.emplace_back(ScriptValue::fromNumber(key), value);
+        for (const auto& [key, value] : table.fields) entries.emplace_back(ScriptValue::fromString(key), value);
+        for (auto& [key, value] : entries) {
+            if (stop) break;
+            if (value.type != ScriptValue::Type::Nil) visit(std::move(key), std::move(value));
+        }
+        return flow;
+    }
+};
+
+namespace {
+
+ScriptValue arg(std::vector<ScriptValue>& args, size_t i) {
+    return i < args.size() ? args[i] : ScriptValue();
+}
+
+double numberArg(std::vector<ScriptValue>& args, size_t i, const char* name) {
+    ScriptValue value = arg(args, i);
+    double number;
+    if (value.type == ScriptValue::Type::Number) return value.number;
+    if (value.type == ScriptValue::Type::String && parseNumber(value.string, number)) return number;
+    throw std::invalid_argument(std::string("bad argument #") + std::to_string(i + 1) + " to '" + name + "' (number expected, got " + value.typeName() + ")");
+}
+
+std::string stringArg(std::vector<ScriptValue>& args, size_t i, const char* name) {
+    ScriptValue value = arg(args, i);
+    if (value.type == ScriptValue::Type::String) return value.string;
+    if (value.type == ScriptValue::Type::Number) return ScriptValue::formatNumber(value.number);
+    throw std::invalid_argument(std::string("bad argument #") + std::to_string(i + 1) + " to '" + name + "' (string expected, got " + value.typeName() + ")");
+}
+
+ScriptTable& tableArg(std::vector<ScriptValue>& args, size_t i, const char* name) {
+    if (i >= args.size() || args[i].type != ScriptValue::Type::Table) {
+        throw std::invalid_argument(std::string("bad argument #") + std::to_string(i + 1) + " to '" + name + "' (table expected, got " + arg(args, i).typeName() + ")");
+    }
+    return *args[i].table;
+}
+
+// Lua string positions are 1-based, and negative ones count from the end.
+double stringPosition(double position, size_t length) {
+    return position < 0 ? double(length) + position + 1 : position;
+}
+
+std::shared_ptr<ScriptTable> library(std::vector<std::pair<std::string, ScriptValue::Function>> functions) {
+    auto table = std::make_shared<ScriptTable>();
+    for (auto& [name, function] : functions) table->fields[name] = ScriptValue::fromFunction(std::move(function));
+    table->readonly = true;
+    return table;
+}
+
+const std::unordered_map<std::string, ScriptValue>& standardLibrary() {
+    using Args = std::vector<ScriptValue>;
+    static const std::unordered_map<std::string, ScriptValue> globals = [] {
+        std::unordered_map<std::string, ScriptValue> g;
+        g["tonumber"] = ScriptValue::fromFunction([](Args& args) {
+            ScriptValue value = arg(args, 0);
+            double number;
+            if (value.type == ScriptValue::Type::Number) return value;
+            if (value.type == ScriptValue::Type::String && parseNumber(value.string, number)) return ScriptValue::fromNumber(number);
+            return ScriptValue();
+        });
+        g["tostring"] = ScriptValue::fromFunction([](Args& args) {
+            ScriptValue value = arg(args, 0);
+            switch (value.type) {
+                case ScriptValue::Type::Nil: return ScriptValue::fromString("nil");
+                case ScriptValue::Type::Boolean: return ScriptValue::fromString(value.boolean ? "true" : "false");
+                case ScriptValue::Type::Number: return ScriptValue::fromString(ScriptValue::formatNumber(value.number));
+                case ScriptValue::Type::String: return value;
+                default: {
+                    char buf[48];
+                    const void* address = value.table ? static_cast<const void*>(value.table.get()) : static_cast<const void*>(value.function.get());
+                    std::snprintf(buf, sizeof(buf), "%s: %p", value.typeName(), address);
+                    return ScriptValue::fromString(buf);
+                }
+            }
+        });
+        g["type"] = ScriptValue::fromFunction([](Args& args) { return ScriptValue::fromString(arg(args, 0).typeName()); });
+        g["error"] = ScriptValue::fromFunction([](Args& args) -> ScriptValue {
+            ScriptValue value = arg(args, 0);
+            if (value.type == ScriptValue::Type::Table) {
+                ScriptValue err = value.table->get(ScriptValue::fromString("err"));
+                if (err.type == ScriptValue::Type::String) throw ScriptError(err.string);
+            }
+            throw ScriptError("ERR " + (value.type == ScriptValue::Type::String ? value.string : std::string(value.typeName())));
+        });
+        // Reaching these means they were used outside a generic for.
+        for (const char* name : {"ipairs", "pairs"}) {
+            g[name] = ScriptValue::fromFunction([name](Args&) -> ScriptValue {
+                throw std::invalid_argument(std::string("'") + name + "' is only supported in a generic for");
+            });
+        }
+
+        g["string"] = ScriptValue::fromTable(library({
+            {"len", [](Args& args) { return ScriptValue::fromNumber(double(stringArg(args, 0, "len").size())); }},
+            {"sub", [](Args& args) {
+                std::string s = stringArg(args, 0, "sub");
+                double from = std::max(1.0, stringPosition(numberArg(args, 1, "sub"), s.size()));
+                double to = args.size() > 2 ? stringPosition(numberArg(args, 2, "sub"), s.size()) : -1;
+                to = std::min(double(s.size()), to < 0 && args.size() <= 2 ? double(s.size()) : to);
+                if (from > to) return ScriptValue::fromString("");
+                return ScriptValue::fromString(s.substr(size_t(from) - 1, size_t(to) - size_t(from) + 1));
+            }},
+            {"upper", [](Args& args) {
+                std::string s = stringArg(args, 0, "upper");
+                for (char& c : s) c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+                return ScriptValue::fromString(std::move(s));
+            }},
+            {"lower", [](Args& args) {
+                std::string s = stringArg(args, 0, "lower");
+                for (char& c : s) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+                return ScriptValue::fromString(std::move(s));
+            }},
+            {"rep", [](Args& args) {
+                std::string s = stringArg(args, 0, "rep");
+                double n = numberArg(args, 1, "rep");
+                std::string out;
+                for (double i = 0; i < n; ++i) out += s;
+                return ScriptValue::fromString(std::move(out));
+            }},
+        }));
+        g["table"] = ScriptValue::fromTable(library({
+            {"insert", [](Args& args) {
+                ScriptTable& table = tableArg(args, 0, "insert");
+                if (args.size() < 3) {
+                    table.set(ScriptValue::fromNumber(double(table.array.size() + 1)), arg(args, 1));
+                } else {
+                    size_t position = static_cast<size_t>(numberArg(args, 1, "insert"));
+                    if (position < 1 || position > table.array.size() + 1) throw std::invalid_argument("bad argument #2 to 'insert' (position out of bounds)");
+                    if (table.readonly) throw ScriptError("ERR Attempt to modify a readonly table");
+                    if (args[2].type != ScriptValue::Type::Nil) table.array.insert(table.array.begin() + (position - 1), args[2]);
+                }
+                return ScriptValue();
+            }},
+            {"remove", [](Args& args) {
+                ScriptTable& table = tableArg(args, 0, "remove");
+                if (table.array.empty()) return ScriptValue();
+                size_t position = args.size() > 1 ? static_cast<size_t>(numberArg(args, 1, "remove")) : table.array.size();
+                if (position < 1 || position > table.array.size()) return ScriptValue();
+                if (table.readonly) throw ScriptError("ERR Attempt to modify a readonly table");
+                ScriptValue removed = std::move(table.array[position - 1]);
+                table.array.erase(table.array.begin() + (position - 1));
+                return removed;
+            }},
+            {"concat", [](Args& args) {
+                ScriptTable& table = tableArg(args, 0, "concat");
+                std::string separator = args.size() > 1 ? stringArg(args, 1, "concat") : "";
+                std::string out;
+                for (size_t i = 0; i < table.array.size(); ++i) {
+                    std::vector<ScriptValue> item{table.array[i]};
+                    if (i) out += separator;
+                    out += stringArg(item, 0, "concat");
+                }
+                return ScriptValue::fromString(std::move(out));
+            }},
+        }));
+        g["math"] = ScriptValue::fromTable(library({
+            {"floor", [](Args& args) { return ScriptValue::fromNumber(std::floor(numberArg(args, 0, "floor"))); }},
+            {"ceil", [](Args& args) { return ScriptValue::fromNumber(std::ceil(numberArg(args, 0, "ceil"))); }},
+            {"abs", [](Args& args) { return ScriptValue::fromNumber(std::fabs(numberArg(args, 0, "abs"))); }},
+            {"sqrt", [](Args& args) { return ScriptValue::fromNumber(std::sqrt(numberArg(args, 0, "sqrt"))); }},
+            {"min", [](Args& args) {
+                double result = numberArg(args, 0, "min");
+                for (size_t i = 1; i < args.size(); ++i) result = std::min(result, numberArg(args, i, "min"));
+                return ScriptValue::fromNumber(result);
+            }},
+            {"max", [](Args& args) {
+                double result = numberArg(args, 0, "max");
+                for (size_t i = 1; i < args.size(); ++i) result = std::max(result, numberArg(args, i, "max"));
+                return ScriptValue::fromNumber(result);
+            }},
+        }));
+        g["math"].table->fields["huge"] = ScriptValue::fromNumber(HUGE_VAL);
+        return g;
+    }();
+    return globals;
+}
+
+}
+
+ScriptValue Script::run(const std::unordered_map<std::string, ScriptValue>& globals, int64_t budget_ms, const bool& has_written) const {
+    const auto& library = standardLibrary();
+    std::vector<const ScriptValue*> resolved(global_names.size(), nullptr);
+    for (size_t i = 0; i < global_names.size(); ++i) {
+        auto it = globals.find(global_names[i]);
+        if (it != globals.end()) {
+            resolved[i] = &it->second;
+            continue;
+        }
+        auto lib = library.find(global_names[i]);
+        if (lib != library.end()) resolved[i] = &lib->second;
+    }
+    return ScriptRunner(*this, std::move(resolved), budget_ms, has_written).run();
+}
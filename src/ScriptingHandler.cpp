@@ -0,0 +1,276 @@
+#include "ScriptingHandler.hpp"
+#include "ClientOutput.hpp"
+#include "Sha1.hpp"
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <iostream>
+
+std::unordered_map<std::string, std::shared_ptr<const Script>> ScriptingHandler::script_cache;
+std::mutex ScriptingHandler::cache_mutex;
+std::atomic<int64_t> ScriptingHandler::time_limit_ms{5000};
+
+static std::string upper(std::string text) {
+    for (char& c : text) c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+    return text;
+}
+
+static std::string lower(std::string text) {
+    for (char& c : text) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    return text;
+}
+
+static ScriptValue tableWith(const char* field, std::string text) {
+    auto table = std::make_shared<ScriptTable>();
+    table->fields[field] = ScriptValue::fromString(std::move(text));
+    return ScriptValue::fromTable(std::move(table));
+}
+
+// Converts a captured RESP reply into the value redis.call() returns: status and error
+// replies become {ok=...} and {err=...} tables, nil replies become false.
+static ScriptValue fromReply(std::string_view& in) {
+    size_t eol = in.find("\r\n");
+    if (in.empty() || eol == std::string_view::npos) return ScriptValue::fromBool(false);
+    char type = in[0];
+    std::string_view line = in.substr(1, eol - 1);
+    in.remove_prefix(eol + 2);
+
+    int64_t n = 0;
+    if (type == ':' || type == '$' || type == '*') std::from_chars(line.data(), line.data() + line.size(), n);
+    switch (type) {
+        case '+': return tableWith("ok", std::string(line));
+        case '-': return tableWith("err", std::string(line));
+        case ':': return ScriptValue::fromNumber(double(n));
+        case '$': {
+            if (n < 0 || static_cast<size_t>(n) + 2 > in.size()) return ScriptValue::fromBool(false);
+            ScriptValue value = ScriptValue::fromString(std::string(in.substr(0, n)));
+            in.remove_prefix(n + 2);
+            return value;
+        }
+        case '*': {
+            if (n < 0) return ScriptValue::fromBool(false);
+            auto table = std::make_shared<ScriptTable>();
+            table->array.reserve(n);
+            for (int64_t i = 0; i < n; ++i) table->array.push_back(fromReply(in));
+            return ScriptValue::fromTable(std::move(table));
+        }
+    }
+    return ScriptValue::fromBool(false);
+}
+
+static std::string singleLine(std::string text) {
+    for (char& c : text) {
+        if (c == '\r' || c == '\n') c = ' ';
+    }
+    return text;
+}
+
+// Converts a script's return value into a reply, as Redis converts Lua values.
+static void appendReply(std::string& out, const ScriptValue& value) {
+    switch (value.type) {
+        case ScriptValue::Type::Number:
+            out += ":" + std::to_string(static_cast<int64_t>(value.number)) + "\r\n";
+            return;
+        case ScriptValue::Type::String:
+            out += "$" + std::to_string(value.string.size()) + "\r\n";
+            out += value.string;
+            out += "\r\n";
+            return;
+        case ScriptValue::Type::Boolean:
+            out += value.boolean ? ":1\r\n" : "$-1\r\n";
+            return;
+        case ScriptValue::Type::Table: {
+            const ScriptTable& table = *value.table;
+            ScriptValue err = table.get(ScriptValue::fromString("err"));
+            if (err.type == ScriptValue::Type::String) {
+                out += "-" + singleLine(err.string) + "\r\n";
+                return;
+            }
+            ScriptValue ok = table.get(ScriptValue::fromString("ok"));
+            if (ok.type == ScriptValue::Type::String) {
+                out += "+" + singleLine(ok.string) + "\r\n";
+                return;
+            }
+            // Arrays end at the first nil.
+            size_t count = 0;
+            while (count < table.array.size() && table.array[count].type != ScriptValue::Type::Nil) count++;
+            out += "*" + std::to_string(count) + "\r\n";
+            for (size_t i = 0; i < count; ++i) appendReply(out, table.array[i]);
+            return;
+        }
+        default:
+            out += "$-1\r\n";
+    }
+}
+
+ScriptingHandler::ScriptingHandler(int client_fd, Dispatch dispatch)
+    : client_fd(client_fd), dispatch(std::move(dispatch)) {
+    using Args = std::vector<ScriptValue>;
+    auto lib = std::make_shared<ScriptTable>();
+    lib->fields["call"] = ScriptValue::fromFunction([this](Args& args) { return call(args, true); });
+    lib->fields["pcall"] = ScriptValue::fromFunction([this](Args& args) { return call(args, false); });
+    lib->fields["error_reply"] = ScriptValue::fromFunction([](Args& args) {
+        std::string text = !args.empty() && args[0].type == ScriptValue::Type::String ? args[0].string : "ERR";
+        return tableWith("err", text);
+    });
+    lib->fields["status_reply"] = ScriptValue::fromFunction([](Args& args) {
+        std::string text = !args.empty() && args[0].type == ScriptValue::Type::String ? args[0].string : "";
+        return tableWith("ok", text);
+    });
+    lib->fields["sha1hex"] = ScriptValue::fromFunction([](Args& args) {
+        if (args.empty() || args[0].type != ScriptValue::Type::String) throw std::invalid_argument("wrong number or type of arguments to 'sha1hex'");
+        return ScriptValue::fromString(sha1Hex(args[0].string));
+    });
+    lib->fields["log"] = ScriptValue::fromFunction([](Args&) { return ScriptValue(); });
+    lib->readonly = true;
+    redis_lib = ScriptValue::fromTable(std::move(lib));
+}
+
+bool ScriptingHandler::isScriptCommand(const std::string& cmd) {
+    return cmd == "EVAL" || cmd == "EVALSHA" || cmd == "SCRIPT";
+}
+
+void ScriptingHandler::handleCommand(const std::string& cmd, const std::vector<std::string>& args) {
+    if (cmd == "EVAL") handleEval(args, false);
+    else if (cmd == "EVALSHA") handleEval(args, true);
+    else if (cmd == "SCRIPT") handleScript(args);
+    else sendResponse("-ERR Unsupported scripting command\r\n");
+}
+
+void ScriptingHandler::handleEval(const std::vector<std::string>& args, bool by_sha) {
+    if (args.size() < 2) {
+        sendResponse(by_sha ? "-ERR wrong number of arguments for 'evalsha' command\r\n" : "-ERR wrong number of arguments for 'eval' command\r\n");
+        return;
+    }
+
+    int64_t numkeys = 0;
+    const std::string& text = args[1];
+    auto parsed = std::from_chars(text.data(), text.data() + text.size(), numkeys);
+    if (parsed.ec != std::errc{} || parsed.ptr != text.data() + text.size()) {
+        sendResponse("-ERR value is not an integer or out of range\r\n");
+        return;
+    }
+    if (numkeys < 0) {
+        sendResponse("-ERR Number of keys can't be negative\r\n");
+        return;
+    }
+    if (static_cast<uint64_t>(numkeys) > args.size() - 2) {
+        sendResponse("-ERR Number of keys can't be greater than number of args\r\n");
+        return;
+    }
+
+    std::shared_ptr<const Script> script;
+    std::string sha = by_sha ? lower(args[0]) : sha1Hex(args[0]);
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        auto it = script_cache.find(sha);
+        if (it != script_cache.end()) script = it->second;
+    }
+    if (!script) {
+        if (by_sha) {
+            sendResponse("-NOSCRIPT No matching script. Please use EVAL.\r\n");
+            return;
+        }
+        try {
+            script = std::make_shared<const Script>(args[0]);
+        } catch (const ScriptError& e) {
+            sendResponse("-" + singleLine(e.what()) + "\r\n");
+            return;
+        }
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        script = script_cache.emplace(sha, script).first->second;
+    }
+
+    runScript(*script, args, static_cast<size_t>(numkeys));
+}
+
+void ScriptingHandler::runScript(const Script& script, const std::vector<std::string>& args, size_t numkeys) {
+    auto keys = std::make_shared<ScriptTable>();
+    auto argv = std::make_shared<ScriptTable>();
+    for (size_t i = 0; i < numkeys; ++i) keys->array.push_back(ScriptValue::fromString(args[2 + i]));
+    for (size_t i = 2 + numkeys; i < args.size(); ++i) argv->array.push_back(ScriptValue::fromString(args[i]));
+    std::unordered_map<std::string, ScriptValue> globals = {
+        {"KEYS", ScriptValue::fromTable(std::move(keys))},
+        {"ARGV", ScriptValue::fromTable(std::move(argv))},
+        {"redis", redis_lib},
+    };
+
+    script_wrote = false;
+    int64_t budget_ms = time_limit_ms;
+    auto started = std::chrono::steady_clock::now();
+    std::string reply;
+    try {
+        appendReply(reply, script.run(globals, budget_ms, script_wrote));
+    } catch (const ScriptError& e) {
+        reply = "-" + singleLine(e.what()) + "\r\n";
+    } catch (const std::exception& e) {
+        reply = "-ERR " + singleLine(e.what()) + "\r\n";
+    }
+
+    auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count();
+    if (script_wrote && elapsed_ms > budget_ms) {
+        std::cerr << "Script ran " << elapsed_ms << " ms, over its time budget of " << budget_ms << " ms, but was not aborted because it had written\n";
+    }
+    sendResponse(reply);
+}
+
+ScriptValue ScriptingHandler::call(std::vector<ScriptValue>& args, bool raise_errors) {
+    if (args.empty()) throw std::invalid_argument("Please specify at least one argument for this redis lib call");
+
+    std::vector<std::string> parts;
+    parts.reserve(args.size());
+    for (const auto& arg : args) {
+        if (arg.type == ScriptValue::Type::String) parts.push_back(arg.string);
+        else if (arg.type == ScriptValue::Type::Number) parts.push_back(ScriptValue::formatNumber(arg.number));
+        else throw std::invalid_argument("Lua redis lib command arguments must be strings or integers");
+    }
+    std::string name = upper(parts[0]);
+    parts.erase(parts.begin());
+
+    bool known = false;
+    bool wrote = false;
+    std::string reply = ClientOutput::collect(client_fd, [&]() { known = dispatch(name, parts, wrote); });
+    if (wrote) script_wrote = true;
+
+    ScriptValue result = known ? ScriptValue() : tableWith("err", "ERR This Redis command is not allowed from script");
+    if (known) {
+        std::string_view in = reply;
+        result = fromReply(in);
+    }
+    if (raise_errors && result.type == ScriptValue::Type::Table) {
+        ScriptValue err = result.table->get(ScriptValue::fromString("err"));
+        if (err.type == ScriptValue::Type::String) throw ScriptError(err.string);
+    }
+    return result;
+}
+
+void ScriptingHandler::handleScript(const std::vector<std::string>& args) {
+    std::string sub = args.empty() ? "" : upper(args[0]);
+    if (sub == "LOAD" && args.size() == 2) {
+        std::string sha = sha1Hex(args[1]);
+        try {
+            auto script = std::make_shared<const Script>(args[1]);
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            script_cache.emplace(sha, std::move(script));
+        } catch (const ScriptError& e) {
+            sendResponse("-" + singleLine(e.what()) + "\r\n");
+            return;
+        }
+        sendResponse("$40\r\n" + sha + "\r\n");
+    } else if (sub == "EXISTS" && args.size() >= 2) {
+        std::string response = "*" + std::to_string(args.size() - 1) + "\r\n";
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        for (size_t i = 1; i < args.size(); ++i) response += script_cache.count(lower(args[i])) ? ":1\r\n" : ":0\r\n";
+        sendResponse(response);
+    } else if (sub == "FLUSH") {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        script_cache.clear();
+        sendResponse("+OK\r\n");
+    } else {
+        sendResponse("-ERR unknown subcommand or wrong number of arguments for 'SCRIPT'\r\n");
+    }
+}
+
+void ScriptingHandler::sendResponse(std::string_view response) {
+    ClientOutput::send(client_fd, response);
+}
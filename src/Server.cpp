@@ -2,36 +2,65 @@
 #include <cstdlib>
 #include <string>
 #include <cstring>
+#include <cerrno>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <thread>
 #include <vector>
+#include "ClientOutput.hpp"
 #include "Handler.hpp"
 #include "ReplicaClient.hpp"
 #include "ReplicationManager.hpp"
+#include "RdbReader.hpp"
+#include "AppendOnlyFile.hpp"
 
 void handleResponse(int client_fd, bool isReplica, ReplicationManager* replManager, std::string rdb_dir, std::string rdb_filename) {
-  Handler handler(client_fd, isReplica, replManager, rdb_dir, rdb_filename);
-
-  char buffer[1024];
-  while(true){
-    memset(buffer, 0, sizeof(buffer));
-    int bytes_received = recv(client_fd, buffer, sizeof(buffer)-1, 0);
-    if(bytes_received<=0){
-      std::cerr << "Client disconnected or error occurred\n";
-      break;
+  ClientOutput::registerClient(client_fd);
+  int wake_fd = ClientOutput::wakeFd(client_fd);
+  {
+    Handler handler(client_fd, isReplica, replManager, rdb_dir, rdb_filename);
+
+    // Besides requests, the loop wakes for output other threads queued for this client
+    // (pub/sub messages, replication stream) and for socket space when a flush was short.
+    char buffer[1024];
+    while(true){
+      pollfd fds[2] = {
+        {client_fd, static_cast<short>(POLLIN | (ClientOutput::hasPending(client_fd) ? POLLOUT : 0)), 0},
+        {wake_fd, POLLIN, 0},
+      };
+      if (poll(fds, 2, -1) < 0) {
+        if (errno == EINTR) continue;
+        break;
+      }
+      if (fds[1].revents & POLLIN) {
+        uint64_t ignored;
+        if (read(wake_fd, &ignored, sizeof(ignored)) < 0 && errno != EAGAIN) break;
+      }
+      if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+        memset(buffer, 0, sizeof(buffer));
+        int bytes_received = recv(client_fd, buffer, sizeof(buffer)-1, 0);
+        if(bytes_received<=0){
+          std::cerr << "Client disconnected or error occurred\n";
+          break;
+        }
+
+        std::string message(buffer, bytes_received);
+        handler.handleMessage(message);
+      }
+      // Under appendfsync always, replies wait until their writes are on disk.
+      AppendOnlyFile::waitUntilDurable();
+      if (!ClientOutput::flush(client_fd)) break;
     }
 
-    std::string message(buffer, bytes_received);
-    handler.handleMessage(message);
-  }
-
-  if (replManager) {
-    replManager->removeReplica(client_fd);
+    if (replManager) {
+      replManager->removeReplica(client_fd);
+    }
   }
+  ClientOutput::unregisterClient(client_fd);
   close(client_fd);
 }
 
@@ -45,6 +74,10 @@ int main(int argc, char **argv) {
   int masterPort = 0;
   std::string rdb_dir = "./";
   std::string rdb_filename = "dump.rdb";
+  size_t rdb_load_threads = 0;
+  bool appendonly = false;
+  std::string aof_filename = "appendonly.aof";
+  AppendOnlyFile::FsyncPolicy appendfsync = AppendOnlyFile::FsyncPolicy::EverySec;
 
   for(int i=1;i<argc;i++){
     std::string arg=argv[i];
@@ -69,9 +102,47 @@ int main(int argc, char **argv) {
       rdb_dir = argv[++i];
     } else if (arg=="--dbfilename" && i+1<argc) {
       rdb_filename = argv[++i];
+    } else if (arg=="--appendonly" && i+1<argc) {
+      appendonly = std::string(argv[++i]) == "yes";
+    } else if (arg=="--appendfilename" && i+1<argc) {
+      aof_filename = argv[++i];
+    } else if (arg=="--appendfsync" && i+1<argc) {
+      if (!AppendOnlyFile::parsePolicy(argv[++i], appendfsync)) {
+        std::cerr << "--appendfsync expects always, everysec or no\n";
+        return 1;
+      }
+    } else if (arg=="--rdb-load-threads" && i+1<argc) {
+      rdb_load_threads = std::stoul(argv[++i]);
+    } else if (arg=="--lua-time-limit" && i+1<argc) {
+      ScriptingHandler::setTimeLimit(std::stoll(argv[++i]));
+    } else if (arg=="--client-output-buffer-limit" && i+1<argc) {
+      if (!ClientOutput::parseLimit(argv[++i])) {
+        std::cerr << "--client-output-buffer-limit expects \"<class> <hard> <soft> <seconds>\"\n";
+        return 1;
+      }
     }
   }
 
+  // The dataset is loaded once, into the shared keyspace, before any client can connect.
+  // As in Redis, an existing AOF takes precedence over the dump.
+  std::string aof_path = rdb_dir.empty() ? aof_filename : rdb_dir + "/" + aof_filename;
+  if (appendonly && access(aof_path.c_str(), F_OK) == 0) {
+    Handler replayer(-1, false, nullptr, rdb_dir, rdb_filename);
+    bool loaded = AppendOnlyFile::load(aof_path, [&](const std::string& name, const std::vector<std::string>& args) {
+      ClientOutput::collect(-1, [&]() { replayer.executeCommand(name, args); });
+    });
+    if (!loaded) return 1;
+  } else {
+    RdbReader rdbReader(rdb_dir.empty() ? rdb_filename : rdb_dir + "/" + rdb_filename, rdb_load_threads);
+    rdbReader.load();
+    std::cout << "Loaded " << rdbReader.keysLoaded() << " keys from the dump\n";
+    if (rdbReader.keysSkipped() > 0) std::cout << "Skipped " << rdbReader.keysSkipped() << " set and hash keys, which are not supported\n";
+  }
+  if (appendonly && !AppendOnlyFile::open(aof_path, appendfsync)) {
+    std::cerr << "Failed to open the append only file " << aof_path << "\n";
+    return 1;
+  }
+
   ReplicationManager replManager;
   int server_fd = socket(AF_INET, SOCK_STREAM, 0);
   if (server_fd < 0) {
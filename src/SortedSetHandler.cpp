@@ -1,16 +1,33 @@
 #include "SortedSetHandler.hpp"
+#include "ClientOutput.hpp"
+#include "KeyWatch.hpp"
+#include "StoreLock.hpp"
+#include "NumericCodec.hpp"
+#include "RdbWriter.hpp"
 #include <sstream>
 #include <iostream>
 #include <cstdlib>
 #include <optional>
 #include <sys/socket.h>
 #include <algorithm>
+#include <cmath>
+#include <queue>
+#include <string_view>
+#include <thread>
+
+std::unordered_map<std::string, ZSet> SortedSetHandler::sorted_sets;
+std::mutex SortedSetHandler::store_mutex;
 
 SortedSetHandler::SortedSetHandler(int client_fd) : client_fd(client_fd) {}
 
 bool SortedSetHandler::isSortedSetCommand(const std::string& cmd) {
     return cmd == "ZADD" || cmd == "ZRANK" || cmd == "ZRANGE" ||
-        cmd == "ZCARD" || cmd == "ZSCORE" || cmd == "ZREM";
+        cmd == "ZCARD" || cmd == "ZSCORE" || cmd == "ZREM" ||
+        cmd == "ZUNIONSTORE" || cmd == "ZINTERSTORE" || cmd == "ZDIFFSTORE";
+}
+
+bool SortedSetHandler::isWriteCommand(const std::string& cmd) {
+    return cmd == "ZADD" || cmd == "ZREM" || cmd == "ZUNIONSTORE" || cmd == "ZINTERSTORE" || cmd == "ZDIFFSTORE";
 }
 
 void SortedSetHandler::handleCommand(const std::string& cmd, const std::vector<std::string>& args) {
@@ -20,6 +37,9 @@ void SortedSetHandler::handleCommand(const std::string& cmd, const std::vector<s
     else if(cmd == "ZCARD") handleZCard(args);
     else if(cmd == "ZSCORE") handleZScore(args);
     else if(cmd == "ZREM") handleZRem(args);
+    else if(cmd == "ZUNIONSTORE") handleZUnionStore(args);
+    else if(cmd == "ZINTERSTORE") handleZInterStore(args);
+    else if(cmd == "ZDIFFSTORE") handleZDiffStore(args);
     else sendResponse("-ERR Unsupported sorted set command\r\n");
 }
 
@@ -30,25 +50,17 @@ void SortedSetHandler::handleZAdd(const std::vector<std::string>& args) {
     }
 
     const std::string& key = args[0];
-    double score = std::stod(args[1]);
+    auto parsed = Numeric::parseDouble(args[1]);
+    if (!parsed) {
+        sendResponse("-ERR value is not a valid float\r\n");
+        return;
+    }
+    double score = *parsed;
     const std::string& member = args[2];
 
-    bool added = false;
-    {
-        std::lock_guard<std::mutex> lock(store_mutex);
-
-        auto& zset = sorted_sets[key];
-        auto it = zset.lookup.find(member);
-        if (it != zset.lookup.end()) {
-            zset.ordered.erase({it->second, member});
-        } else {
-            added = true;
-        }
-        zset.lookup[member] = score;
-        zset.ordered[{score, member}] = member;
-    }
+    size_t added = addMembers(key, {{member, score}});
 
-    sendResponse(":" + std::to_string(added ? 1 : 0) + "\r\n");
+    sendResponse(":" + std::to_string(added) + "\r\n");
 }
 
 void SortedSetHandler::handleZRank(const std::vector<std::string>& args) {
@@ -64,7 +76,7 @@ void SortedSetHandler::handleZRank(const std::vector<std::string>& args) {
     bool found = false;
 
     {
-        std::lock_guard<std::mutex> lock(store_mutex);
+        StoreLock lock(store_mutex);
 
         auto it = sorted_sets.find(key);
         if (it == sorted_sets.end()) {
@@ -108,7 +120,7 @@ void SortedSetHandler::handleZRange(const std::vector<std::string>& args) {
     std::vector<std::string> result;
 
     {
-        std::lock_guard<std::mutex> lock(store_mutex);
+        StoreLock lock(store_mutex);
 
         auto it = sorted_sets.find(key);
         if (it == sorted_sets.end()) {
@@ -160,7 +172,7 @@ void SortedSetHandler::handleZCard(const std::vector<std::string>& args) {
     int card = 0;
 
     {
-        std::lock_guard<std::mutex> lock(store_mutex);
+        StoreLock lock(store_mutex);
 
         auto it = sorted_sets.find(key);
         if (it != sorted_sets.end()) {
@@ -182,7 +194,7 @@ void SortedSetHandler::handleZScore(const std::vector<std::string>& args) {
     std::optional<double> score;
 
     {
-        std::lock_guard<std::mutex> lock(store_mutex);
+        StoreLock lock(store_mutex);
 
        auto it = sorted_sets.find(key);
         if (it == sorted_sets.end()) {
@@ -199,12 +211,8 @@ void SortedSetHandler::handleZScore(const std::vector<std::string>& args) {
         score = mit->second; 
     }
 
-    std::ostringstream oss;
-    oss.precision(17);
-    oss << *score;
-    std::string scoreStr = oss.str();
-
-    std::string result = "$" + std::to_string(scoreStr.size()) + "\r\n" + scoreStr + "\r\n";
+    std::string result;
+    Numeric::appendBulkDouble(result, *score);
     sendResponse(result);
 }
 
@@ -219,7 +227,7 @@ void SortedSetHandler::handleZRem(const std::vector<std::string>& args) {
     bool removed = false;
 
     {
-        std::lock_guard<std::mutex> lock(store_mutex);
+        StoreLock lock(store_mutex);
 
         auto it = sorted_sets.find(key);
         if (it == sorted_sets.end()) {
@@ -234,15 +242,322 @@ void SortedSetHandler::handleZRem(const std::vector<std::string>& args) {
             zset.ordered.erase({score, member});
             zset.lookup.erase(mit);
             removed = true;
+            KeyWatch::touch(key);
         }
     }
 
     sendResponse(":" + std::to_string(removed ? 1 : 0) + "\r\n");
 }
 
+enum class Aggregate { Sum, Min, Max };
+
+struct WeightedInput {
+    const ZSet* zset;
+    double weight;
+};
+
+using ScoredMember = std::pair<double, std::string>;
+
+// Unions whose inputs hold at least this many members in total are aggregated on worker threads.
+static constexpr size_t PARALLEL_UNION_THRESHOLD = 1 << 17;
+static constexpr unsigned MAX_UNION_WORKERS = 8;
+
+static double weightedScore(double score, double weight) {
+    double v = score * weight;
+    return std::isnan(v) ? 0.0 : v;
+}
+
+static double aggregateScore(double acc, double value, Aggregate agg) {
+    if (agg == Aggregate::Min) return std::min(acc, value);
+    if (agg == Aggregate::Max) return std::max(acc, value);
+    double sum = acc + value;
+    return std::isnan(sum) ? 0.0 : sum;
+}
+
+static void appendInOrder(ZSet& zset, ScoredMember&& entry) {
+    zset.lookup.emplace(entry.second, entry.first);
+    std::string member = entry.second;
+    zset.ordered.emplace_hint(zset.ordered.end(), std::move(entry), std::move(member));
+}
+
+static std::vector<ScoredMember> sortedMembers(std::unordered_map<std::string_view, double>& acc) {
+    std::vector<ScoredMember> out;
+    out.reserve(acc.size());
+    for (const auto& [member, score] : acc) out.emplace_back(score, std::string(member));
+    std::sort(out.begin(), out.end());
+    return out;
+}
+
+template <typename Fn>
+static void runOnWorkers(unsigned workers, Fn&& fn) {
+    std::vector<std::thread> threads;
+    threads.reserve(workers - 1);
+    for (unsigned w = 1; w < workers; ++w) threads.emplace_back(fn, w);
+    fn(0u);
+    for (auto& t : threads) t.join();
+}
+
+static std::vector<ScoredMember> unionSequential(const std::vector<WeightedInput>& inputs, Aggregate agg) {
+    std::unordered_map<std::string_view, double> acc;
+    for (const auto& input : inputs) {
+        for (const auto& [member, score] : input.zset->lookup) {
+            double v = weightedScore(score, input.weight);
+            auto [it, inserted] = acc.try_emplace(member, v);
+            if (!inserted) it->second = aggregateScore(it->second, v, agg);
+        }
+    }
+    return sortedMembers(acc);
+}
+
+// Hash-partitioned union. Every worker scans a slice of the buckets of each input and routes
+// members to the partition owning their hash; each partition is then aggregated independently
+// into a sorted run. Partitions are disjoint, so the runs only need a k-way merge at the end.
+static std::vector<std::vector<ScoredMember>> unionParallel(const std::vector<WeightedInput>& inputs, Aggregate agg, unsigned workers) {
+    struct Contribution {
+        const std::string* member;
+        double score;
+    };
+
+    // routed[w][p] holds what worker w found for partition p, grouped by input;
+    // starts[w][p][i] is where input i begins so scores are aggregated in input order.
+    std::vector<std::vector<std::vector<Contribution>>> routed(workers, std::vector<std::vector<Contribution>>(workers));
+    std::vector<std::vector<std::vector<size_t>>> starts(workers, std::vector<std::vector<size_t>>(workers, std::vector<size_t>(inputs.size() + 1)));
+
+    runOnWorkers(workers, [&](unsigned w) {
+        std::hash<std::string> hasher;
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            for (unsigned p = 0; p < workers; ++p) starts[w][p][i] = routed[w][p].size();
+
+            const auto& lookup = inputs[i].zset->lookup;
+            size_t buckets = lookup.bucket_count();
+            size_t first = buckets * w / workers;
+            size_t last = buckets * (w + 1) / workers;
+            for (size_t b = first; b < last; ++b) {
+                for (auto it = lookup.begin(b); it != lookup.end(b); ++it) {
+                    routed[w][hasher(it->first) % workers].push_back({&it->first, weightedScore(it->second, inputs[i].weight)});
+                }
+            }
+        }
+        for (unsigned p = 0; p < workers; ++p) starts[w][p][inputs.size()] = routed[w][p].size();
+    });
+
+    std::vector<std::vector<ScoredMember>> runs(workers);
+    runOnWorkers(workers, [&](unsigned p) {
+        std::unordered_map<std::string_view, double> acc;
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            for (unsigned w = 0; w < workers; ++w) {
+                for (size_t k = starts[w][p][i]; k < starts[w][p][i + 1]; ++k) {
+                    const Contribution& c = routed[w][p][k];
+                    auto [it, inserted] = acc.try_emplace(*c.member, c.score);
+                    if (!inserted) it->second = aggregateScore(it->second, c.score, agg);
+                }
+            }
+        }
+        runs[p] = sortedMembers(acc);
+    });
+    return runs;
+}
+
+static ZSet mergeRuns(std::vector<std::vector<ScoredMember>>& runs) {
+    using Head = std::pair<size_t, size_t>;
+    auto later = [&runs](const Head& a, const Head& b) {
+        return runs[a.first][a.second] > runs[b.first][b.second];
+    };
+    std::priority_queue<Head, std::vector<Head>, decltype(later)> heap(later);
+    size_t total = 0;
+    for (size_t r = 0; r < runs.size(); ++r) {
+        total += runs[r].size();
+        if (!runs[r].empty()) heap.push({r, 0});
+    }
+
+    ZSet zset;
+    zset.lookup.reserve(total);
+    while (!heap.empty()) {
+        auto [r, i] = heap.top();
+        heap.pop();
+        appendInOrder(zset, std::move(runs[r][i]));
+        if (i + 1 < runs[r].size()) heap.push({r, i + 1});
+    }
+    return zset;
+}
+
+// Probes the inputs smallest-first so most non-members are rejected after one lookup,
+// but aggregates the scores in the order the keys were given.
+static std::vector<ScoredMember> intersect(const std::vector<WeightedInput>& inputs, Aggregate agg) {
+    std::vector<size_t> order(inputs.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return inputs[a].zset->lookup.size() < inputs[b].zset->lookup.size();
+    });
+
+    std::vector<ScoredMember> out;
+    std::vector<double> scores(inputs.size());
+    for (const auto& [member, score] : inputs[order[0]].zset->lookup) {
+        scores[order[0]] = score;
+        bool everywhere = true;
+        for (size_t k = 1; k < order.size() && everywhere; ++k) {
+            const auto& lookup = inputs[order[k]].zset->lookup;
+            auto it = lookup.find(member);
+            if (it == lookup.end()) everywhere = false;
+            else scores[order[k]] = it->second;
+        }
+        if (!everywhere) continue;
+
+        double total = weightedScore(scores[0], inputs[0].weight);
+        for (size_t i = 1; i < inputs.size(); ++i) {
+            total = aggregateScore(total, weightedScore(scores[i], inputs[i].weight), agg);
+        }
+        out.emplace_back(total, member);
+    }
+    std::sort(out.begin(), out.end());
+    return out;
+}
+
+static std::vector<ScoredMember> difference(const std::vector<WeightedInput>& inputs) {
+    std::vector<ScoredMember> out;
+    for (const auto& [member, score] : inputs[0].zset->lookup) {
+        bool excluded = false;
+        for (size_t i = 1; i < inputs.size() && !excluded; ++i) {
+            excluded = inputs[i].zset->lookup.count(member) > 0;
+        }
+        if (!excluded) out.emplace_back(score, member);
+    }
+    std::sort(out.begin(), out.end());
+    return out;
+}
+
+void SortedSetHandler::handleZUnionStore(const std::vector<std::string>& args) {
+    handleSetOperation(SetOperation::Union, "ZUNIONSTORE", args);
+}
+
+void SortedSetHandler::handleZInterStore(const std::vector<std::string>& args) {
+    handleSetOperation(SetOperation::Inter, "ZINTERSTORE", args);
+}
+
+void SortedSetHandler::handleZDiffStore(const std::vector<std::string>& args) {
+    handleSetOperation(SetOperation::Diff, "ZDIFFSTORE", args);
+}
+
+void SortedSetHandler::handleSetOperation(SetOperation op, const std::string& cmd, const std::vector<std::string>& args) {
+    if (args.size() < 3) {
+        sendResponse("-ERR " + cmd + " requires destination, numkeys and at least one key\r\n");
+        return;
+    }
+
+    const std::string& dest = args[0];
+    long long numkeys = 0;
+    try {
+        numkeys = std::stoll(args[1]);
+    } catch (...) {
+        sendResponse("-ERR value is not an integer or out of range\r\n");
+        return;
+    }
+    if (numkeys <= 0) {
+        sendResponse("-ERR at least 1 input key is needed for " + cmd + "\r\n");
+        return;
+    }
+    if (static_cast<size_t>(numkeys) > args.size() - 2) {
+        sendResponse("-ERR syntax error\r\n");
+        return;
+    }
+
+    std::vector<double> weights(numkeys, 1.0);
+    Aggregate agg = Aggregate::Sum;
+    for (size_t i = 2 + numkeys; i < args.size(); ++i) {
+        std::string option = args[i];
+        std::transform(option.begin(), option.end(), option.begin(), ::toupper);
+        if (op != SetOperation::Diff && option == "WEIGHTS" && i + numkeys < args.size()) {
+            for (long long k = 0; k < numkeys; ++k) {
+                auto weight = Numeric::parseDouble(args[++i]);
+                if (!weight) {
+                    sendResponse("-ERR weight value is not a float\r\n");
+                    return;
+                }
+                weights[k] = *weight;
+            }
+        } else if (op != SetOperation::Diff && option == "AGGREGATE" && i + 1 < args.size()) {
+            std::string mode = args[++i];
+            std::transform(mode.begin(), mode.end(), mode.begin(), ::toupper);
+            if (mode == "SUM") agg = Aggregate::Sum;
+            else if (mode == "MIN") agg = Aggregate::Min;
+            else if (mode == "MAX") agg = Aggregate::Max;
+            else {
+                sendResponse("-ERR syntax error\r\n");
+                return;
+            }
+        } else {
+            sendResponse("-ERR syntax error\r\n");
+            return;
+        }
+    }
+
+    static const ZSet empty;
+    size_t card = 0;
+    {
+        StoreLock lock(store_mutex);
+
+        std::vector<WeightedInput> inputs;
+        inputs.reserve(numkeys);
+        size_t totalMembers = 0;
+        for (long long k = 0; k < numkeys; ++k) {
+            auto it = sorted_sets.find(args[2 + k]);
+            const ZSet* zset = it == sorted_sets.end() ? &empty : &it->second;
+            totalMembers += zset->lookup.size();
+            inputs.push_back({zset, weights[k]});
+        }
+
+        ZSet result;
+        if (op == SetOperation::Union) {
+            unsigned workers = std::min(std::thread::hardware_concurrency(), MAX_UNION_WORKERS);
+            if (totalMembers >= PARALLEL_UNION_THRESHOLD && workers > 1) {
+                auto runs = unionParallel(inputs, agg, workers);
+                result = mergeRuns(runs);
+            } else {
+                auto members = unionSequential(inputs, agg);
+                result.lookup.reserve(members.size());
+                for (auto& entry : members) appendInOrder(result, std::move(entry));
+            }
+        } else {
+            auto members = op == SetOperation::Inter ? intersect(inputs, agg) : difference(inputs);
+            result.lookup.reserve(members.size());
+            for (auto& entry : members) appendInOrder(result, std::move(entry));
+        }
+
+        card = result.lookup.size();
+        if (card == 0) sorted_sets.erase(dest);
+        else sorted_sets[dest] = std::move(result);
+        KeyWatch::touch(dest);
+    }
+
+    sendResponse(":" + std::to_string(card) + "\r\n");
+}
+
+size_t SortedSetHandler::addMembers(const std::string& key, const std::vector<std::pair<std::string, double>>& members) {
+    StoreLock lock(store_mutex);
+
+    size_t added = 0;
+    auto& zset = sorted_sets[key];
+    KeyWatch::touch(key);
+    for (const auto& [member, score] : members) {
+        auto it = zset.lookup.find(member);
+        if (it != zset.lookup.end()) {
+            zset.ordered.erase({it->second, member});
+            it->second = score;
+        } else {
+            zset.lookup.emplace(member, score);
+            added++;
+        }
+        zset.ordered[{score, member}] = member;
+    }
+    return added;
+}
+
 std::optional<double> SortedSetHandler::getScore(const std::string& key, const std::string& member) {
-    std::lock_guard<std::mutex> lock(store_mutex);
+    StoreLock lock(store_mutex);
+    return getScoreLocked(key, member);
+}
 
+std::optional<double> SortedSetHandler::getScoreLocked(const std::string& key, const std::string& member) {
     auto it = sorted_sets.find(key);
     if (it == sorted_sets.end()) return std::nullopt;
 
@@ -253,7 +568,7 @@ std::optional<double> SortedSetHandler::getScore(const std::string& key, const s
 }
 
 std::vector<std::pair<std::string, double>> SortedSetHandler::getAllWithScores(const std::string& key) {
-    std::lock_guard<std::mutex> lock(store_mutex);
+    StoreLock lock(store_mutex);
 
     std::vector<std::pair<std::string, double>> result;
 
@@ -268,6 +583,71 @@ std::vector<std::pair<std::string, double>> SortedSetHandler::getAllWithScores(c
     return result;
 }
 
+std::vector<std::pair<std::string, double>> SortedSetHandler::getInScoreRanges(const std::string& key, const std::vector<std::pair<double, double>>& ranges) {
+    StoreLock lock(store_mutex);
+
+    std::vector<std::pair<std::string, double>> result;
+    for (const auto& [min, max] : ranges) appendInScoreRangeLocked(key, min, max, result);
+    return result;
+}
+
+void SortedSetHandler::appendInScoreRangeLocked(const std::string& key, double min, double max, std::vector<std::pair<std::string, double>>& out) {
+    auto it = sorted_sets.find(key);
+    if (it == sorted_sets.end()) return;
+
+    const auto& ordered = it->second.ordered;
+    for (auto oit = ordered.lower_bound({min, std::string()}); oit != ordered.end() && oit->first.first < max; ++oit) {
+        out.emplace_back(oit->second, oit->first.first);
+    }
+}
+
+void SortedSetHandler::replaceMembers(const std::string& key, std::vector<std::pair<std::string, double>> members) {
+    std::vector<ScoredMember> sorted;
+    sorted.reserve(members.size());
+    for (auto& [member, score] : members) sorted.emplace_back(score, std::move(member));
+    std::sort(sorted.begin(), sorted.end());
+
+    ZSet zset;
+    zset.lookup.reserve(sorted.size());
+    for (auto& entry : sorted) {
+        if (zset.lookup.count(entry.second)) continue;
+        appendInOrder(zset, std::move(entry));
+    }
+
+    StoreLock lock(store_mutex);
+    if (zset.lookup.empty()) sorted_sets.erase(key);
+    else sorted_sets[key] = std::move(zset);
+    KeyWatch::touch(key);
+}
+
+void SortedSetHandler::saveTo(RdbWriter& out) {
+    for (const auto& [key, zset] : sorted_sets) {
+        if (zset.ordered.empty()) continue;
+        out.writeKey(RdbWriter::TYPE_ZSET_2, key);
+        out.writeLength(zset.ordered.size());
+        for (const auto& [entry, member] : zset.ordered) {
+            out.writeString(member);
+            out.writeBinaryDouble(entry.first);
+        }
+    }
+}
+
+size_t SortedSetHandler::restore(std::vector<std::pair<std::string, std::vector<std::pair<std::string, double>>>>& batch) {
+    size_t inserted = 0;
+    StoreLock lock(store_mutex);
+    for (auto& [key, members] : batch) {
+        if (members.empty()) continue;
+        ZSet& zset = sorted_sets[std::move(key)];
+        zset = ZSet{};
+        for (auto& [member, score] : members) {
+            zset.lookup[member] = score;
+            zset.ordered.emplace(std::make_pair(score, member), std::move(member));
+        }
+        inserted++;
+    }
+    return inserted;
+}
+
 void SortedSetHandler::sendResponse(const std::string& response) {
-    send(client_fd, response.c_str(), response.size(), 0);
+    ClientOutput::send(client_fd, response);
 }
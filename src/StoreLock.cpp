@@ -0,0 +1,37 @@
+#include "StoreLock.hpp"
+#include <algorithm>
+#include <functional>
+
+static thread_local std::vector<std::mutex*> batch_mutexes;
+static thread_local bool batch_blocking = false;
+
+StoreLock::StoreLock(std::mutex& mutex) : lock(mutex, std::defer_lock) {
+    if (std::find(batch_mutexes.begin(), batch_mutexes.end(), &mutex) == batch_mutexes.end()) {
+        lock.lock();
+    } else if (batch_blocking) {
+        lock = std::unique_lock<std::mutex>(mutex, std::adopt_lock);
+        adopted = true;
+    }
+}
+
+StoreLock::~StoreLock() {
+    if (adopted) lock.release();
+}
+
+void StoreLock::acquireBatch(std::vector<std::mutex*> mutexes, bool blocking) {
+    std::sort(mutexes.begin(), mutexes.end(), std::less<std::mutex*>());
+    mutexes.erase(std::unique(mutexes.begin(), mutexes.end()), mutexes.end());
+    for (std::mutex* mutex : mutexes) mutex->lock();
+    batch_mutexes = std::move(mutexes);
+    batch_blocking = blocking;
+}
+
+bool StoreLock::holdsBatch() {
+    return !batch_mutexes.empty();
+}
+
+void StoreLock::releaseBatch() {
+    for (auto it = batch_mutexes.rbegin(); it != batch_mutexes.rend(); ++it) (*it)->unlock();
+    batch_mutexes.clear();
+    batch_blocking = false;
+}
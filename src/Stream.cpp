@@ -0,0 +1,369 @@
+#include "Stream.hpp"
+#include <algorithm>
+#include <array>
+#include <charconv>
+
+std::string StreamId::toString() const {
+    return std::to_string(ms) + "-" + std::to_string(seq);
+}
+
+StreamId StreamId::next() const {
+    if (seq != UINT64_MAX) return {ms, seq + 1};
+    if (ms != UINT64_MAX) return {ms + 1, 0};
+    return *this;
+}
+
+StreamId StreamId::prev() const {
+    if (seq != 0) return {ms, seq - 1};
+    if (ms != 0) return {ms - 1, UINT64_MAX};
+    return *this;
+}
+
+static bool parseUint(std::string_view text, uint64_t& out) {
+    if (text.empty()) return false;
+    auto res = std::from_chars(text.data(), text.data() + text.size(), out);
+    return res.ec == std::errc{} && res.ptr == text.data() + text.size();
+}
+
+std::optional<StreamId> StreamId::parse(std::string_view text, uint64_t missingSeq) {
+    StreamId id;
+    size_t dash = text.find('-');
+    if (dash == std::string_view::npos) {
+        if (!parseUint(text, id.ms)) return std::nullopt;
+        id.seq = missingSeq;
+        return id;
+    }
+    if (!parseUint(text.substr(0, dash), id.ms) || !parseUint(text.substr(dash + 1), id.seq)) return std::nullopt;
+    return id;
+}
+
+static constexpr uint8_t FLAG_SAME_FIELDS = 1;
+static constexpr uint8_t FLAG_DELETED = 2;
+
+// Integers are delta-encoded only within this range so that zigzag(delta) << 1 fits in 64 bits.
+static constexpr int64_t MAX_PACKED_INT = int64_t{1} << 61;
+
+static void putVarint(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+        out += static_cast<char>((v & 0x7F) | 0x80);
+        v >>= 7;
+    }
+    out += static_cast<char>(v);
+}
+
+static uint64_t getVarint(const std::string& data, size_t& pos) {
+    uint64_t v = 0;
+    for (int shift = 0;; shift += 7) {
+        uint8_t byte = static_cast<uint8_t>(data[pos++]);
+        v |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return v;
+    }
+}
+
+static uint64_t zigzag(int64_t v) { return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63); }
+static int64_t unzigzag(uint64_t v) { return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1); }
+
+// Only values that print back to exactly the same text are stored as integers.
+static bool asPackedInt(std::string_view text, int64_t& out) {
+    if (text.empty() || text.size() > 20) return false;
+    auto res = std::from_chars(text.data(), text.data() + text.size(), out);
+    if (res.ec != std::errc{} || res.ptr != text.data() + text.size()) return false;
+    if (out >= MAX_PACKED_INT || out <= -MAX_PACKED_INT) return false;
+    char buf[24];
+    auto back = std::to_chars(buf, buf + sizeof(buf), out);
+    return std::string_view(buf, back.ptr - buf) == text;
+}
+
+// Value header: (len << 1) for raw bytes, (zigzag(delta) << 1) | 1 for integers.
+static void putValue(std::string& out, std::string_view value, int64_t* lastInt) {
+    int64_t v;
+    if (lastInt && asPackedInt(value, v)) {
+        putVarint(out, (zigzag(v - *lastInt) << 1) | 1);
+        *lastInt = v;
+        return;
+    }
+    putVarint(out, static_cast<uint64_t>(value.size()) << 1);
+    out += value;
+}
+
+static void putString(std::string& out, std::string_view s) {
+    putVarint(out, s.size());
+    out += s;
+}
+
+static std::string_view getString(const std::string& data, size_t& pos) {
+    size_t len = getVarint(data, pos);
+    std::string_view s(data.data() + pos, len);
+    pos += len;
+    return s;
+}
+
+void Stream::appendEntry(Node& node, StreamId master, StreamId id, const std::vector<std::pair<std::string, std::string>>& fields) {
+    bool same = fields.size() == node.master_fields.size();
+    for (size_t k = 0; same && k < fields.size(); ++k) same = fields[k].first == node.master_fields[k];
+
+    std::string& out = node.data;
+    out += static_cast<char>(same ? FLAG_SAME_FIELDS : 0);
+    uint64_t ms_delta = id.ms - master.ms;
+    putVarint(out, ms_delta);
+    putVarint(out, ms_delta == 0 ? id.seq - master.seq : id.seq);
+
+    if (same) {
+        for (size_t k = 0; k < fields.size(); ++k) putValue(out, fields[k].second, &node.last_ints[k]);
+    } else {
+        int64_t base = 0;
+        putVarint(out, fields.size());
+        for (const auto& [field, value] : fields) {
+            putString(out, field);
+            base = 0;
+            putValue(out, value, &base);
+        }
+    }
+    node.count++;
+    node.live++;
+    node.last = id;
+}
+
+// Walks the live entries of one node in order, reusing its buffers between entries.
+// Deleted entries are still decoded, since later integer deltas depend on them.
+class NodeReader {
+public:
+    NodeReader(const std::string& data, const std::vector<std::string>& master_fields, StreamId master)
+        : data(data), master_fields(master_fields), master(master), last_ints(master_fields.size(), 0) {}
+
+    bool next(StreamEntry& entry) {
+        while (pos < data.size()) {
+            entry_offset = pos;
+            if (decode(entry)) return true;
+        }
+        return false;
+    }
+
+    // Offset of the entry last returned by next(), where its flags byte lives.
+    size_t entryOffset() const { return entry_offset; }
+
+    // A mark records the decoder state before an entry so it can be decoded again later.
+    struct Mark {
+        size_t pos;
+        std::vector<int64_t> last_ints;
+    };
+
+    void save(Mark& mark) const {
+        mark.pos = pos;
+        mark.last_ints.assign(last_ints.begin(), last_ints.end());
+    }
+
+    void restore(const Mark& mark) {
+        pos = mark.pos;
+        std::copy(mark.last_ints.begin(), mark.last_ints.end(), last_ints.begin());
+    }
+
+private:
+    bool decode(StreamEntry& entry) {
+        uint8_t flags = static_cast<uint8_t>(data[pos++]);
+        uint64_t ms_delta = getVarint(data, pos);
+        uint64_t seq = getVarint(data, pos);
+        entry.id = {master.ms + ms_delta, ms_delta == 0 ? master.seq + seq : seq};
+
+        entry.fields.clear();
+        if (flags & FLAG_SAME_FIELDS) {
+            numbers.resize(master_fields.size());
+            for (size_t k = 0; k < master_fields.size(); ++k) {
+                entry.fields.emplace_back(master_fields[k], getValue(last_ints[k], numbers[k]));
+            }
+        } else {
+            size_t n = getVarint(data, pos);
+            numbers.resize(n);
+            for (size_t k = 0; k < n; ++k) {
+                std::string_view field = getString(data, pos);
+                int64_t base = 0;
+                entry.fields.emplace_back(field, getValue(base, numbers[k]));
+            }
+        }
+        return !(flags & FLAG_DELETED);
+    }
+
+    std::string_view getValue(int64_t& lastInt, std::array<char, 24>& text) {
+        uint64_t header = getVarint(data, pos);
+        if (header & 1) {
+            lastInt += unzigzag(header >> 1);
+            auto res = std::to_chars(text.data(), text.data() + text.size(), lastInt);
+            return std::string_view(text.data(), res.ptr - text.data());
+        }
+        std::string_view value(data.data() + pos, header >> 1);
+        pos += header >> 1;
+        return value;
+    }
+
+    const std::string& data;
+    const std::vector<std::string>& master_fields;
+    StreamId master;
+    std::vector<int64_t> last_ints;
+    std::vector<std::array<char, 24>> numbers;
+    size_t pos = 0;
+    size_t entry_offset = 0;
+};
+
+void Stream::append(StreamId id, std::vector<std::pair<std::string, std::string>> fields) {
+    if (nodes.empty() || nodes.rbegin()->second.count >= NODE_MAX_ENTRIES || nodes.rbegin()->second.data.size() >= NODE_MAX_BYTES) {
+        Node& node = nodes.emplace_hint(nodes.end(), id, Node{})->second;
+        for (const auto& field : fields) node.master_fields.push_back(field.first);
+        node.last_ints.assign(node.master_fields.size(), 0);
+    }
+    auto& [master, node] = *nodes.rbegin();
+    appendEntry(node, master, id, fields);
+    last_id = id;
+    length++;
+    entries_added++;
+}
+
+void Stream::range(StreamId start, StreamId end, const std::function<bool(const StreamEntry&)>& visit) const {
+    if (start > end || nodes.empty()) return;
+
+    // The first node that can hold start is the last one whose first ID is <= start.
+    auto it = nodes.upper_bound(start);
+    if (it != nodes.begin()) --it;
+
+    StreamEntry entry;
+    for (; it != nodes.end() && it->first <= end; ++it) {
+        NodeReader reader(it->second.data, it->second.master_fields, it->first);
+        while (reader.next(entry)) {
+            if (entry.id < start) continue;
+            if (entry.id > end) return;
+            if (!visit(entry)) return;
+        }
+    }
+}
+
+void Stream::revrange(StreamId start, StreamId end, const std::function<bool(const StreamEntry&)>& visit) const {
+    if (start > end || nodes.empty()) return;
+
+    auto it = nodes.upper_bound(end);
+    if (it == nodes.begin()) return;
+
+    // Entries in a node can only be decoded forwards, so each node is scanned once to mark
+    // the entries in range and those are then decoded again from the back.
+    StreamEntry entry;
+    std::vector<NodeReader::Mark> marks;
+    do {
+        --it;
+        NodeReader reader(it->second.data, it->second.master_fields, it->first);
+        size_t used = 0;
+        for (;;) {
+            if (used == marks.size()) marks.emplace_back();
+            reader.save(marks[used]);
+            if (!reader.next(entry) || entry.id > end) break;
+            if (entry.id >= start) used++;
+        }
+        while (used > 0) {
+            reader.restore(marks[--used]);
+            reader.next(entry);
+            if (!visit(entry)) return;
+        }
+    } while (it != nodes.begin() && it->first > start);
+}
+
+bool Stream::contains(StreamId id) const {
+    bool found = false;
+    range(id, id, [&](const StreamEntry&) { return !(found = true); });
+    return found;
+}
+
+void Stream::markDeleted(std::map<StreamId, Node>::iterator it, size_t offset) {
+    Node& node = it->second;
+    node.data[offset] = static_cast<char>(node.data[offset] | FLAG_DELETED);
+    node.live--;
+    length--;
+    if (node.live == 0) nodes.erase(it);
+}
+
+bool Stream::remove(StreamId id) {
+    auto it = nodes.upper_bound(id);
+    if (it == nodes.begin()) return false;
+    --it;
+
+    StreamEntry entry;
+    NodeReader reader(it->second.data, it->second.master_fields, it->first);
+    while (reader.next(entry)) {
+        if (entry.id < id) continue;
+        if (entry.id > id) return false;
+        markDeleted(it, reader.entryOffset());
+        max_deleted_id = std::max(max_deleted_id, id);
+        return true;
+    }
+    return false;
+}
+
+// Entries leave from the head while shouldRemove(id, length) holds. Whole nodes are dropped
+// without decoding them; only an exact trim decodes the node where trimming stops.
+size_t Stream::trimHead(const std::function<bool(StreamId, size_t)>& shouldRemove, bool approx, size_t limit) {
+    size_t removed = 0;
+    while (!nodes.empty()) {
+        auto it = nodes.begin();
+        Node& node = it->second;
+        if (limit != 0 && removed + node.live > limit) return removed;
+        if (!shouldRemove(node.last, length - node.live + 1)) break;
+        removed += node.live;
+        length -= node.live;
+        max_deleted_id = std::max(max_deleted_id, node.last);
+        nodes.erase(it);
+    }
+    if (approx || nodes.empty()) return removed;
+
+    auto it = nodes.begin();
+    StreamEntry entry;
+    NodeReader reader(it->second.data, it->second.master_fields, it->first);
+    while (reader.next(entry) && shouldRemove(entry.id, length)) {
+        removed++;
+        bool last = it->second.live == 1;
+        max_deleted_id = std::max(max_deleted_id, entry.id);
+        markDeleted(it, reader.entryOffset());
+        if (last) break;
+    }
+    return removed;
+}
+
+size_t Stream::trimMaxLen(size_t maxlen, bool approx, size_t limit) {
+    return trimHead([maxlen](StreamId, size_t remaining) { return remaining > maxlen; }, approx, limit);
+}
+
+size_t Stream::trimMinId(StreamId minid, bool approx, size_t limit) {
+    return trimHead([minid](StreamId id, size_t) { return id < minid; }, approx, limit);
+}
+
+Consumer& ConsumerGroup::consumer(const std::string& name, int64_t now) {
+    Consumer& c = consumers[name];
+    c.seen_time = now;
+    return c;
+}
+
+PendingEntry& ConsumerGroup::assign(StreamId id, const std::string& name, int64_t now) {
+    auto [it, inserted] = pel.try_emplace(id);
+    PendingEntry& entry = it->second;
+    if (!inserted && entry.consumer != name) {
+        auto previous = consumers.find(entry.consumer);
+        if (previous != consumers.end()) previous->second.pending.erase(id);
+    }
+    entry.consumer = name;
+    entry.delivery_time = now;
+    consumer(name, now).pending.insert(id);
+    return entry;
+}
+
+bool ConsumerGroup::ack(StreamId id) {
+    auto it = pel.find(id);
+    if (it == pel.end()) return false;
+    auto owner = consumers.find(it->second.consumer);
+    if (owner != consumers.end()) owner->second.pending.erase(id);
+    pel.erase(it);
+    return true;
+}
+
+size_t ConsumerGroup::removeConsumer(const std::string& name) {
+    auto it = consumers.find(name);
+    if (it == consumers.end()) return 0;
+    size_t pending = it->second.pending.size();
+    for (StreamId id : it->second.pending) pel.erase(id);
+    consumers.erase(it);
+    return pending;
+}
@@ -1,33 +1,54 @@
 #include "StreamStoreHandler.hpp"
+#include "ClientOutput.hpp"
+#include "KeyWatch.hpp"
+#include "Propagation.hpp"
+#include "StoreLock.hpp"
+#include "RdbWriter.hpp"
+#include "Listpack.hpp"
 #include <iostream>
 #include <sstream>
 #include <algorithm>
+#include <charconv>
 #include <chrono>
 #include <sys/socket.h>
 #include <cctype>
+#include <stdexcept>
 #include <unordered_set>
 
 
 static std::condition_variable global_cv;
-std::unordered_map<std::string, std::vector<StreamStoreHandler::StreamEntry>> StreamStoreHandler::stream_store;
+std::unordered_map<std::string, Stream> StreamStoreHandler::stream_store;
 std::mutex StreamStoreHandler::store_mutex;
 std::unordered_map<std::string, std::condition_variable>StreamStoreHandler::stream_cvs;
 
 StreamStoreHandler::StreamStoreHandler(int client_fd) : client_fd(client_fd) {}
 
 bool StreamStoreHandler::isStreamCommand(const std::string& cmd) {
-    return cmd == "XADD" || cmd == "XRANGE" || cmd == "XREAD";
+    static const std::unordered_set<std::string> streamCommands = {
+        "XADD", "XRANGE", "XREVRANGE", "XLEN", "XREAD", "XTRIM", "XDEL",
+        "XGROUP", "XREADGROUP", "XACK", "XPENDING", "XCLAIM", "XAUTOCLAIM"};
+    return streamCommands.count(cmd) > 0;
 }
 
 bool StreamStoreHandler::isWriteCommand(const std::string& cmd) {
-    static const std::unordered_set<std::string> writeCommands = {"XADD"};
+    static const std::unordered_set<std::string> writeCommands = {"XADD", "XTRIM", "XDEL", "XGROUP", "XREADGROUP", "XACK", "XCLAIM", "XAUTOCLAIM"};
     return writeCommands.count(cmd) > 0;
 }
 
 void StreamStoreHandler::handleCommand(const std::string& cmd, const std::vector<std::string>& args) {
     if (cmd == "XADD") handleXadd(args);
-    else if (cmd == "XRANGE") handleXrange(args);
+    else if (cmd == "XRANGE") handleXrange(args, false);
+    else if (cmd == "XREVRANGE") handleXrange(args, true);
+    else if (cmd == "XLEN") handleXlen(args);
     else if (cmd == "XREAD") handleXread(args);
+    else if (cmd == "XTRIM") handleXtrim(args);
+    else if (cmd == "XDEL") handleXdel(args);
+    else if (cmd == "XGROUP") handleXgroup(args);
+    else if (cmd == "XREADGROUP") handleXreadgroup(args);
+    else if (cmd == "XACK") handleXack(args);
+    else if (cmd == "XPENDING") handleXpending(args);
+    else if (cmd == "XCLAIM") handleXclaim(args);
+    else if (cmd == "XAUTOCLAIM") handleXautoclaim(args);
 }
 
 int64_t StreamStoreHandler::getCurrentTimeMs() {
@@ -35,110 +56,324 @@ int64_t StreamStoreHandler::getCurrentTimeMs() {
     return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
 }
 
+static std::string upper(std::string text) {
+    std::transform(text.begin(), text.end(), text.begin(), ::toupper);
+    return text;
+}
+
+static bool parseInt(const std::string& text, long long& out) {
+    auto res = std::from_chars(text.data(), text.data() + text.size(), out);
+    return res.ec == std::errc{} && res.ptr == text.data() + text.size();
+}
+
+// Decimal digits of the largest uint64_t.
+static constexpr size_t UINT64_DIGITS = 20;
+
+static void appendUint(std::string& out, uint64_t v) {
+    char buf[24];
+    auto res = std::to_chars(buf, buf + sizeof(buf), v);
+    out.append(buf, res.ptr);
+}
+
+static void appendBulk(std::string& out, std::string_view value) {
+    out += '$';
+    appendUint(out, value.size());
+    out += "\r\n";
+    out += value;
+    out += "\r\n";
+}
+
+static void appendIdBulk(std::string& out, StreamId id) {
+    // "<ms>-<seq>"; the ms part is bounded so the dash always fits.
+    char text[2 * UINT64_DIGITS + 1];
+    auto ms = std::to_chars(text, text + UINT64_DIGITS, id.ms);
+    if (ms.ec != std::errc{}) {
+        appendBulk(out, id.toString());
+        return;
+    }
+    *ms.ptr = '-';
+    auto seq = std::to_chars(ms.ptr + 1, text + sizeof(text), id.seq);
+    if (seq.ec != std::errc{}) {
+        appendBulk(out, id.toString());
+        return;
+    }
+    appendBulk(out, std::string_view(text, seq.ptr - text));
+}
+
+static void appendEntry(std::string& out, const StreamEntry& entry) {
+    out += "*2\r\n";
+    appendIdBulk(out, entry.id);
+    out += '*';
+    appendUint(out, entry.fields.size() * 2);
+    out += "\r\n";
+    for (const auto& [field, value] : entry.fields) {
+        appendBulk(out, field);
+        appendBulk(out, value);
+    }
+}
+
+// Array replies whose length is only known once the body is written keep room for the
+// header at the front of the buffer, so the body never has to be copied behind it.
+// "*<count>\r\n" at its longest.
+static constexpr size_t ARRAY_HEADER_ROOM = 1 + UINT64_DIGITS + 2;
+
+static std::string_view finishArray(std::string& reply, size_t count) {
+    char header[ARRAY_HEADER_ROOM];
+    header[0] = '*';
+    auto res = std::to_chars(header + 1, header + 1 + UINT64_DIGITS, count);
+    if (res.ec != std::errc{}) throw std::length_error("array reply too long");
+    char* p = res.ptr;
+    *p++ = '\r';
+    *p++ = '\n';
+    size_t len = p - header;
+    std::copy(header, p, reply.begin() + (ARRAY_HEADER_ROOM - len));
+    return std::string_view(reply).substr(ARRAY_HEADER_ROOM - len);
+}
+
+struct TrimOptions {
+    bool enabled = false;
+    bool by_minid = false;
+    bool approx = false;
+    size_t maxlen = 0;
+    StreamId minid;
+    size_t limit = 0;
+};
+
+// Parses "MAXLEN|MINID [=|~] threshold [LIMIT count]" at tokens[idx], leaving idx on the
+// last token consumed. Returns an error reply, or an empty string on success.
+static std::string parseTrimOptions(const std::vector<std::string>& tokens, size_t& idx, TrimOptions& trim) {
+    trim.enabled = true;
+    trim.by_minid = upper(tokens[idx]) == "MINID";
+    if (idx + 1 < tokens.size() && (tokens[idx + 1] == "~" || tokens[idx + 1] == "=")) {
+        trim.approx = tokens[++idx] == "~";
+    }
+    if (++idx >= tokens.size()) return "-ERR syntax error\r\n";
+
+    if (trim.by_minid) {
+        auto id = StreamId::parse(tokens[idx], 0);
+        if (!id) return "-ERR Invalid stream ID specified as stream command argument\r\n";
+        trim.minid = *id;
+    } else {
+        long long n = 0;
+        if (!parseInt(tokens[idx], n) || n < 0) return "-ERR The MAXLEN argument must be >= 0.\r\n";
+        trim.maxlen = static_cast<size_t>(n);
+    }
+
+    // Approximate trims are bounded by default, as in Redis, so one call never frees too much.
+    if (trim.approx) trim.limit = 100 * Stream::NODE_MAX_ENTRIES;
+    if (idx + 1 < tokens.size() && upper(tokens[idx + 1]) == "LIMIT") {
+        long long n = 0;
+        if (idx + 2 >= tokens.size() || !parseInt(tokens[idx + 2], n) || n < 0)
+            return "-ERR The LIMIT argument must be >= 0.\r\n";
+        if (!trim.approx) return "-ERR syntax error, LIMIT cannot be used without the special ~ option\r\n";
+        trim.limit = static_cast<size_t>(n);
+        idx += 2;
+    }
+    return "";
+}
+
+static size_t applyTrim(Stream& stream, const TrimOptions& trim) {
+    if (!trim.enabled) return 0;
+    if (trim.by_minid) return stream.trimMinId(trim.minid, trim.approx, trim.limit);
+    return stream.trimMaxLen(trim.maxlen, trim.approx, trim.limit);
+}
+
 void StreamStoreHandler::handleXadd(const std::vector<std::string>& tokens) {
-    if (tokens.size() < 3 || tokens.size() % 2 != 0) {
+    bool nomkstream = false;
+    TrimOptions trim;
+    size_t idx = 1;
+    for (; idx < tokens.size(); ++idx) {
+        std::string option = upper(tokens[idx]);
+        if (option == "NOMKSTREAM") {
+            nomkstream = true;
+        } else if (option == "MAXLEN" || option == "MINID") {
+            std::string error = parseTrimOptions(tokens, idx, trim);
+            if (!error.empty()) { sendResponse(error); return; }
+        } else {
+            break;
+        }
+    }
+
+    if (idx + 3 > tokens.size() || (tokens.size() - idx) % 2 != 1) {
         sendResponse("-ERR XADD requires a key, ID, and field-value pairs\r\n");
         return;
     }
 
     const std::string& key = tokens[0];
-    const std::string& id = tokens[1];
-    std::string timePart, seqPart;
+    const std::string& id = tokens[idx];
 
-    if(id == "*") {
-        timePart = "*"; seqPart = "*";
-    } else {
+    // Explicit IDs are "ms-seq" or "ms-*"; "*" generates both parts.
+    bool autoMs = id == "*";
+    bool autoSeq = autoMs;
+    StreamId requested;
+    if (!autoMs) {
         size_t dash = id.find('-');
-        if(dash == std::string::npos) { sendResponse("-ERR Invalid ID format\r\n"); return; }
-        timePart = id.substr(0, dash);
-        seqPart = id.substr(dash + 1);
+        if (dash == std::string::npos) { sendResponse("-ERR Invalid ID format\r\n"); return; }
+        autoSeq = id.compare(dash + 1, std::string::npos, "*") == 0;
+        auto parsed = StreamId::parse(autoSeq ? id.substr(0, dash) : id, 0);
+        if (!parsed) { sendResponse("-ERR Invalid stream ID specified as stream command argument\r\n"); return; }
+        requested = *parsed;
     }
 
-    int64_t ms, seq;
-    std::string final_id;
+    std::vector<std::pair<std::string, std::string>> fields;
+    fields.reserve((tokens.size() - idx) / 2);
+    for (size_t i = idx + 1; i < tokens.size(); i += 2)
+        fields.emplace_back(tokens[i], tokens[i + 1]);
+
+    StreamId final_id;
     {
-        std::lock_guard<std::mutex> lock(store_mutex);
+        StoreLock lock(store_mutex);
+        if (nomkstream && stream_store.find(key) == stream_store.end()) {
+            sendResponse("$-1\r\n");
+            return;
+        }
         auto& stream = stream_store[key];
-        int64_t current_ms = getCurrentTimeMs();
-
-        if(timePart == "*") ms = current_ms; else ms = std::stoll(timePart);
-        if(seqPart == "*") {
-            seq = 0;
-            if (!stream.empty()) {
-                size_t last_dash = stream.back().first.find('-');
-                int64_t last_ms = std::stoll(stream.back().first.substr(0, last_dash));
-                int64_t last_seq = std::stoll(stream.back().first.substr(last_dash + 1));
-                if (last_ms == ms) seq = last_seq + 1;
-            }
-            if (ms == 0) seq = 1;
-        } else seq = std::stoll(seqPart);
-
-        if (ms == 0 && seq == 0) { sendResponse("-ERR The ID specified in XADD must be greater than 0-0\r\n"); return; }
+        // lastId() survives deletions, so IDs never go backwards even after XDEL or XTRIM.
+        StreamId last = stream.lastId();
 
-        if (!stream.empty()) {
-            size_t last_dash = stream.back().first.find('-');
-            int64_t last_ms = std::stoll(stream.back().first.substr(0, last_dash));
-            int64_t last_seq = std::stoll(stream.back().first.substr(last_dash + 1));
-            if (ms < last_ms || (ms == last_ms && seq <= last_seq)) {
-                sendResponse("-ERR The ID specified in XADD is equal or smaller than the target stream top item\r\n");
-                return;
-            }
+        if (autoMs) {
+            final_id.ms = std::max<uint64_t>(getCurrentTimeMs(), last.ms);
+            final_id.seq = final_id.ms == last.ms ? last.seq + 1 : 0;
+        } else if (autoSeq) {
+            final_id.ms = requested.ms;
+            final_id.seq = final_id.ms == last.ms ? last.seq + 1 : 0;
+        } else {
+            final_id = requested;
         }
 
-        std::unordered_map<std::string, std::string> fields;
-        for (size_t i = 2; i < tokens.size(); i += 2)
-            fields[tokens[i]] = tokens[i+1];
+        if (final_id == StreamId::min()) { sendResponse("-ERR The ID specified in XADD must be greater than 0-0\r\n"); return; }
+
+        if (final_id <= last) {
+            sendResponse("-ERR The ID specified in XADD is equal or smaller than the target stream top item\r\n");
+            return;
+        }
 
-        final_id = std::to_string(ms) + "-" + std::to_string(seq);
-        stream.push_back({final_id, fields});
+        stream.append(final_id, std::move(fields));
+        applyTrim(stream, trim);
+        KeyWatch::touch(key);
+        // A replay must add the entry under the ID it got now, not generate a new one.
+        if (autoSeq) Propagation::rewriteArgument(idx, final_id.toString());
 
         stream_cvs[key].notify_all();
         global_cv.notify_all();
-    } 
-    sendResponse("$" + std::to_string(final_id.size()) + "\r\n" + final_id + "\r\n");
+    }
+    std::string id_str = final_id.toString();
+    sendResponse("$" + std::to_string(id_str.size()) + "\r\n" + id_str + "\r\n");
 }
 
-void StreamStoreHandler::handleXrange(const std::vector<std::string>& tokens) {
-    if (tokens.size() < 3) { sendResponse("-ERR XRANGE requires key, start, end\r\n"); return; }
+// Range bounds accept "-" and "+", plain or "ms-seq" IDs, and "(" for an exclusive bound.
+static std::optional<StreamId> parseRangeBound(const std::string& token, bool isStart, bool& emptyRange) {
+    if (token == "-") return StreamId::min();
+    if (token == "+") return StreamId::max();
+
+    bool exclusive = !token.empty() && token[0] == '(';
+    auto id = StreamId::parse(std::string_view(token).substr(exclusive), isStart ? 0 : UINT64_MAX);
+    if (!id || !exclusive) return id;
+
+    if (isStart) {
+        if (*id == StreamId::max()) emptyRange = true;
+        return id->next();
+    }
+    if (*id == StreamId::min()) emptyRange = true;
+    return id->prev();
+}
+
+void StreamStoreHandler::handleXrange(const std::vector<std::string>& tokens, bool reverse) {
+    const char* name = reverse ? "XREVRANGE" : "XRANGE";
+    if (tokens.size() != 3 && tokens.size() != 5) {
+        sendResponse(std::string("-ERR ") + name + " requires key, " + (reverse ? "end, start" : "start, end") + " [COUNT count]\r\n");
+        return;
+    }
 
     const std::string& key = tokens[0];
-    std::string start_id = tokens[1], end_id = tokens[2];
+    bool emptyRange = false;
+    auto start = parseRangeBound(tokens[reverse ? 2 : 1], true, emptyRange);
+    auto end = parseRangeBound(tokens[reverse ? 1 : 2], false, emptyRange);
+    if (!start || !end) {
+        sendResponse("-ERR Invalid stream ID specified as stream command argument\r\n");
+        return;
+    }
 
-    std::lock_guard<std::mutex> lock(store_mutex);
-    auto it = stream_store.find(key);
-    if (it == stream_store.end() || it->second.empty()) { sendResponse("*0\r\n"); return; }
-    auto& stream = it->second;
+    size_t limit = SIZE_MAX;
+    if (tokens.size() == 5) {
+        std::string option = tokens[3];
+        std::transform(option.begin(), option.end(), option.begin(), ::toupper);
+        if (option != "COUNT") { sendResponse("-ERR syntax error\r\n"); return; }
+        long long n = 0;
+        if (!parseInt(tokens[4], n)) { sendResponse("-ERR value is not an integer or out of range\r\n"); return; }
+        limit = n < 0 ? 0 : static_cast<size_t>(n);
+    }
 
-    auto parse_id = [](const std::string& id, int64_t& ms, int64_t& seq, bool is_start) {
-        size_t dash = id.find('-');
-        if (dash == std::string::npos) { ms = std::stoll(id); seq = is_start ? 0 : INT64_MAX; }
-        else { ms = std::stoll(id.substr(0, dash)); seq = std::stoll(id.substr(dash + 1)); }
-    };
+    std::string reply(ARRAY_HEADER_ROOM, '\0');
+    size_t count = 0;
+    {
+        StoreLock lock(store_mutex);
+        auto it = stream_store.find(key);
+        if (it != stream_store.end() && !emptyRange && limit > 0) {
+            auto visit = [&](const StreamEntry& entry) {
+                appendEntry(reply, entry);
+                return ++count < limit;
+            };
+            if (reverse) it->second.revrange(*start, *end, visit);
+            else it->second.range(*start, *end, visit);
+        }
+    }
+    sendResponse(finishArray(reply, count));
+}
+
+void StreamStoreHandler::handleXlen(const std::vector<std::string>& tokens) {
+    if (tokens.size() != 1) { sendResponse("-ERR XLEN requires a key\r\n"); return; }
+
+    size_t length = 0;
+    {
+        StoreLock lock(store_mutex);
+        auto it = stream_store.find(tokens[0]);
+        if (it != stream_store.end()) length = it->second.size();
+    }
+    sendResponse(":" + std::to_string(length) + "\r\n");
+}
+
+void StreamStoreHandler::handleXtrim(const std::vector<std::string>& tokens) {
+    if (tokens.size() < 3) { sendResponse("-ERR XTRIM requires key, strategy and threshold\r\n"); return; }
+
+    std::string strategy = upper(tokens[1]);
+    if (strategy != "MAXLEN" && strategy != "MINID") { sendResponse("-ERR syntax error\r\n"); return; }
+    TrimOptions trim;
+    size_t idx = 1;
+    std::string error = parseTrimOptions(tokens, idx, trim);
+    if (!error.empty()) { sendResponse(error); return; }
+    if (idx + 1 != tokens.size()) { sendResponse("-ERR syntax error\r\n"); return; }
+
+    size_t removed = 0;
+    {
+        StoreLock lock(store_mutex);
+        auto it = stream_store.find(tokens[0]);
+        if (it != stream_store.end()) removed = applyTrim(it->second, trim);
+        if (removed > 0) KeyWatch::touch(tokens[0]);
+    }
+    sendResponse(":" + std::to_string(removed) + "\r\n");
+}
+
+void StreamStoreHandler::handleXdel(const std::vector<std::string>& tokens) {
+    if (tokens.size() < 2) { sendResponse("-ERR XDEL requires a key and at least one ID\r\n"); return; }
+
+    std::vector<StreamId> ids;
+    for (size_t i = 1; i < tokens.size(); ++i) {
+        auto id = StreamId::parse(tokens[i], 0);
+        if (!id) { sendResponse("-ERR Invalid stream ID specified as stream command argument\r\n"); return; }
+        ids.push_back(*id);
+    }
 
-    int64_t start_ms, start_seq, end_ms, end_seq;
-    if (start_id == "-") { start_ms = 0; start_seq = 0; } else parse_id(start_id, start_ms, start_seq, true);
-    if (end_id == "+") { end_ms = INT64_MAX; end_seq = INT64_MAX; } else parse_id(end_id, end_ms, end_seq, false);
-
-    std::vector<std::pair<std::string, std::unordered_map<std::string,std::string>>> result;
-    for (auto& entry : stream) {
-        size_t dash = entry.first.find('-');
-        int64_t ms = std::stoll(entry.first.substr(0, dash));
-        int64_t seq = std::stoll(entry.first.substr(dash + 1));
-        if ((ms > start_ms || (ms == start_ms && seq >= start_seq)) &&
-            (ms < end_ms || (ms == end_ms && seq <= end_seq)))
-            result.push_back(entry);
-    }
-
-    std::string response = "*" + std::to_string(result.size()) + "\r\n";
-    for (auto& entry : result) {
-        response += "*2\r\n$" + std::to_string(entry.first.size()) + "\r\n" + entry.first + "\r\n";
-        response += "*" + std::to_string(entry.second.size() * 2) + "\r\n";
-        for (auto& kv : entry.second) {
-            response += "$" + std::to_string(kv.first.size()) + "\r\n" + kv.first + "\r\n";
-            response += "$" + std::to_string(kv.second.size()) + "\r\n" + kv.second + "\r\n";
+    size_t removed = 0;
+    {
+        StoreLock lock(store_mutex);
+        auto it = stream_store.find(tokens[0]);
+        if (it != stream_store.end()) {
+            for (StreamId id : ids) removed += it->second.remove(id);
+            if (removed > 0) KeyWatch::touch(tokens[0]);
         }
     }
-    sendResponse(response);
+    sendResponse(":" + std::to_string(removed) + "\r\n");
 }
 
 void StreamStoreHandler::handleXread(const std::vector<std::string>& tokens) {
@@ -147,14 +382,15 @@ void StreamStoreHandler::handleXread(const std::vector<std::string>& tokens) {
         return;
     }
 
-    int64_t block_ms = 0;
+    int64_t block_ms = -1;
     size_t idx = 0;
 
     while(idx < tokens.size() && tokens[idx] != "streams") {
         if((tokens[idx] == "BLOCK" || tokens[idx] == "block") && idx + 1 < tokens.size()) {
-            try {
-                block_ms = std::stoll(tokens[idx + 1]);
-            } catch (...) { sendResponse("-ERR invalid BLOCK value\r\n"); return; }
+            long long n = 0;
+            if (!parseInt(tokens[idx + 1], n)) { sendResponse("-ERR value is not an integer or out of range\r\n"); return; }
+            if (n < 0) { sendResponse("-ERR timeout is negative\r\n"); return; }
+            block_ms = n;
             idx += 2;
         } else {
             idx++;
@@ -181,125 +417,731 @@ void StreamStoreHandler::handleXread(const std::vector<std::string>& tokens) {
         return;
     }
 
-    std::unique_lock<std::mutex> lock(store_mutex);
+    StoreLock lock(store_mutex);
 
-    std::vector<int64_t> last_ms(keys.size(), 0), last_seq(keys.size(), -1);
+    std::vector<StreamId> last_ids(keys.size());
     for (size_t i = 0; i < ids.size(); ++i) {
-        const std::string &last_id = ids[i];
-        if (last_id == "$") {
+        if (ids[i] == "$") {
             auto it = stream_store.find(keys[i]);
-            if (it != stream_store.end() && !it->second.empty()) {
-                const auto &last_entry = it->second.back().first;
-                size_t dash = last_entry.find('-');
-                last_ms[i] = std::stoll(last_entry.substr(0, dash));
-                last_seq[i] = std::stoll(last_entry.substr(dash + 1));
+            if (it != stream_store.end()) last_ids[i] = it->second.lastId();
+        } else {
+            auto parsed = StreamId::parse(ids[i], 0);
+            if (!parsed) {
+                lock.unlock();
+                sendResponse("-ERR Invalid stream ID specified as stream command argument\r\n");
+                return;
+            }
+            last_ids[i] = *parsed;
+        }
+    }
+
+    auto has_new_entries = [&]() -> bool {
+        for (size_t i = 0; i < keys.size(); ++i) {
+            auto it = stream_store.find(keys[i]);
+            if (it != stream_store.end() && !it->second.empty() && it->second.lastId() > last_ids[i]) return true;
+        }
+        return false;
+    };
+
+    if (block_ms > 0 && lock.canBlock()) {
+        global_cv.wait_for(lock.unique(), std::chrono::milliseconds(block_ms), has_new_entries);
+    } else if (block_ms == 0 && lock.canBlock()) {
+        global_cv.wait(lock.unique(), has_new_entries);
+    }
+
+    std::string response;
+    size_t streams_with_entries = 0;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        auto it = stream_store.find(keys[i]);
+        if (it == stream_store.end() || last_ids[i] == StreamId::max()) continue;
+
+        size_t count = 0;
+        std::string entries;
+        it->second.range(last_ids[i].next(), StreamId::max(), [&](const StreamEntry& entry) {
+            appendEntry(entries, entry);
+            count++;
+            return true;
+        });
+        if (count == 0) continue;
+
+        streams_with_entries++;
+        response += "*2\r\n";
+        response += "$" + std::to_string(keys[i].size()) + "\r\n" + keys[i] + "\r\n";
+        response += "*" + std::to_string(count) + "\r\n" + entries;
+    }
+
+    lock.unlock();
+    if (streams_with_entries == 0) {
+        sendResponse("*-1\r\n");
+    } else {
+        sendResponse("*" + std::to_string(streams_with_entries) + "\r\n" + response);
+    }
+}
+
+static std::string noGroupError(const std::string& key, const std::string& group) {
+    return "-NOGROUP No such key '" + key + "' or consumer group '" + group + "'\r\n";
+}
+
+// Appends the stored entry with this ID, returning false if it is no longer in the stream.
+static bool appendStoredEntry(std::string& out, const Stream& stream, StreamId id) {
+    bool found = false;
+    stream.range(id, id, [&](const StreamEntry& entry) {
+        appendEntry(out, entry);
+        found = true;
+        return false;
+    });
+    return found;
+}
+
+ConsumerGroup* StreamStoreHandler::findGroup(const std::string& key, const std::string& group) {
+    auto it = stream_store.find(key);
+    if (it == stream_store.end()) return nullptr;
+    auto g = it->second.groups().find(group);
+    return g == it->second.groups().end() ? nullptr : &g->second;
+}
+
+void StreamStoreHandler::handleXgroup(const std::vector<std::string>& tokens) {
+    std::string sub = tokens.empty() ? "" : upper(tokens[0]);
+    bool known = sub == "CREATE" || sub == "SETID" || sub == "DESTROY" || sub == "CREATECONSUMER" || sub == "DELCONSUMER";
+    size_t arity = sub == "DESTROY" ? 3 : 4;
+    if (!known || tokens.size() < arity || tokens.size() > arity + (sub == "CREATE")) {
+        sendResponse("-ERR XGROUP syntax error\r\n");
+        return;
+    }
+
+    const std::string& key = tokens[1];
+    const std::string& name = tokens[2];
+    bool mkstream = false;
+    if (tokens.size() == 5) {
+        if (upper(tokens[4]) != "MKSTREAM") { sendResponse("-ERR XGROUP syntax error\r\n"); return; }
+        mkstream = true;
+    }
+
+    std::optional<StreamId> id;
+    if ((sub == "CREATE" || sub == "SETID") && tokens[3] != "$") {
+        id = StreamId::parse(tokens[3], 0);
+        if (!id) { sendResponse("-ERR Invalid stream ID specified as stream command argument\r\n"); return; }
+    }
+
+    std::string reply;
+    {
+        StoreLock lock(store_mutex);
+        auto it = stream_store.find(key);
+        if (it == stream_store.end() && !(sub == "CREATE" && mkstream)) {
+            sendResponse("-ERR The XGROUP subcommand requires the key to exist. "
+                         "Note that for CREATE you may want to use the MKSTREAM option to create an empty stream automatically.\r\n");
+            return;
+        }
+        if (it == stream_store.end()) KeyWatch::touch(key);
+        Stream& stream = it == stream_store.end() ? stream_store[key] : it->second;
+        auto& groups = stream.groups();
+        auto group = groups.find(name);
+
+        if (sub == "CREATE") {
+            if (group != groups.end()) { sendResponse("-BUSYGROUP Consumer Group name already exists\r\n"); return; }
+            groups[name].last_delivered = id ? *id : stream.lastId();
+            reply = "+OK\r\n";
+        } else if (group == groups.end()) {
+            if (sub == "DESTROY") {
+                reply = ":0\r\n";
             } else {
-                last_ms[i] = 0;
-                last_seq[i] = 0;
+                sendResponse(noGroupError(key, name));
+                return;
             }
+        } else if (sub == "SETID") {
+            group->second.last_delivered = id ? *id : stream.lastId();
+            reply = "+OK\r\n";
+        } else if (sub == "DESTROY") {
+            groups.erase(group);
+            // Wake readers blocked on the group so they can report it is gone.
+            global_cv.notify_all();
+            reply = ":1\r\n";
+        } else if (sub == "CREATECONSUMER") {
+            bool created = group->second.consumers.count(tokens[3]) == 0;
+            if (created) group->second.consumer(tokens[3], getCurrentTimeMs());
+            reply = created ? ":1\r\n" : ":0\r\n";
         } else {
-            size_t dash = last_id.find('-');
-            if (dash != std::string::npos) {
-                last_ms[i] = std::stoll(last_id.substr(0, dash));
-                last_seq[i] = std::stoll(last_id.substr(dash + 1));
+            reply = ":" + std::to_string(group->second.removeConsumer(tokens[3])) + "\r\n";
+        }
+    }
+    sendResponse(reply);
+}
+
+// An XCLAIM that gives id to consumer with exactly entry's delivery time and count, whatever
+// the idle time at replay.
+static Propagation::Command claimEffect(const std::string& key, const std::string& group, const std::string& consumer, StreamId id, const PendingEntry& entry) {
+    return {"XCLAIM", key, group, consumer, "0", id.toString(),
+            "TIME", std::to_string(entry.delivery_time), "RETRYCOUNT", std::to_string(entry.delivery_count), "FORCE", "JUSTID"};
+}
+
+void StreamStoreHandler::handleXreadgroup(const std::vector<std::string>& tokens) {
+    if (tokens.size() < 6 || upper(tokens[0]) != "GROUP") {
+        sendResponse("-ERR XREADGROUP syntax error\r\n");
+        return;
+    }
+    const std::string& group_name = tokens[1];
+    const std::string& consumer = tokens[2];
+
+    size_t limit = SIZE_MAX;
+    int64_t block_ms = -1;
+    bool noack = false;
+    size_t idx = 3;
+    for (; idx < tokens.size(); ++idx) {
+        std::string option = upper(tokens[idx]);
+        if (option == "STREAMS") break;
+        long long n = 0;
+        if ((option == "COUNT" || option == "BLOCK") && idx + 1 < tokens.size()) {
+            if (!parseInt(tokens[++idx], n)) { sendResponse("-ERR value is not an integer or out of range\r\n"); return; }
+            if (option == "COUNT") {
+                limit = n <= 0 ? SIZE_MAX : static_cast<size_t>(n);
             } else {
-                last_ms[i] = std::stoll(last_id);
-                last_seq[i] = -1;
+                if (n < 0) { sendResponse("-ERR timeout is negative\r\n"); return; }
+                block_ms = n;
             }
+        } else if (option == "NOACK") {
+            noack = true;
+        } else {
+            sendResponse("-ERR XREADGROUP syntax error\r\n");
+            return;
         }
     }
+    idx++;
+    if (idx >= tokens.size() || (tokens.size() - idx) % 2 != 0) {
+        sendResponse("-ERR Unbalanced 'xreadgroup' list of streams: for each stream key an ID or '>' must be specified.\r\n");
+        return;
+    }
 
-    auto collect = [&]() {
-        std::vector<std::vector<std::pair<std::string,std::unordered_map<std::string,std::string>>>> out(keys.size());
-        for (size_t i = 0; i < keys.size(); ++i) {
-            const std::string &key = keys[i];
-            auto it = stream_store.find(key);
-            if (it == stream_store.end() || it->second.empty()) continue;
-            auto &stream = it->second;
-            for (auto &entry : stream) {
-                size_t e_dash = entry.first.find('-');
-                int64_t ms = std::stoll(entry.first.substr(0, e_dash));
-                int64_t seq = std::stoll(entry.first.substr(e_dash + 1));
-                if ((ms > last_ms[i]) || (ms == last_ms[i] && seq > last_seq[i])) {
-                    out[i].push_back(entry);
+    size_t n = (tokens.size() - idx) / 2;
+    std::vector<std::string> keys(tokens.begin() + idx, tokens.begin() + idx + n);
+    // nullopt stands for ">", new entries never delivered to the group.
+    std::vector<std::optional<StreamId>> ids(n);
+    bool only_new = true;
+    for (size_t i = 0; i < n; ++i) {
+        const std::string& text = tokens[idx + n + i];
+        if (text == ">") continue;
+        ids[i] = StreamId::parse(text, 0);
+        if (!ids[i]) { sendResponse("-ERR Invalid stream ID specified as stream command argument\r\n"); return; }
+        only_new = false;
+    }
+
+    StoreLock lock(store_mutex);
+    for (const auto& key : keys) {
+        if (!findGroup(key, group_name)) {
+            lock.unlock();
+            sendResponse("-NOGROUP No such key '" + key + "' or consumer group '" + group_name + "' in XREADGROUP with GROUP option\r\n");
+            return;
+        }
+    }
+
+    // Only reads of new entries block; reads of the consumer's own history answer at once.
+    auto ready = [&]() -> bool {
+        for (const auto& key : keys) {
+            ConsumerGroup* group = findGroup(key, group_name);
+            if (!group || stream_store[key].lastId() > group->last_delivered) return true;
+        }
+        return false;
+    };
+    if (only_new && block_ms > 0 && lock.canBlock()) {
+        global_cv.wait_for(lock.unique(), std::chrono::milliseconds(block_ms), ready);
+    } else if (only_new && block_ms == 0 && lock.canBlock()) {
+        global_cv.wait(lock.unique(), ready);
+    }
+
+    int64_t now = getCurrentTimeMs();
+    std::string response;
+    size_t streams_in_reply = 0;
+    // Replaying the read would deliver at replay time and could block, so what it delivered
+    // is logged instead.
+    std::vector<Propagation::Command> effects;
+    for (size_t i = 0; i < n; ++i) {
+        ConsumerGroup* group = findGroup(keys[i], group_name);
+        if (!group) {
+            lock.unlock();
+            Propagation::replace({});
+            sendResponse("-UNBLOCKED the stream key no longer exists or the consumer group was destroyed\r\n");
+            return;
+        }
+        Stream& stream = stream_store[keys[i]];
+        bool new_consumer = group->consumers.count(consumer) == 0;
+        Consumer& owner = group->consumer(consumer, now);
+        size_t first_effect = effects.size();
+
+        size_t count = 0;
+        std::string entries;
+        if (!ids[i]) {
+            if (group->last_delivered == StreamId::max()) continue;
+            stream.range(group->last_delivered.next(), StreamId::max(), [&](const StreamEntry& entry) {
+                appendEntry(entries, entry);
+                group->last_delivered = entry.id;
+                if (!noack) {
+                    PendingEntry& pending = group->assign(entry.id, consumer, now);
+                    pending.delivery_count = 1;
+                    effects.push_back(claimEffect(keys[i], group_name, consumer, entry.id, pending));
                 }
+                return ++count < limit;
+            });
+            if (count > 0) effects.push_back({"XGROUP", "SETID", keys[i], group_name, group->last_delivered.toString()});
+        } else {
+            for (auto it = owner.pending.upper_bound(*ids[i]); it != owner.pending.end() && count < limit; ++it, ++count) {
+                if (!appendStoredEntry(entries, stream, *it)) {
+                    entries += "*2\r\n";
+                    appendIdBulk(entries, *it);
+                    entries += "*-1\r\n";
+                    continue;
+                }
+                // Re-reading history is another delivery, as in Redis.
+                PendingEntry& pending = group->assign(*it, consumer, now);
+                pending.delivery_count++;
+                effects.push_back(claimEffect(keys[i], group_name, consumer, *it, pending));
             }
         }
-        return out;
-    };
+        // Creating the consumer is only logged along with a delivery.
+        if (new_consumer && effects.size() > first_effect) {
+            effects.insert(effects.begin() + first_effect, Propagation::Command{"XGROUP", "CREATECONSUMER", keys[i], group_name, consumer});
+        }
+        if (!ids[i] && count == 0) continue;
 
-    auto all_results = collect();
-
-    if (block_ms > 0) {
-        bool awakened_by_data = global_cv.wait_for(lock, std::chrono::milliseconds(block_ms), [&]() -> bool {
-            for (size_t i = 0; i < keys.size(); ++i) {
-                auto it = stream_store.find(keys[i]);
-                if (it == stream_store.end()) continue;
-                auto &stream = it->second;
-                if (stream.empty()) continue;
-                size_t e_dash = stream.back().first.find('-');
-                int64_t ms = std::stoll(stream.back().first.substr(0, e_dash));
-                int64_t seq = std::stoll(stream.back().first.substr(e_dash + 1));
-                if ((ms > last_ms[i]) || (ms == last_ms[i] && seq > last_seq[i])) return true;
+        streams_in_reply++;
+        response += "*2\r\n";
+        appendBulk(response, keys[i]);
+        response += "*" + std::to_string(count) + "\r\n" + entries;
+    }
+
+    Propagation::replace(std::move(effects));
+    lock.unlock();
+    if (streams_in_reply == 0) {
+        sendResponse("*-1\r\n");
+    } else {
+        sendResponse("*" + std::to_string(streams_in_reply) + "\r\n" + response);
+    }
+}
+
+void StreamStoreHandler::handleXack(const std::vector<std::string>& tokens) {
+    if (tokens.size() < 3) { sendResponse("-ERR XACK requires key, group and at least one ID\r\n"); return; }
+
+    std::vector<StreamId> ids;
+    for (size_t i = 2; i < tokens.size(); ++i) {
+        auto id = StreamId::parse(tokens[i], 0);
+        if (!id) { sendResponse("-ERR Invalid stream ID specified as stream command argument\r\n"); return; }
+        ids.push_back(*id);
+    }
+
+    size_t acked = 0;
+    {
+        StoreLock lock(store_mutex);
+        ConsumerGroup* group = findGroup(tokens[0], tokens[1]);
+        if (group) {
+            for (StreamId id : ids) acked += group->ack(id);
+        }
+    }
+    sendResponse(":" + std::to_string(acked) + "\r\n");
+}
+
+void StreamStoreHandler::handleXpending(const std::vector<std::string>& tokens) {
+    if (tokens.size() < 2) { sendResponse("-ERR XPENDING requires key and group\r\n"); return; }
+    const std::string& key = tokens[0];
+    const std::string& group_name = tokens[1];
+
+    // Extended form: [IDLE min-idle-time] start end count [consumer]
+    bool extended = tokens.size() > 2;
+    int64_t min_idle = 0;
+    size_t idx = 2;
+    if (extended && upper(tokens[idx]) == "IDLE") {
+        long long n = 0;
+        if (idx + 1 >= tokens.size() || !parseInt(tokens[idx + 1], n)) {
+            sendResponse("-ERR value is not an integer or out of range\r\n");
+            return;
+        }
+        min_idle = n;
+        idx += 2;
+    }
+    bool emptyRange = false;
+    std::optional<StreamId> start, end;
+    long long limit = 0;
+    if (extended) {
+        if (tokens.size() - idx != 3 && tokens.size() - idx != 4) { sendResponse("-ERR syntax error\r\n"); return; }
+        start = parseRangeBound(tokens[idx], true, emptyRange);
+        end = parseRangeBound(tokens[idx + 1], false, emptyRange);
+        if (!start || !end) { sendResponse("-ERR Invalid stream ID specified as stream command argument\r\n"); return; }
+        if (!parseInt(tokens[idx + 2], limit)) { sendResponse("-ERR value is not an integer or out of range\r\n"); return; }
+    }
+    const std::string* consumer = extended && tokens.size() - idx == 4 ? &tokens[idx + 3] : nullptr;
+
+    std::string reply;
+    {
+        StoreLock lock(store_mutex);
+        ConsumerGroup* group = findGroup(key, group_name);
+        if (!group) { sendResponse(noGroupError(key, group_name)); return; }
+
+        if (!extended) {
+            if (group->pel.empty()) {
+                reply = "*4\r\n:0\r\n$-1\r\n$-1\r\n*-1\r\n";
+            } else {
+                reply = "*4\r\n:" + std::to_string(group->pel.size()) + "\r\n";
+                appendIdBulk(reply, group->pel.begin()->first);
+                appendIdBulk(reply, group->pel.rbegin()->first);
+                std::string owners;
+                size_t owner_count = 0;
+                for (const auto& [name, c] : group->consumers) {
+                    if (c.pending.empty()) continue;
+                    owners += "*2\r\n";
+                    appendBulk(owners, name);
+                    appendBulk(owners, std::to_string(c.pending.size()));
+                    owner_count++;
+                }
+                reply += "*" + std::to_string(owner_count) + "\r\n" + owners;
             }
-            return false;
-        });
-        all_results = collect();
-
-    } else if (block_ms == 0) {
-        global_cv.wait(lock, [&]() -> bool {
-            for (size_t i = 0; i < keys.size(); ++i) {
-                auto it = stream_store.find(keys[i]);
-                if (it == stream_store.end()) continue;
-                auto &stream = it->second;
-                if (stream.empty()) continue;
-                size_t e_dash = stream.back().first.find('-');
-                int64_t ms = std::stoll(stream.back().first.substr(0, e_dash));
-                int64_t seq = std::stoll(stream.back().first.substr(e_dash + 1));
-                if ((ms > last_ms[i]) || (ms == last_ms[i] && seq > last_seq[i])) return true;
+        } else {
+            int64_t now = getCurrentTimeMs();
+            reply.assign(ARRAY_HEADER_ROOM, '\0');
+            size_t count = 0;
+            auto visit = [&](StreamId id, const PendingEntry& entry) {
+                int64_t idle = now - entry.delivery_time;
+                if (idle < min_idle) return;
+                reply += "*4\r\n";
+                appendIdBulk(reply, id);
+                appendBulk(reply, entry.consumer);
+                reply += ":" + std::to_string(idle) + "\r\n:" + std::to_string(entry.delivery_count) + "\r\n";
+                count++;
+            };
+            if (!emptyRange && limit > 0 && *start <= *end) {
+                if (consumer) {
+                    auto owner = group->consumers.find(*consumer);
+                    if (owner != group->consumers.end()) {
+                        const auto& pending = owner->second.pending;
+                        for (auto it = pending.lower_bound(*start); it != pending.end() && *it <= *end && count < static_cast<size_t>(limit); ++it)
+                            visit(*it, group->pel.at(*it));
+                    }
+                } else {
+                    for (auto it = group->pel.lower_bound(*start); it != group->pel.end() && it->first <= *end && count < static_cast<size_t>(limit); ++it)
+                        visit(it->first, it->second);
+                }
             }
-            return false;
-        });
+            reply = std::string(finishArray(reply, count));
+        }
+    }
+    sendResponse(reply);
+}
+
+void StreamStoreHandler::handleXclaim(const std::vector<std::string>& tokens) {
+    if (tokens.size() < 5) { sendResponse("-ERR XCLAIM requires key, group, consumer, min-idle-time and IDs\r\n"); return; }
+    const std::string& key = tokens[0];
+    const std::string& group_name = tokens[1];
+    const std::string& consumer = tokens[2];
+
+    long long min_idle = 0;
+    if (!parseInt(tokens[3], min_idle)) { sendResponse("-ERR Invalid min-idle-time argument for XCLAIM\r\n"); return; }
 
-        all_results = collect();
+    // IDs come first; the first token that is not an ID starts the options.
+    std::vector<StreamId> ids;
+    size_t idx = 4;
+    for (; idx < tokens.size(); ++idx) {
+        auto id = StreamId::parse(tokens[idx], 0);
+        if (!id) break;
+        ids.push_back(*id);
     }
 
-    std::vector<std::string> stream_parts;
-    for (size_t i = 0; i < keys.size(); ++i) {
-        auto &results = all_results[i];
-        if (results.empty()) continue;
-
-        std::string part;
-        part += "*2\r\n"; 
-        part += "$" + std::to_string(keys[i].size()) + "\r\n" + keys[i] + "\r\n";
-        part += "*" + std::to_string(results.size()) + "\r\n";
-
-        for (auto &entry : results) {
-            part += "*2\r\n"; 
-            part += "$" + std::to_string(entry.first.size()) + "\r\n" + entry.first + "\r\n";
-            part += "*" + std::to_string(entry.second.size() * 2) + "\r\n";
-            for (auto &kv : entry.second) {
-                part += "$" + std::to_string(kv.first.size()) + "\r\n" + kv.first + "\r\n";
-                part += "$" + std::to_string(kv.second.size()) + "\r\n" + kv.second + "\r\n";
+    int64_t now = getCurrentTimeMs();
+    int64_t delivery_time = now;
+    std::optional<long long> retry_count;
+    std::optional<StreamId> last_id;
+    bool force = false, justid = false;
+    for (; idx < tokens.size(); ++idx) {
+        std::string option = upper(tokens[idx]);
+        long long n = 0;
+        if ((option == "IDLE" || option == "TIME" || option == "RETRYCOUNT") && idx + 1 < tokens.size()) {
+            if (!parseInt(tokens[++idx], n)) { sendResponse("-ERR value is not an integer or out of range\r\n"); return; }
+            if (option == "IDLE") delivery_time = now - n;
+            else if (option == "TIME") delivery_time = n;
+            else retry_count = n;
+        } else if (option == "LASTID" && idx + 1 < tokens.size()) {
+            last_id = StreamId::parse(tokens[++idx], 0);
+            if (!last_id) { sendResponse("-ERR Invalid stream ID specified as stream command argument\r\n"); return; }
+        } else if (option == "FORCE") {
+            force = true;
+        } else if (option == "JUSTID") {
+            justid = true;
+        } else {
+            sendResponse("-ERR Unrecognized XCLAIM option '" + tokens[idx] + "'\r\n");
+            return;
+        }
+    }
+
+    std::string reply(ARRAY_HEADER_ROOM, '\0');
+    size_t count = 0;
+    {
+        StoreLock lock(store_mutex);
+        ConsumerGroup* group = findGroup(key, group_name);
+        if (!group) { sendResponse(noGroupError(key, group_name)); return; }
+        Stream& stream = stream_store[key];
+
+        // The idle-time checks depend on when this runs, so what it did is logged instead.
+        std::vector<Propagation::Command> effects;
+        if (last_id && *last_id > group->last_delivered) {
+            group->last_delivered = *last_id;
+            effects.push_back({"XGROUP", "SETID", key, group_name, last_id->toString()});
+        }
+
+        for (StreamId id : ids) {
+            auto pending = group->pel.find(id);
+            bool exists = stream.contains(id);
+            if (pending == group->pel.end()) {
+                if (!force || !exists) continue;
+            } else if (!exists) {
+                // The entry was deleted from the stream, so it can never be processed.
+                group->ack(id);
+                effects.push_back({"XACK", key, group_name, id.toString()});
+                continue;
+            } else if (now - pending->second.delivery_time < min_idle) {
+                continue;
             }
+
+            PendingEntry& entry = group->assign(id, consumer, now);
+            entry.delivery_time = delivery_time;
+            if (retry_count) entry.delivery_count = *retry_count;
+            else if (!justid) entry.delivery_count++;
+            effects.push_back(claimEffect(key, group_name, consumer, id, entry));
+
+            if (justid) appendIdBulk(reply, id);
+            else appendStoredEntry(reply, stream, id);
+            count++;
         }
-        stream_parts.push_back(part);
+        Propagation::replace(std::move(effects));
     }
+    sendResponse(finishArray(reply, count));
+}
 
-    std::string response;
-    if (stream_parts.empty()) {
-        response = "*-1\r\n"; 
-    } else {
-        response = "*" + std::to_string(stream_parts.size()) + "\r\n";
-        for (auto &p : stream_parts) response += p;
+void StreamStoreHandler::handleXautoclaim(const std::vector<std::string>& tokens) {
+    if (tokens.size() < 5) { sendResponse("-ERR XAUTOCLAIM requires key, group, consumer, min-idle-time and start\r\n"); return; }
+    const std::string& key = tokens[0];
+    const std::string& group_name = tokens[1];
+    const std::string& consumer = tokens[2];
+
+    long long min_idle = 0;
+    if (!parseInt(tokens[3], min_idle)) { sendResponse("-ERR Invalid min-idle-time argument for XAUTOCLAIM\r\n"); return; }
+    bool emptyRange = false;
+    auto start = parseRangeBound(tokens[4], true, emptyRange);
+    if (!start) { sendResponse("-ERR Invalid stream ID specified as stream command argument\r\n"); return; }
+
+    long long limit = 100;
+    bool justid = false;
+    for (size_t idx = 5; idx < tokens.size(); ++idx) {
+        std::string option = upper(tokens[idx]);
+        if (option == "COUNT" && idx + 1 < tokens.size()) {
+            if (!parseInt(tokens[++idx], limit)) { sendResponse("-ERR value is not an integer or out of range\r\n"); return; }
+            if (limit < 1) { sendResponse("-ERR COUNT must be > 0\r\n"); return; }
+        } else if (option == "JUSTID") {
+            justid = true;
+        } else {
+            sendResponse("-ERR syntax error\r\n");
+            return;
+        }
     }
 
-    lock.unlock(); 
-    sendResponse(response);
+    std::string claimed, deleted;
+    size_t claimed_count = 0, deleted_count = 0;
+    StreamId cursor;
+    {
+        StoreLock lock(store_mutex);
+        ConsumerGroup* group = findGroup(key, group_name);
+        if (!group) { sendResponse(noGroupError(key, group_name)); return; }
+        Stream& stream = stream_store[key];
+        int64_t now = getCurrentTimeMs();
+
+        std::vector<Propagation::Command> effects;
+        // As in Redis, at most ten PEL entries are examined per requested claim.
+        long long attempts = limit * 10;
+        auto it = emptyRange ? group->pel.end() : group->pel.lower_bound(*start);
+        while (it != group->pel.end() && static_cast<long long>(claimed_count) < limit && attempts-- > 0) {
+            StreamId id = it->first;
+            int64_t idle = now - it->second.delivery_time;
+            ++it;
+            if (idle < min_idle) continue;
+
+            if (!stream.contains(id)) {
+                group->ack(id);
+                effects.push_back({"XACK", key, group_name, id.toString()});
+                appendIdBulk(deleted, id);
+                deleted_count++;
+                continue;
+            }
+
+            PendingEntry& entry = group->assign(id, consumer, now);
+            if (!justid) entry.delivery_count++;
+            effects.push_back(claimEffect(key, group_name, consumer, id, entry));
+            if (justid) appendIdBulk(claimed, id);
+            else appendStoredEntry(claimed, stream, id);
+            claimed_count++;
+        }
+        if (it != group->pel.end()) cursor = it->first;
+        Propagation::replace(std::move(effects));
+    }
+
+    std::string reply = "*3\r\n";
+    appendIdBulk(reply, cursor);
+    reply += "*" + std::to_string(claimed_count) + "\r\n" + claimed;
+    reply += "*" + std::to_string(deleted_count) + "\r\n" + deleted;
+    sendResponse(reply);
+}
+
+// Stream IDs inside RDB files are 16 raw bytes, big-endian ms then seq.
+static std::string rawStreamId(StreamId id) {
+    std::string raw(16, '\0');
+    for (int i = 0; i < 8; ++i) {
+        raw[7 - i] = static_cast<char>((id.ms >> (8 * i)) & 0xFF);
+        raw[15 - i] = static_cast<char>((id.seq >> (8 * i)) & 0xFF);
+    }
+    return raw;
+}
+
+// One stream node in the Redis listpack layout: a master entry with the entry count, the
+// deleted count and the master field names, then per entry its flags, ID deltas from the
+// master ID, fields or values, and the number of listpack elements it took.
+static std::string packStreamNode(StreamId master, const std::vector<std::pair<StreamId, std::vector<std::pair<std::string, std::string>>>>& entries) {
+    static constexpr int64_t FLAG_SAME_FIELDS = 2;
+
+    const auto& master_fields = entries.front().second;
+    ListpackWriter lp;
+    lp.appendInteger(static_cast<int64_t>(entries.size()));
+    lp.appendInteger(0);
+    lp.appendInteger(static_cast<int64_t>(master_fields.size()));
+    for (const auto& field : master_fields) lp.appendString(field.first);
+    lp.appendInteger(0);
+
+    for (const auto& [id, fields] : entries) {
+        bool same = fields.size() == master_fields.size() &&
+                    std::equal(fields.begin(), fields.end(), master_fields.begin(), [](const auto& a, const auto& b) { return a.first == b.first; });
+        int64_t n = static_cast<int64_t>(fields.size());
+        lp.appendInteger(same ? FLAG_SAME_FIELDS : 0);
+        lp.appendInteger(static_cast<int64_t>(id.ms - master.ms));
+        lp.appendInteger(static_cast<int64_t>(id.seq - master.seq));
+        if (!same) lp.appendInteger(n);
+        for (const auto& [field, value] : fields) {
+            if (!same) lp.appendString(field);
+            lp.appendString(value);
+        }
+        lp.appendInteger(same ? n + 3 : 2 * n + 4);
+    }
+    return lp.finish();
+}
+
+void StreamStoreHandler::saveTo(RdbWriter& out) {
+    for (auto& [key, stream] : stream_store) {
+        // Live entries are re-packed into nodes of the same size limits as ours.
+        std::vector<std::pair<std::string, std::string>> nodes;
+        std::vector<std::pair<StreamId, std::vector<std::pair<std::string, std::string>>>> pending;
+        size_t pending_bytes = 0;
+        StreamId first_id;
+        auto flushNode = [&]() {
+            if (pending.empty()) return;
+            nodes.emplace_back(rawStreamId(pending.front().first), packStreamNode(pending.front().first, pending));
+            pending.clear();
+            pending_bytes = 0;
+        };
+        stream.range(StreamId::min(), StreamId::max(), [&](const StreamEntry& entry) {
+            if (nodes.empty() && pending.empty()) first_id = entry.id;
+            std::vector<std::pair<std::string, std::string>> fields;
+            for (const auto& [field, value] : entry.fields) {
+                fields.emplace_back(field, value);
+                pending_bytes += field.size() + value.size();
+            }
+            pending.emplace_back(entry.id, std::move(fields));
+            if (pending.size() >= Stream::NODE_MAX_ENTRIES || pending_bytes >= Stream::NODE_MAX_BYTES) flushNode();
+            return true;
+        });
+        flushNode();
+
+        out.writeKey(RdbWriter::TYPE_STREAM_LISTPACKS_3, key);
+        out.writeLength(nodes.size());
+        for (const auto& [master, lp] : nodes) {
+            out.writeString(master);
+            out.writeString(lp);
+        }
+        out.writeLength(stream.size());
+        out.writeLength(stream.lastId().ms);
+        out.writeLength(stream.lastId().seq);
+        out.writeLength(first_id.ms);
+        out.writeLength(first_id.seq);
+        out.writeLength(stream.maxDeletedId().ms);
+        out.writeLength(stream.maxDeletedId().seq);
+        out.writeLength(stream.entriesAdded());
+
+        out.writeLength(stream.groups().size());
+        for (const auto& [name, group] : stream.groups()) {
+            size_t entries_read = 0;
+            stream.range(StreamId::min(), group.last_delivered, [&](const StreamEntry&) {
+                entries_read++;
+                return true;
+            });
+            out.writeString(name);
+            out.writeLength(group.last_delivered.ms);
+            out.writeLength(group.last_delivered.seq);
+            out.writeLength(entries_read);
+
+            out.writeLength(group.pel.size());
+            for (const auto& [id, pending_entry] : group.pel) {
+                out.writeRaw(rawStreamId(id));
+                out.writeMillis(pending_entry.delivery_time);
+                out.writeLength(pending_entry.delivery_count);
+            }
+            out.writeLength(group.consumers.size());
+            for (const auto& [consumer_name, consumer] : group.consumers) {
+                out.writeString(consumer_name);
+                out.writeMillis(consumer.seen_time);
+                out.writeMillis(consumer.seen_time);
+                out.writeLength(consumer.pending.size());
+                for (StreamId id : consumer.pending) out.writeRaw(rawStreamId(id));
+            }
+        }
+    }
+}
+
+void StreamStoreHandler::loadNode(Stream& stream, StreamId master, std::string_view listpack) {
+    static constexpr int64_t FLAG_DELETED = 1;
+    static constexpr int64_t FLAG_SAME_FIELDS = 2;
+
+    ListpackReader lp(listpack);
+    ListpackReader::Element element;
+    auto nextText = [&]() {
+        if (!lp.next(element)) throw std::runtime_error("Truncated stream node");
+        return element.text();
+    };
+
+    int64_t count = lp.nextInteger();
+    int64_t deleted = lp.nextInteger();
+    int64_t master_count = lp.nextInteger();
+    std::vector<std::string> master_fields;
+    for (int64_t i = 0; i < master_count; ++i) master_fields.push_back(nextText());
+    lp.nextInteger();
+
+    for (int64_t i = 0; i < count + deleted; ++i) {
+        int64_t flags = lp.nextInteger();
+        StreamId id{master.ms + static_cast<uint64_t>(lp.nextInteger()), master.seq + static_cast<uint64_t>(lp.nextInteger())};
+        std::vector<std::pair<std::string, std::string>> fields;
+        if (flags & FLAG_SAME_FIELDS) {
+            for (const auto& field : master_fields) fields.emplace_back(field, nextText());
+        } else {
+            int64_t n = lp.nextInteger();
+            for (int64_t k = 0; k < n; ++k) {
+                std::string field = nextText();
+                fields.emplace_back(std::move(field), nextText());
+            }
+        }
+        lp.nextInteger();
+        if (flags & FLAG_DELETED) continue;
+        if (!stream.empty() && id <= stream.lastId()) throw std::runtime_error("Stream entries out of order");
+        stream.append(id, std::move(fields));
+    }
+}
+
+size_t StreamStoreHandler::restore(std::vector<std::pair<std::string, Stream>>& batch) {
+    StoreLock lock(store_mutex);
+    for (auto& [key, stream] : batch) stream_store[std::move(key)] = std::move(stream);
+    return batch.size();
 }
 
 bool StreamStoreHandler::hasKey(const std::string& key) {
-    std::lock_guard<std::mutex> lock(store_mutex);
+    StoreLock lock(store_mutex);
     auto it = stream_store.find(key);
     if (it != stream_store.end()) {
         return true;
@@ -307,6 +1149,6 @@ bool StreamStoreHandler::hasKey(const std::string& key) {
     return false;
 }
 
-void StreamStoreHandler::sendResponse(const std::string& response) {
-    send(client_fd, response.c_str(), response.size(), 0);
-}
\ No newline at end of file
+void StreamStoreHandler::sendResponse(std::string_view response) {
+    ClientOutput::send(client_fd, response);
+}